@@ -14,6 +14,9 @@ parser.add_option ("--stop", dest = "mode",
 parser.add_option ("--restart", dest = "mode",
                    action = "store_const", const = "restart",
                    help = "restart the raid")
+parser.add_option ("--assemble", dest = "mode",
+                   action = "store_const", const = "assemble",
+                   help = "assemble a created raid from its members")
 parser.add_option ("--decode", dest = "mode",
                    action = "store_const", const = "decode",
                    help = "serves kernel decoding requests")
@@ -38,11 +41,17 @@ parser.add_option ("-m", "--redundant-resources", dest = "redundant_resources",
                    help = "the number of redundant resources")
 parser.add_option ("-M", "--polynomial", dest = "polynomial", default = 0,
                    help = "modular polynomial")
+parser.add_option ("-i", "--interleaved", dest = "interleaved",
+                   action = "store_true", default = False,
+                   help = "interleaves the units of a resource on its device")
 parser.set_usage ("""Usage: conf.py [options]
 
 Constructs a shell script from the specification on stdin or otherwise
 just executes the actions needed to perform the mode change on the raid.
 
+A raid which was started once keeps its layout on the members, so
+--assemble only needs the devices from the specification.
+
 The format for the specification is as follows:
 
   RAID_DESCR device, chunk_size
@@ -53,6 +62,8 @@ The format for the specification is as follows:
   UNITS u0, u1, ..., un
   UNIT_DESCR u0, /dev/bar
 
+  SPARES /dev/baz, ...
+
   REDUNDANCY destunit = XOR(u4, u2, ..., un)
 
   TEMPORARY tempunit = XOR(u3, u2, ..., un)
@@ -63,11 +74,12 @@ and additionally for decoding equations
 
 (opts, args) = parser.parse_args ()
 
-global raid_device, chunk_size, resources, units
+global raid_device, chunk_size, resources, units, spares
 raid_device = None
 chunk_size = 0
 resources = []
 units = []
+spares = []
 
 class resource ():
     def __init__ (self, name, device = None, units = [], faulty = False):
@@ -218,6 +230,15 @@ def handle_unit_desc (line, match):
         sys.stderr.write ("overwriting description for %s\n" % unit.name)
     unit.device = device
 
+@match(re.compile ("^SPARES\s+(.*[^\s].*)$"))
+def handle_spares (line, match):
+    global spares
+
+    if spares:
+        sys.stderr.write ("overwriting spares\n")
+    spares = [dev.strip () for dev in match.groups ()[0].split (",")
+              if dev.strip () != ""]
+
 @match(re.compile ("^REDUNDANCY\s+(\w+)\s*=\s*XOR\s*\(([^\)]*)\)"))
 def handle_red (line, match):
     global units
@@ -255,6 +276,7 @@ matchers = [
     handle_res_desc,
     handle_units,
     handle_unit_desc,
+    handle_spares,
     handle_red,
     handle_temp,
 ]
@@ -366,6 +388,12 @@ def unit_compare_encoding (a, b):
         except:
             return 0
 
+def unit_index (u):
+    """Returns the index of the unit inside the kernel module."""
+    if opts.interleaved:
+        return resources.index (u.resource) + u.resource.units.index (u) * len (resources)
+    return filter (lambda x: isinstance(x, unit), units).index (u)
+
 def generate_encoding_shell_script (out):
     global units
 
@@ -379,7 +407,7 @@ def generate_encoding_shell_script (out):
         out.write("""\\0%s\\02\\0%s""" % (oct (i), oct (len (temps[i].encoding))))
         for u in temps[i].encoding:
             if isinstance (u, unit):
-                out.write ("""\\00\\0%s""" % (oct (tmpunits.index (u))))
+                out.write ("""\\00\\0%s""" % (oct (unit_index (u))))
             else:
                 out.write ("""\\01\\0%s""" % (oct (temps.index (u))))
         out.write ("' > tmp && cat tmp > /sys/block/%s/md/encoding\n" % (block_name (raid_device)))
@@ -388,12 +416,12 @@ def generate_encoding_shell_script (out):
         print tmpunits[i]
         out.write ("""echo -en '\\0%s""" % (oct (len (temps))))
         if not tmpunits[i].redundant:
-            out.write ("""\\0%s\\00""" % (oct (i)))
+            out.write ("""\\0%s\\00""" % (oct (unit_index (tmpunits[i]))))
         else:
-            out.write ("""\\0%s\\01\\0%s""" % (oct (i), oct (len (tmpunits[i].encoding))))
+            out.write ("""\\0%s\\01\\0%s""" % (oct (unit_index (tmpunits[i])), oct (len (tmpunits[i].encoding))))
             for u in tmpunits[i].encoding:
                 if isinstance (u, unit):
-                    out.write ("""\\00\\0%s""" % (oct (tmpunits.index (u))))
+                    out.write ("""\\00\\0%s""" % (oct (unit_index (u))))
                 else:
                     out.write ("""\\01\\0%s""" % (oct (temps.index (u))))
         out.write ("' > tmp && cat tmp > /sys/block/%s/md/encoding\n" % (block_name (raid_device)))
@@ -410,7 +438,7 @@ def generate_decoding_shell_script (out):
         out.write ("""echo -en '\\0%s\\0%s\\01\\0%s""" % (oct (len (temps)), oct (i), oct (len (temps[i].encoding))))
         for u in temps[i].encoding:
             if isinstance (u, unit):
-                out.write ("""\\00\\0%s""" % (oct (tmpunits.index (u))))
+                out.write ("""\\00\\0%s""" % (oct (unit_index (u))))
             else:
                 out.write ("""\\01\\0%s""" % (oct (temps.index (u))))
         out.write ("' > tmp && cat tmp > /sys/block/%s/md/decoding\n" % (block_name (raid_device)))
@@ -419,10 +447,10 @@ def generate_decoding_shell_script (out):
         if tmpunits[i].redundant or not tmpunits[i].faulty:
             continue
         print tmpunits[i]
-        out.write ("""echo -en '\\0%s\\0%s\\00\\0%s""" % (oct (len (temps)), oct (i), oct (len (tmpunits[i].decoding))))
+        out.write ("""echo -en '\\0%s\\0%s\\00\\0%s""" % (oct (len (temps)), oct (unit_index (tmpunits[i])), oct (len (tmpunits[i].decoding))))
         for u in tmpunits[i].decoding:
             if isinstance (u, unit):
-                out.write ("""\\00\\0%s""" % (oct (tmpunits.index (u))))
+                out.write ("""\\00\\0%s""" % (oct (unit_index (u))))
             else:
                 out.write ("""\\01\\0%s""" % (oct (temps.index (u))))
         out.write ("' > tmp && cat tmp > /sys/block/%s/md/decoding\n" % (block_name (raid_device)))
@@ -443,9 +471,19 @@ $MDADM --manage %s -S
 
 def generate_start_shell_script (out):
     units_formatted = ""
-    tmpunits = filter (lambda x: isinstance(x, unit), units)
-    for u in tmpunits:
-        units_formatted += " " + u.device
+    if opts.interleaved:
+        members = [res.device for res in resources]
+        units_per_member = len (resources[0].units)
+    else:
+        members = [u.device for u in filter (lambda x: isinstance(x, unit), units)]
+        units_per_member = 1
+    for device in members:
+        units_formatted += " " + device
+    # md puts a spare into a failed unit's place and rebuilds it
+    if spares:
+        units_formatted += " \\\n\t--spare-devices=%s" % len (spares)
+        for dev in spares:
+            units_formatted += " " + dev
     out.write (
 """#!/bin/sh
 
@@ -456,11 +494,17 @@ then
 	echo "tmp file exists, aborting"
 fi
 
+echo %s > /sys/module/raidxor/parameters/units_per_member
+
 $MDADM -v -v --create %s -R -c %s --level=xor \\
 	--raid-devices=%s%s
 if [[ ! $? -eq 0 ]]; then exit; fi
 
-""" % (opts.mdadm, raid_device, chunk_size / 1024, len (tmpunits), units_formatted))
+# a new array, so the end of its members is free for the layout
+echo 1 > /sys/block/%s/md/store_layout
+
+""" % (opts.mdadm, units_per_member, raid_device, chunk_size / 1024, len (members), units_formatted,
+       block_name (raid_device)))
     generate_encoding_shell_script (out)
     out.write (
 """
@@ -469,13 +513,35 @@ echo %s > /sys/block/%s/md/units_per_resource
 rm tmp
 """ % (len (resources[0].units), block_name (raid_device)))
 
+def generate_assemble_shell_script (out):
+    units_formatted = ""
+    if opts.interleaved:
+        members = [res.device for res in resources]
+    else:
+        members = [u.device for u in filter (lambda x: isinstance(x, unit), units)]
+    for device in members + spares:
+        units_formatted += " " + device
+    out.write (
+"""#!/bin/sh
+
+MDADM=%s
+
+# the layout, including the units per member, is read back from the
+# members
+$MDADM -v -v --assemble %s -R%s
+""" % (opts.mdadm, raid_device, units_formatted))
+
 def parse_faulty ():
     global units
 
     tmp = filter (lambda x: isinstance(x, unit), units)
 
     for u in tmp:
-	path = "/sys/block/%s/md/dev-%s/state" % (block_name (raid_device), u.mdname ())
+	if opts.interleaved:
+	    member = block_name (u.resource.device)
+	else:
+	    member = u.mdname ()
+	path = "/sys/block/%s/md/dev-%s/state" % (block_name (raid_device), member)
 	for line in fileinput.input (path):
             u.faulty = (line.find("faulty") >= 0)
             if u.faulty:
@@ -529,6 +595,8 @@ if opts.mode == "stop" or opts.mode == "restart":
     [generate_stop_shell_script (file) for file in files]
 if opts.mode == "start" or opts.mode == "restart":
     [generate_start_shell_script (file) for file in files]
+if opts.mode == "assemble":
+    [generate_assemble_shell_script (file) for file in files]
 if opts.mode == "decode":
     print "cauchyrs executable at %s" % opts.cauchyrs
     parse_faulty ()
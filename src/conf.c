@@ -1,5 +1,27 @@
 /* -*- mode: c; coding: utf-8; c-file-style: "K&R"; tab-width: 8; indent-tabs-mode: t; -*- */
 
+/**
+ * raidxor_cache_matches() - checks if the cache fits the current layout
+ *
+ * The cache can be kept over a reconfiguration as long as the number
+ * of data and redundant units and the number of lines stay the same.
+ */
+static unsigned int raidxor_cache_matches(raidxor_conf_t *conf)
+{
+	unsigned int i, n_data_units = 0;
+
+	if (!conf->cache)
+		return 0;
+
+	for (i = 0; i < conf->n_units; ++i)
+		if (conf->units[i].redundant == 0)
+			++n_data_units;
+
+	return conf->cache->n_lines == conf->n_cache_lines &&
+		conf->cache->n_buffers == n_data_units &&
+		conf->cache->n_red_buffers == conf->n_units - n_data_units;
+}
+
 /**
  * raidxor_try_configure_raid() - configures the raid
  *
@@ -26,6 +48,14 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 		goto out;
 	}
 
+	if (conf->units_per_member > 1 &&
+	    conf->units_per_resource != conf->units_per_member) {
+		printk(KERN_INFO "raidxor: interleaved units need one member "
+		       "per resource: %u != %u\n",
+		       conf->units_per_resource, conf->units_per_member);
+		goto out;
+	}
+
 	if (conf->n_units % conf->units_per_resource != 0) {
 		printk(KERN_INFO
 		       "raidxor: parameters don't match %u %% %u != 0\n",
@@ -39,7 +69,9 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 		if (conf->units[i].redundant == -1) {
 			printk(KERN_INFO
 			       "raidxor: unit %u, %s is not initialized\n",
-			       i, bdevname(conf->units[i].rdev->bdev, buffer));
+			       i, conf->units[i].rdev ?
+			       bdevname(conf->units[i].rdev->bdev, buffer) :
+			       "missing");
 			goto out;
 		}
 
@@ -47,6 +79,15 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 			++conf->n_data_units;
 	}
 
+	/* data buffers come first in a line, in unit order, followed by
+	   the redundant ones */
+	for (i = 0, j = 0; i < conf->n_units; ++i)
+		if (!conf->units[i].redundant)
+			conf->units[i].buffer = j++;
+	for (i = 0; i < conf->n_units; ++i)
+		if (conf->units[i].redundant)
+			conf->units[i].buffer = j++;
+
 	printk(KERN_INFO "raidxor: got enough information, building raid\n");
 
 	conf->n_resources = conf->n_units / conf->units_per_resource;
@@ -75,16 +116,28 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 	}
 
 
-	/* allocate the cache with a default of 10 lines;
-	   TODO: could be a driver option, or allow for shrinking/growing ... */
+	/* a cache kept over a reconfiguration is idle, see
+	   raidxor_quiesce(), but with a new layout its contents are
+	   meaningless */
+	if (conf->cache && !raidxor_cache_matches(conf)) {
+		raidxor_cache_fail_parked(conf);
+		raidxor_free_cache(conf->cache);
+		conf->cache = NULL;
+	}
+
+	/* allocate the cache with n_cache_lines lines, see the cache_lines
+	   attribute for resizing it */
 	/* one chunk is CHUNK_SIZE / PAGE_SIZE pages long, eqv. >> PAGE_SHIFT */
-	conf->cache = raidxor_alloc_cache(number_of_cache_lines,
-					  conf->n_data_units,
-					  conf->n_units - conf->n_data_units,
-					  conf->chunk_size >> PAGE_SHIFT);
-	if (!conf->cache)
-		goto out_free_resources;
-	conf->cache->conf = conf;
+	if (!conf->cache) {
+		conf->cache = raidxor_alloc_cache(conf->n_cache_lines,
+						  conf->n_data_units,
+						  conf->n_units - conf->n_data_units,
+						  conf->chunk_size >> PAGE_SHIFT,
+						  conf->n_workers);
+		if (!conf->cache)
+			goto out_free_resources;
+		conf->cache->conf = conf;
+	}
 
 	/* now a request is between 4096 and N_DATA_UNITS * CHUNK_SIZE bytes long */
 	printk(KERN_INFO "and max sectors to %lu\n",
@@ -94,17 +147,22 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 	blk_queue_segment_boundary(mddev->queue,
 				   (conf->chunk_size >> 1) *
 				   conf->n_data_units - 1);
+#ifdef QUEUE_FLAG_DISCARD
+	/* whole strips are forwarded, see raidxor_handle_discard() */
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, mddev->queue);
+#endif
 
 	printk(KERN_INFO "setting device size\n");
 
 	/* since all stripes are equally long */
-	mddev->array_sectors = conf->n_data_units * mddev->size * 2;
+	mddev->array_sectors = conf->n_data_units *
+		(mddev->size / conf->units_per_member) * 2;
 	set_capacity(mddev->gendisk, mddev->array_sectors);
 
 	printk (KERN_INFO "raidxor: array_sectors is %u * %llu= "
 		"%llu blocks, %llu sectors\n",
 		(unsigned int) conf->n_data_units,
-		(unsigned long long) mddev->size * 2,
+		(unsigned long long) (mddev->size / conf->units_per_member) * 2,
 		(unsigned long long) mddev->array_sectors,
 		(unsigned long long) mddev->array_sectors / 2);
 
@@ -112,6 +170,28 @@ static void raidxor_try_configure_raid(raidxor_conf_t *conf) {
 
 	WITHLOCKCONF(conf, flags, {
 	clear_bit(CONF_INCOMPLETE, &conf->flags);
+
+	/* the records of the log don't fit the new layout */
+	if (conf->log && !conf->log->failed &&
+	    (conf->log->record_pages != 1 + conf->cache->n_buffers *
+	     conf->cache->n_chunk_mult ||
+	     conf->log->n_slots < 2 * conf->cache->n_lines)) {
+		printk(KERN_WARNING "raidxor: log device doesn't fit the "
+		       "layout anymore, writing back without it\n");
+		conf->log->failed = 1;
+	}
+
+	/* assembled degraded, without decodings supplied */
+	for (i = 0; i < conf->n_units; ++i)
+		if (!conf->units[i].redundant &&
+		    !conf->units[i].decoding &&
+		    !raidxor_unit_readable(&conf->units[i]))
+			break;
+
+	if (i < conf->n_units)
+		raidxor_schedule_derive(conf);
+
+	raidxor_super_schedule(conf);
 	});
 
 	return;
@@ -150,13 +230,74 @@ raidxor_store_units_per_resource(mddev_t *mddev, const char *page, size_t len)
 	if (new == 0)
 		return -EINVAL;
 
+	/* only the resources are rebuilt, the cache stays */
+	raidxor_quiesce(mddev, 1);
+
 	WITHLOCKCONF(conf, flags, {
-	raidxor_safe_free_conf(conf);
+	raidxor_safe_free_resources(conf);
 	conf->units_per_resource = new;
 	});
 
 	raidxor_try_configure_raid(conf);
 
+	raidxor_quiesce(mddev, 0);
+
+	return len;
+}
+
+static ssize_t
+raidxor_show_cache_lines(mddev_t *mddev, char *page)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+
+	if (conf)
+		return sprintf(page, "%u\n", conf->n_cache_lines);
+	else
+		return -ENODEV;
+}
+
+/**
+ * raidxor_store_cache_lines() - resizes the cache
+ *
+ * Dirty lines are written back, then the cache is replaced while the
+ * array is quiesced.
+ */
+static ssize_t
+raidxor_store_cache_lines(mddev_t *mddev, const char *page, size_t len)
+{
+	unsigned long new, flags = 0;
+	unsigned int reconfigure = 0;
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new) || new == 0)
+		return -EINVAL;
+
+	raidxor_quiesce(mddev, 1);
+
+	/* parked lines count as idle, but don't survive the cache */
+	if (conf->cache && conf->cache->n_lines != new)
+		raidxor_cache_fail_parked(conf);
+
+	WITHLOCKCONF(conf, flags, {
+	conf->n_cache_lines = new;
+
+	if (conf->cache && conf->cache->n_lines != new) {
+		raidxor_wait_for_writeback(conf, &flags);
+		raidxor_safe_free_conf(conf);
+		reconfigure = 1;
+	}
+	});
+
+	if (reconfigure)
+		raidxor_try_configure_raid(conf);
+
+	raidxor_quiesce(mddev, 0);
+
 	return len;
 }
 
@@ -167,7 +308,7 @@ raidxor_show_decoding(mddev_t *mddev, char *page)
 }
 
 static ssize_t
-raidxor_store_decoding(mddev_t *mddev, const char *page, size_t len)
+raidxor_parse_decoding(mddev_t *mddev, const char *page, size_t len)
 {
 	unsigned char length, i, red, ntemps, temp;
 	decoding_t *decoding;
@@ -262,6 +403,35 @@ out:
 	return -EINVAL;
 }
 
+/**
+ * raidxor_store_decoding() - replaces decoding equations
+ *
+ * The array is quiesced, since the temporaries of all lines may be
+ * reallocated.
+ */
+static ssize_t
+raidxor_store_decoding(mddev_t *mddev, const char *page, size_t len)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	unsigned long flags = 0;
+	ssize_t result;
+
+	if (!conf)
+		return -ENODEV;
+
+	raidxor_quiesce(mddev, 1);
+	result = raidxor_parse_decoding(mddev, page, len);
+	raidxor_quiesce(mddev, 0);
+
+	if (result >= 0) {
+		WITHLOCKCONF(conf, flags, {
+		raidxor_super_schedule(conf);
+		});
+	}
+
+	return result;
+}
+
 static ssize_t
 raidxor_show_encoding(mddev_t *mddev, char *page)
 {
@@ -269,7 +439,7 @@ raidxor_show_encoding(mddev_t *mddev, char *page)
 }
 
 static ssize_t
-raidxor_store_encoding(mddev_t *mddev, const char *page, size_t len)
+raidxor_parse_encoding(mddev_t *mddev, const char *page, size_t len)
 {
 	raidxor_conf_t *conf = mddev_to_conf(mddev);
 	unsigned char index, redundant, length, i, red, ntemps, temp;
@@ -379,11 +549,224 @@ out:
 	return -EINVAL;
 }
 
+/**
+ * raidxor_store_encoding() - replaces encoding equations
+ *
+ * Like raidxor_store_decoding(), runs with the array quiesced.
+ */
+static ssize_t
+raidxor_store_encoding(mddev_t *mddev, const char *page, size_t len)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	unsigned long flags = 0;
+	ssize_t result;
+
+	if (!conf)
+		return -ENODEV;
+
+	raidxor_quiesce(mddev, 1);
+	result = raidxor_parse_encoding(mddev, page, len);
+	raidxor_quiesce(mddev, 0);
+
+	if (result >= 0) {
+		WITHLOCKCONF(conf, flags, {
+		raidxor_super_schedule(conf);
+		});
+	}
+
+	return result;
+}
+
+/**
+ * raidxor_show_numa_placement() - reports lines, pages and workers per node
+ *
+ * One line per node with lines, reserved and free pages, e.g.
+ * "node 0: 5 lines, 640 pages (320 free), workers 0 2".
+ */
+static ssize_t
+raidxor_show_numa_placement(mddev_t *mddev, char *page)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	cache_t *cache;
+	unsigned long flags = 0;
+	unsigned int i, n_lines;
+	ssize_t result = 0;
+	int node;
+
+	if (!conf)
+		return -ENODEV;
+
+	WITHLOCKCONF(conf, flags, {
+	cache = conf->cache;
+
+	for_each_online_node(node) {
+		for (i = 0, n_lines = 0; cache && i < cache->n_lines; ++i)
+			if (cache->lines[i]->node == node)
+				++n_lines;
+
+		result += snprintf(page + result, PAGE_SIZE - result,
+				   "node %d: %u lines, %u pages (%u free), workers",
+				   node, n_lines,
+				   cache ? cache->pools[node].n_pages : 0,
+				   cache ? cache->pools[node].n_free_pages : 0);
+
+		for (i = 0; i < conf->n_workers; ++i)
+			if (conf->workers[i].node == node)
+				result += snprintf(page + result,
+						   PAGE_SIZE - result, " %u", i);
+
+		result += snprintf(page + result, PAGE_SIZE - result, "\n");
+	}
+	});
+
+	return result;
+}
+
+static ssize_t
+raidxor_show_log(mddev_t *mddev, char *page)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	char buffer[BDEVNAME_SIZE];
+	unsigned long flags = 0;
+	ssize_t result;
+
+	if (!conf)
+		return -ENODEV;
+
+	WITHLOCKCONF(conf, flags, {
+	if (conf->log)
+		result = sprintf(page, "%s%s\n",
+				 bdevname(conf->log->bdev, buffer),
+				 conf->log->failed ? " failed" : "");
+	else
+		result = sprintf(page, "none\n");
+	});
+
+	return result;
+}
+
+/**
+ * raidxor_store_log() - attaches or detaches the log device
+ *
+ * Takes the path of a block device, or "none" to write everything
+ * back and stop using the log.  Runs with the array quiesced.
+ */
+static ssize_t
+raidxor_store_log(mddev_t *mddev, const char *page, size_t len)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	char path[BDEVNAME_SIZE + 32];
+	size_t n = len;
+	unsigned long flags = 0;
+	int err = 0;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (n > 0 && page[n - 1] == '\n')
+		--n;
+	if (n == 0 || n >= sizeof(path))
+		return -EINVAL;
+
+	memcpy(path, page, n);
+	path[n] = '\0';
+
+	raidxor_quiesce(mddev, 1);
+
+	if (test_bit(CONF_INCOMPLETE, &conf->flags) || !conf->cache)
+		err = -EBUSY;
+	else if (!strcmp(path, "none"))
+		raidxor_log_detach(conf);
+	else
+		err = raidxor_log_attach(conf, path);
+
+	raidxor_quiesce(mddev, 0);
+
+	/* the layout names the log, so assembling replays it */
+	if (!err) {
+		WITHLOCKCONF(conf, flags, {
+		raidxor_super_schedule(conf);
+		});
+	}
+
+	return err ? err : len;
+}
+
+static ssize_t
+raidxor_show_store_layout(mddev_t *mddev, char *page)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+
+	if (conf)
+		return sprintf(page, "%u\n", conf->super_reserved);
+	else
+		return -ENODEV;
+}
+
+/**
+ * raidxor_store_store_layout() - keeps the layout on the members
+ *
+ * Only for a new array: the space for it is taken from the end of the
+ * members, which an older array may use for data.  Therefore it's only
+ * accepted before the array was configured.
+ */
+static ssize_t
+raidxor_store_store_layout(mddev_t *mddev, const char *page, size_t len)
+{
+	unsigned long new, flags = 0;
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	int err = 0;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	strict_strtoul(page, 10, &new);
+
+	if (new != 1)
+		return -EINVAL;
+
+	WITHLOCKCONF(conf, flags, {
+	if (conf->super_reserved)
+		;
+	else if (!test_bit(CONF_INCOMPLETE, &conf->flags) ||
+		 mddev->array_sectors)
+		err = -EBUSY;
+	else {
+		mddev->size = raidxor_super_data_size(conf, 1);
+		conf->super_reserved = 1;
+	}
+	});
+
+	return err ? err : len;
+}
+
+static struct md_sysfs_entry
+raidxor_store_layout = __ATTR(store_layout, S_IRUGO | S_IWUSR,
+			      raidxor_show_store_layout,
+			      raidxor_store_store_layout);
+
+static struct md_sysfs_entry
+raidxor_log = __ATTR(log, S_IRUGO | S_IWUSR,
+		     raidxor_show_log, raidxor_store_log);
+
+static struct md_sysfs_entry
+raidxor_numa_placement = __ATTR(numa_placement, S_IRUGO,
+				raidxor_show_numa_placement, NULL);
+
 static struct md_sysfs_entry
 raidxor_units_per_resource = __ATTR(units_per_resource, S_IRUGO | S_IWUSR,
 				    raidxor_show_units_per_resource,
 				    raidxor_store_units_per_resource);
 
+static struct md_sysfs_entry
+raidxor_cache_lines = __ATTR(cache_lines, S_IRUGO | S_IWUSR,
+			     raidxor_show_cache_lines,
+			     raidxor_store_cache_lines);
+
 static struct md_sysfs_entry
 raidxor_encoding = __ATTR(encoding, S_IRUGO | S_IWUSR,
 			  raidxor_show_encoding,
@@ -396,8 +779,12 @@ raidxor_decoding = __ATTR(decoding, S_IRUGO | S_IWUSR,
 
 static struct attribute * raidxor_attrs[] = {
 	(struct attribute *) &raidxor_units_per_resource,
+	(struct attribute *) &raidxor_cache_lines,
 	(struct attribute *) &raidxor_encoding,
 	(struct attribute *) &raidxor_decoding,
+	(struct attribute *) &raidxor_numa_placement,
+	(struct attribute *) &raidxor_log,
+	(struct attribute *) &raidxor_store_layout,
 	NULL
 };
 
@@ -449,9 +836,13 @@ static void raidxor_status(struct seq_file *seq, mddev_t *mddev)
 #endif
 
 	for (i = 0; i < conf->cache->n_lines; ++i) {
-		seq_printf(seq, "line %u: %s at sector %llu\n", i,
+		seq_printf(seq, "line %u: %s at sector %llu%s, %u hits\n", i,
 			   raidxor_cache_line_status(conf->cache->lines[i]),
-			   (unsigned long long) conf->cache->lines[i]->sector);
+			   (unsigned long long) conf->cache->lines[i]->sector,
+			   test_bit(CACHE_LINE_PINNED,
+				    &conf->cache->lines[i]->flags) ?
+			   ", pinned" : "",
+			   conf->cache->lines[i]->hits);
 	}
 }
 
@@ -0,0 +1,463 @@
+/* -*- mode: c; coding: utf-8; c-file-style: "K&R"; tab-width: 8; indent-tabs-mode: t; -*- */
+
+/**
+ * struct raidxor_derivation - state while deriving decoding equations
+ * @n_syms: number of symbols, units first, then temporaries
+ * @longs: size of one row in longs
+ * @n_rows: number of equations, one per redundant unit
+ * @rows: the equations, see raidxor_derive_decodings()
+ * @unknown: unreadable units
+ * @decodings: one row per unit, the derived decoding or empty
+ * @n_temps: number of temporaries used so far
+ * @pairs: the two symbols each temporary combines
+ */
+struct raidxor_derivation {
+	unsigned int n_syms, longs;
+
+	unsigned int n_rows;
+	unsigned long *rows;
+
+	unsigned long *unknown;
+	unsigned long *decodings;
+
+	unsigned int n_temps;
+	unsigned int (*pairs)[2];
+};
+
+#define raidxor_derivation_row(rows, d, i) (&(rows)[(i) * (d)->longs])
+
+/**
+ * raidxor_expand_encoding() - adds the units of an encoding to a row
+ *
+ * Temporaries are expanded recursively, so in the end @row contains
+ * the units which are XORed together.  Returns 1 if an encoding is
+ * missing.
+ */
+static int raidxor_expand_encoding(raidxor_conf_t *conf,
+				   encoding_t *encoding, unsigned long *row)
+{
+	unsigned int i;
+
+	if (!encoding)
+		return 1;
+
+	for (i = 0; i < encoding->n_units; ++i) {
+		if (encoding->units[i].temporary) {
+			if (raidxor_expand_encoding(conf,
+						    encoding->units[i].encoding,
+						    row))
+				return 1;
+		}
+		else
+			__change_bit(encoding->units[i].disk - conf->units, row);
+	}
+
+	return 0;
+}
+
+/**
+ * raidxor_eliminate() - Gauss-Jordan elimination over GF(2)
+ *
+ * Eliminates the columns of all unknown units, so every unknown appears
+ * in at most one row afterwards.
+ */
+static void raidxor_eliminate(struct raidxor_derivation *d)
+{
+	unsigned long *pivot, *row;
+	unsigned int c, p, q, n_pivots = 0;
+
+	for (c = find_first_bit(d->unknown, d->n_syms); c < d->n_syms;
+	     c = find_next_bit(d->unknown, d->n_syms, c + 1)) {
+		for (p = n_pivots; p < d->n_rows; ++p)
+			if (test_bit(c, raidxor_derivation_row(d->rows, d, p)))
+				break;
+		if (p == d->n_rows)
+			continue;
+
+		pivot = raidxor_derivation_row(d->rows, d, n_pivots);
+
+		/* swap into place */
+		if (p != n_pivots) {
+			row = raidxor_derivation_row(d->rows, d, p);
+			bitmap_xor(pivot, pivot, row, d->n_syms);
+			bitmap_xor(row, row, pivot, d->n_syms);
+			bitmap_xor(pivot, pivot, row, d->n_syms);
+		}
+
+		for (q = 0; q < d->n_rows; ++q) {
+			row = raidxor_derivation_row(d->rows, d, q);
+			if (q != n_pivots && test_bit(c, row))
+				bitmap_xor(row, row, pivot, d->n_syms);
+		}
+
+		++n_pivots;
+	}
+}
+
+/**
+ * raidxor_extract_decodings() - reads the decodings off the equations
+ *
+ * An unreadable data unit can be recovered if a row contains it as the
+ * only unknown; the other units of this row XOR to its contents.
+ * Returns the number of unreadable data units which can't be recovered.
+ */
+static unsigned int raidxor_extract_decodings(raidxor_conf_t *conf,
+					      struct raidxor_derivation *d)
+{
+	unsigned long *row, *decoding;
+	unsigned int i, r, lost = 0;
+
+	for (i = 0; i < conf->n_units; ++i) {
+		if (!test_bit(i, d->unknown) || conf->units[i].redundant)
+			continue;
+
+		decoding = raidxor_derivation_row(d->decodings, d, i);
+
+		for (r = 0; r < d->n_rows; ++r) {
+			row = raidxor_derivation_row(d->rows, d, r);
+			if (!test_bit(i, row))
+				continue;
+
+			bitmap_and(decoding, row, d->unknown, d->n_syms);
+			if (bitmap_weight(decoding, d->n_syms) != 1) {
+				bitmap_zero(decoding, d->n_syms);
+				continue;
+			}
+
+			bitmap_copy(decoding, row, d->n_syms);
+			__clear_bit(i, decoding);
+			break;
+		}
+
+		if (bitmap_empty(decoding, d->n_syms))
+			++lost;
+	}
+
+	return lost;
+}
+
+/**
+ * raidxor_count_pair() - counts the decodings containing two symbols
+ */
+static unsigned int raidxor_count_pair(raidxor_conf_t *conf,
+				       struct raidxor_derivation *d,
+				       unsigned int a, unsigned int b)
+{
+	unsigned long *decoding;
+	unsigned int i, count = 0;
+
+	for (i = 0; i < conf->n_units; ++i) {
+		decoding = raidxor_derivation_row(d->decodings, d, i);
+		if (test_bit(a, decoding) && test_bit(b, decoding))
+			++count;
+	}
+
+	return count;
+}
+
+/**
+ * raidxor_factor_decodings() - moves common pairs into temporaries
+ *
+ * Greedily takes the pair of symbols shared by most decodings and
+ * replaces it by a new temporary, which is computed once per line
+ * instead of once per decoding.  Stops when no pair is shared anymore
+ * or all temporaries are used up.
+ */
+static void raidxor_factor_decodings(raidxor_conf_t *conf,
+				     struct raidxor_derivation *d)
+{
+	unsigned long *decoding;
+	unsigned int a, b, i, t, count, best, best_a = 0, best_b = 0;
+
+	while (conf->n_units + d->n_temps < d->n_syms) {
+		t = conf->n_units + d->n_temps;
+
+		best = 1;
+		for (a = 0; a < t; ++a)
+			for (b = a + 1; b < t; ++b) {
+				count = raidxor_count_pair(conf, d, a, b);
+				if (count > best) {
+					best = count;
+					best_a = a;
+					best_b = b;
+				}
+			}
+
+		if (best < 2)
+			break;
+
+		d->pairs[d->n_temps][0] = best_a;
+		d->pairs[d->n_temps][1] = best_b;
+		++d->n_temps;
+
+		for (i = 0; i < conf->n_units; ++i) {
+			decoding = raidxor_derivation_row(d->decodings, d, i);
+			if (!test_bit(best_a, decoding) ||
+			    !test_bit(best_b, decoding))
+				continue;
+
+			__clear_bit(best_a, decoding);
+			__clear_bit(best_b, decoding);
+			__set_bit(t, decoding);
+		}
+	}
+}
+
+/**
+ * raidxor_build_decoding() - converts a row into a decoding
+ *
+ * The decoding temporaries the row refers to have to be in place.
+ */
+static decoding_t * raidxor_build_decoding(raidxor_conf_t *conf,
+					   struct raidxor_derivation *d,
+					   unsigned long *row)
+{
+	decoding_t *decoding;
+	unsigned int s, i = 0;
+
+	decoding = kzalloc(sizeof(decoding_t) +
+			   sizeof(coding_t) * bitmap_weight(row, d->n_syms),
+			   GFP_NOIO);
+	if (!decoding)
+		return NULL;
+
+	decoding->n_units = bitmap_weight(row, d->n_syms);
+
+	for (s = find_first_bit(row, d->n_syms); s < d->n_syms;
+	     s = find_next_bit(row, d->n_syms, s + 1), ++i) {
+		if (s < conf->n_units) {
+			decoding->units[i].temporary = 0;
+			decoding->units[i].disk = &conf->units[s];
+		}
+		else {
+			decoding->units[i].temporary = 1;
+			decoding->units[i].decoding =
+				conf->dec_temps[s - conf->n_units];
+		}
+	}
+
+	return decoding;
+}
+
+/**
+ * raidxor_install_decodings() - replaces all decodings by derived ones
+ *
+ * Temporaries are built first, in order, since later ones and the
+ * decodings of the units refer to them.
+ */
+static int raidxor_install_decodings(raidxor_conf_t *conf,
+				     struct raidxor_derivation *d)
+{
+	unsigned long *row, *decoding, flags = 0;
+	unsigned int i;
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < conf->n_units; ++i)
+		raidxor_safe_free_decoding(&conf->units[i]);
+
+	if (conf->dec_temps)
+		for (i = 0; i < conf->n_dec_temps; ++i) {
+			kfree(conf->dec_temps[i]);
+			conf->dec_temps[i] = NULL;
+		}
+	});
+
+	if (raidxor_cache_ensure_temps(conf, conf->n_enc_temps, d->n_temps))
+		return -ENOMEM;
+
+	row = kzalloc(sizeof(unsigned long) * d->longs, GFP_NOIO);
+	if (!row)
+		return -ENOMEM;
+
+	for (i = 0; i < d->n_temps; ++i) {
+		bitmap_zero(row, d->n_syms);
+		__set_bit(d->pairs[i][0], row);
+		__set_bit(d->pairs[i][1], row);
+
+		conf->dec_temps[i] = raidxor_build_decoding(conf, d, row);
+		if (!conf->dec_temps[i])
+			goto out_free_row;
+	}
+
+	for (i = 0; i < conf->n_units; ++i) {
+		decoding = raidxor_derivation_row(d->decodings, d, i);
+		if (bitmap_empty(decoding, d->n_syms))
+			continue;
+
+		conf->units[i].decoding = raidxor_build_decoding(conf, d,
+								 decoding);
+		if (!conf->units[i].decoding)
+			goto out_free_row;
+	}
+
+	kfree(row);
+	return 0;
+out_free_row:
+	kfree(row);
+	return -ENOMEM;
+}
+
+/**
+ * raidxor_derive_decodings() - computes the decodings for failed units
+ *
+ * Every redundant unit r with encoding E gives the equation
+ * r + E = 0 over GF(2), with units as variables.  Eliminating the
+ * unreadable units from these equations yields the decodings, see
+ * raidxor_extract_decodings(), which are then optimised using
+ * temporaries.
+ *
+ * Replaces all decodings and decoding temporaries, so the array has to
+ * be quiesced.  Returns the number of unreadable data units which
+ * can't be recovered, or a negative error code.
+ */
+static int raidxor_derive_decodings(raidxor_conf_t *conf)
+{
+	struct raidxor_derivation d;
+	unsigned long *row, flags = 0;
+	unsigned int i;
+	int result = -ENOMEM;
+
+	CHECK_FUN(raidxor_derive_decodings);
+
+	memset(&d, 0, sizeof(d));
+
+	/* at most one temporary per unit */
+	d.n_syms = conf->n_units * 2;
+	d.longs = BITS_TO_LONGS(d.n_syms);
+
+	for (i = 0; i < conf->n_units; ++i)
+		if (conf->units[i].redundant)
+			++d.n_rows;
+
+	d.rows = kzalloc(sizeof(unsigned long) * d.longs *
+			 (d.n_rows + conf->n_units + 1), GFP_NOIO);
+	d.pairs = kzalloc(sizeof(*d.pairs) * conf->n_units, GFP_NOIO);
+	if (!d.rows || !d.pairs)
+		goto out;
+
+	d.decodings = raidxor_derivation_row(d.rows, &d, d.n_rows);
+	d.unknown = raidxor_derivation_row(d.decodings, &d, conf->n_units);
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < conf->n_units; ++i)
+		if (!raidxor_unit_readable(&conf->units[i]))
+			__set_bit(i, d.unknown);
+	});
+
+	for (i = 0, d.n_rows = 0; i < conf->n_units; ++i) {
+		if (!conf->units[i].redundant)
+			continue;
+
+		row = raidxor_derivation_row(d.rows, &d, d.n_rows++);
+		__set_bit(i, row);
+		if (raidxor_expand_encoding(conf, conf->units[i].encoding,
+					    row)) {
+			result = -EINVAL;
+			goto out;
+		}
+	}
+
+	raidxor_eliminate(&d);
+	result = raidxor_extract_decodings(conf, &d);
+	raidxor_factor_decodings(conf, &d);
+
+	if (raidxor_install_decodings(conf, &d))
+		result = -ENOMEM;
+out:
+	kfree(d.pairs);
+	kfree(d.rows);
+	return result;
+}
+
+/**
+ * raidxor_derive_done() - resumes the loads waiting for the decodings
+ *
+ * Unless another failure meanwhile scheduled the next derivation, see
+ * raidxor_cache_unpark_lines().
+ */
+static void raidxor_derive_done(raidxor_conf_t *conf)
+{
+	unsigned long flags = 0;
+	unsigned int queued = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	if (!delayed_work_pending(&conf->derive_work)) {
+		clear_bit(CONF_DERIVING, &conf->flags);
+		if (conf->cache)
+			queued = raidxor_cache_unpark_lines(conf->cache);
+	}
+	});
+
+	if (queued)
+		raidxor_wakeup_thread(conf);
+}
+
+/**
+ * raidxor_derive_work() - derives decodings after a failure
+ *
+ * Scheduled by raidxor_schedule_derive().  Runs under the md
+ * reconfiguration mutex like the sysfs attributes; if that's taken,
+ * e.g. while the array is stopped, it tries again later.  Loads which
+ * need the new decodings wait until it's done.
+ */
+static void raidxor_derive_work(struct work_struct *work)
+{
+	raidxor_conf_t *conf = container_of(work, raidxor_conf_t,
+					    derive_work.work);
+	mddev_t *mddev = conf->mddev;
+	int result;
+
+	if (!mutex_trylock(&mddev->reconfig_mutex)) {
+		queue_delayed_work(conf->derive_wq, &conf->derive_work,
+				   HZ / 10);
+		return;
+	}
+
+	if (test_bit(CONF_INCOMPLETE, &conf->flags)) {
+		mutex_unlock(&mddev->reconfig_mutex);
+		raidxor_derive_done(conf);
+		return;
+	}
+
+	raidxor_quiesce(mddev, 1);
+	result = raidxor_derive_decodings(conf);
+	raidxor_quiesce(mddev, 0);
+
+	/* assembling again doesn't have to derive them */
+	if (result == 0)
+		raidxor_super_write(conf);
+
+	mutex_unlock(&mddev->reconfig_mutex);
+
+	raidxor_derive_done(conf);
+
+	if (result < 0)
+		printk(KERN_ERR "raidxor: couldn't derive decodings for %s: "
+		       "%d\n", mdname(mddev), result);
+	else if (result > 0)
+		printk(KERN_CRIT "raidxor: %d failed units of %s can't be "
+		       "recovered\n", result, mdname(mddev));
+	else
+		printk(KERN_INFO "raidxor: derived decodings for %s\n",
+		       mdname(mddev));
+}
+
+/**
+ * raidxor_schedule_derive() - derives new decodings in the background
+ *
+ * Can be called from any context.  Needs to be called with
+ * conf->device_lock held, so it doesn't race with raidxor_stop().
+ */
+static void raidxor_schedule_derive(raidxor_conf_t *conf)
+{
+	if (!test_bit(CONF_STOPPING, &conf->flags)) {
+		set_bit(CONF_DERIVING, &conf->flags);
+		queue_delayed_work(conf->derive_wq, &conf->derive_work, 0);
+	}
+}
+
+#if 0
+Local variables:
+c-basic-offset: 8
+End:
+#endif
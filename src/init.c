@@ -14,18 +14,32 @@ static struct mdk_personality raidxor_personality =
 	/* handles faulty disks, so we have to implement this one */
 	.error_handler = raidxor_error,
 
-	/* .sync_request = raidxor_sync_request, */
-	/* .quiesce = raidxor_quiesce, */
+	.hot_add_disk = raidxor_add_disk,
+	.hot_remove_disk = raidxor_remove_disk,
+	.spare_active = raidxor_spare_active,
+	.sync_request = raidxor_sync_request,
+	.quiesce = raidxor_quiesce,
 };
 
 static int __init raidxor_init(void)
 {
-	return register_md_personality(&raidxor_personality);
+	int result;
+
+	raidxor_wq = create_workqueue("raidxor");
+	if (!raidxor_wq)
+		return -ENOMEM;
+
+	result = register_md_personality(&raidxor_personality);
+	if (result)
+		destroy_workqueue(raidxor_wq);
+
+	return result;
 }
 
 static void __exit raidxor_exit(void)
 {
 	unregister_md_personality(&raidxor_personality);
+	destroy_workqueue(raidxor_wq);
 }
 
 MODULE_AUTHOR("Olof-Joachim Frahm");
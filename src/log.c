@@ -0,0 +1,1155 @@
+/* -*- mode: c; coding: utf-8; c-file-style: "K&R"; tab-width: 8; indent-tabs-mode: t; -*- */
+
+/*
+   The log keeps the contents of dirty lines on a separate device, so a
+   line is safe as soon as it's written there.  FUA requests and flushes
+   complete at the speed of the log, the writeback to the members
+   happens later, and since every writeback is preceded by a record of
+   the whole strip, a crash in the middle of a writeback is repaired by
+   writing the strip again from the log.
+
+   The first page of the device holds struct raidxor_log_super, the rest
+   is split into slots of record_pages pages.  Record seq lives in slot
+   seq % n_slots and consists of a struct raidxor_log_record page
+   followed by the data units of the strip in buffer order; the
+   redundant units are encoded again on replay.
+
+   A record counts only if all records before it are on disk, see
+   raidxor_log_end_line(), so a replay reads from the tail of the
+   superblock up to the first record which doesn't match.  A line keeps
+   its newest record in ->log_seq until it's written back; the tail is
+   the oldest record still referenced and is only moved forward on disk
+   by a checkpoint, after the members were flushed.
+*/
+
+/**
+ * raidxor_log_slot_sector() - returns the first sector of a record
+ */
+static sector_t raidxor_log_slot_sector(raidxor_log_t *log, u64 seq)
+{
+	u64 slot = seq;
+	u32 rem = do_div(slot, log->n_slots);
+
+	return ((sector_t) 1 + (sector_t) rem * log->record_pages) <<
+		(PAGE_SHIFT - 9);
+}
+
+static u32 raidxor_log_crc_pages(u32 crc, struct page **pages,
+				 unsigned int n_pages)
+{
+	unsigned int i;
+	void *data;
+
+	for (i = 0; i < n_pages; ++i) {
+		data = kmap(pages[i]);
+		crc = crc32_le(crc, data, PAGE_SIZE);
+		kunmap(pages[i]);
+	}
+
+	return crc;
+}
+
+/**
+ * raidxor_log_record_crc() - computes the checksum of a record
+ * @pages: the data pages, NULL for a cancelled record
+ */
+static u32 raidxor_log_record_crc(raidxor_log_t *log,
+				  struct raidxor_log_record *record,
+				  struct page **pages)
+{
+	struct raidxor_log_record header = *record;
+	u32 crc;
+
+	header.crc = 0;
+	crc = crc32_le(~0, (unsigned char *) &header, sizeof(header));
+
+	if (pages)
+		crc = raidxor_log_crc_pages(crc, pages, log->record_pages - 1);
+
+	return crc;
+}
+
+static u32 raidxor_log_super_crc(struct raidxor_log_super *super)
+{
+	struct raidxor_log_super copy = *super;
+
+	copy.crc = 0;
+	return crc32_le(~0, (unsigned char *) &copy, sizeof(copy));
+}
+
+/**
+ * raidxor_log_alloc_io() - allocates a record write
+ *
+ * Only the header page is allocated, the data pages are the line's.
+ */
+static raidxor_log_io_t * raidxor_log_alloc_io(raidxor_log_t *log)
+{
+	raidxor_log_io_t *io;
+
+	io = kzalloc(sizeof(raidxor_log_io_t) +
+		     sizeof(struct page *) * log->record_pages, GFP_NOIO);
+	if (!io)
+		return NULL;
+
+	io->pages[0] = alloc_page(GFP_NOIO);
+	if (!io->pages[0]) {
+		kfree(io);
+		return NULL;
+	}
+
+	io->log = log;
+	io->n_pages = log->record_pages;
+	INIT_LIST_HEAD(&io->list);
+
+	return io;
+}
+
+static void raidxor_log_free_io(raidxor_log_io_t *io)
+{
+	__free_page(io->pages[0]);
+	kfree(io);
+}
+
+static void raidxor_log_end_line(raidxor_log_io_t *io);
+
+static void raidxor_log_put_io(raidxor_log_io_t *io)
+{
+	if (atomic_dec_and_test(&io->remaining))
+		raidxor_log_end_line(io);
+}
+
+static void raidxor_log_end_bio(struct bio *bio, int error)
+{
+	raidxor_log_io_t *io = (raidxor_log_io_t *)(bio->bi_private);
+
+	if (error && !io->error)
+		io->error = error;
+
+	bio_put(bio);
+	raidxor_log_put_io(io);
+}
+
+/**
+ * raidxor_log_submit() - writes the pages of a record
+ *
+ * The record is written in as few bios as the log device takes.
+ */
+static void raidxor_log_submit(raidxor_log_io_t *io, sector_t sector)
+{
+	struct bio *bio;
+	unsigned int i = 0;
+
+	atomic_set(&io->remaining, 1);
+
+	while (i < io->n_pages) {
+		bio = bio_alloc(GFP_NOIO, min_t(unsigned int, io->n_pages - i,
+						BIO_MAX_PAGES));
+		bio->bi_bdev = io->log->bdev;
+		bio->bi_sector = sector + ((sector_t) i << (PAGE_SHIFT - 9));
+		bio->bi_end_io = raidxor_log_end_bio;
+		bio->bi_private = io;
+
+		while (i < io->n_pages &&
+		       bio_add_page(bio, io->pages[i], PAGE_SIZE, 0) == PAGE_SIZE)
+			++i;
+
+		if (bio->bi_vcnt == 0) {
+			bio_put(bio);
+			io->error = -EIO;
+			break;
+		}
+
+		atomic_inc(&io->remaining);
+		submit_bio(RAIDXOR_FUA_RW, bio);
+	}
+
+	raidxor_log_put_io(io);
+}
+
+/**
+ * raidxor_log_schedule_checkpoint() - frees space in the log soon
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_log_schedule_checkpoint(raidxor_log_t *log)
+{
+	if (log->checkpointing)
+		return;
+
+	log->checkpointing = 1;
+	queue_work(log->wq, &log->checkpoint_work);
+}
+
+/**
+ * raidxor_log_reserve() - takes the next record
+ *
+ * Returns its sequence number, or 0 if the log is full.  A checkpoint
+ * is started when half of the log is in use, so usually there's space.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static u64 raidxor_log_reserve(raidxor_log_t *log)
+{
+	u64 used = log->head - log->tail;
+
+	if (used * 2 >= log->n_slots)
+		raidxor_log_schedule_checkpoint(log);
+
+	if (used >= log->n_slots)
+		return 0;
+
+	return log->head++;
+}
+
+/**
+ * raidxor_log_line() - writes the contents of a dirty line to the log
+ *
+ * Called before a line is written back.  Returns 1 if the line may be
+ * written back, because there's no log or its contents are already in
+ * there.  Else the line is logged, or waits for space in the log, and 0
+ * is returned; it's queued again afterwards.
+ *
+ * The line is owned by the caller.
+ */
+static int raidxor_log_line(cache_t *cache, unsigned int n_line)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+	struct raidxor_log_record *record;
+	raidxor_log_t *log;
+	raidxor_log_io_t *io;
+	unsigned long flags = 0;
+	unsigned int i, need;
+	u64 seq = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	log = conf->log;
+	need = log && !log->failed && line->status == CACHE_LINE_DIRTY &&
+		!test_bit(CACHE_LINE_LOGGED, &line->flags);
+	});
+
+	if (!need)
+		return 1;
+
+	/* allocated first, a reserved record has to be written, else
+	   the replay stops at the hole */
+	io = raidxor_log_alloc_io(log);
+	if (!io) {
+		/* the checkpoint queues the line again when it's done */
+		WITHLOCKCONF(conf, flags, {
+		raidxor_log_schedule_checkpoint(log);
+		});
+		return 0;
+	}
+
+	WITHLOCKCONF(conf, flags, {
+	if (!log->failed && line->status == CACHE_LINE_DIRTY &&
+	    !test_bit(CACHE_LINE_LOGGED, &line->flags) &&
+	    (seq = raidxor_log_reserve(log))) {
+		line->status = CACHE_LINE_LOGGING;
+		line->log_writing = seq;
+		++cache->active_lines;
+
+		io->line = line;
+		io->seq = seq;
+		list_add_tail(&io->list, &log->ios);
+	}
+	});
+
+	if (!seq) {
+		raidxor_log_free_io(io);
+		return log->failed;
+	}
+
+	/* a LOGGING line doesn't change, so its buffers are written
+	   directly */
+	for (i = 1; i < io->n_pages; ++i)
+		io->pages[i] = line->buffers[i - 1];
+
+	record = kmap(io->pages[0]);
+	memset(record, 0, PAGE_SIZE);
+	record->magic = cpu_to_le32(RAIDXOR_LOG_MAGIC);
+	record->generation = cpu_to_le32(log->generation);
+	record->seq = cpu_to_le64(seq);
+	record->sector = cpu_to_le64(line->sector);
+	record->crc = cpu_to_le32(raidxor_log_record_crc(log, record,
+							 &io->pages[1]));
+	kunmap(io->pages[0]);
+
+	raidxor_log_submit(io, raidxor_log_slot_sector(log, seq));
+
+	return 0;
+}
+
+/**
+ * raidxor_log_finish() - accounts a record on disk
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_log_finish(raidxor_log_t *log, raidxor_log_io_t *io)
+{
+	cache_line_t *line = io->line;
+	cache_t *cache = line->cache;
+
+	line->status = CACHE_LINE_DIRTY;
+	line->log_writing = 0;
+
+	if (io->error && !log->failed) {
+		printk(KERN_ERR "raidxor: log device failed, writing back "
+		       "without it\n");
+		log->failed = 1;
+		raidxor_log_schedule_checkpoint(log);
+	}
+
+	/* after a failure, later records aren't replayed either, the
+	   line persists its FUA requests by a writeback instead */
+	if (!log->failed) {
+		set_bit(CACHE_LINE_LOGGED, &line->flags);
+		line->log_seq = io->seq;
+		io->syncing = raidxor_cache_line_persisted(cache, line);
+	}
+
+	--cache->active_lines;
+	raidxor_wake_quiesce(log->conf);
+	raidxor_cache_queue_line(cache, line->index);
+}
+
+/**
+ * raidxor_log_end_line() - completes record writes in sequence order
+ *
+ * A replay stops at the first missing record, so a record doesn't
+ * count before all earlier ones are on disk, even if it's complete.
+ */
+static void raidxor_log_end_line(raidxor_log_io_t *io)
+{
+	raidxor_log_t *log = io->log;
+	raidxor_conf_t *conf = log->conf;
+	raidxor_log_io_t *next;
+	struct bio *bio;
+	unsigned long flags = 0;
+	LIST_HEAD(finished);
+
+	WITHLOCKCONF(conf, flags, {
+	io->done = 1;
+
+	while (!list_empty(&log->ios)) {
+		io = list_first_entry(&log->ios, raidxor_log_io_t, list);
+		if (!io->done)
+			break;
+
+		list_move_tail(&io->list, &finished);
+		raidxor_log_finish(log, io);
+	}
+	});
+
+	list_for_each_entry_safe(io, next, &finished, list) {
+		/* FUA requests in this line are on disk now */
+		while ((bio = io->syncing)) {
+			io->syncing = bio->bi_next;
+			bio->bi_next = NULL;
+			bio_endio(bio, 0);
+		}
+
+		list_del(&io->list);
+		raidxor_log_free_io(io);
+	}
+
+	raidxor_wakeup_thread(conf);
+}
+
+/**
+ * raidxor_log_line_changed() - notes new data in a line
+ *
+ * The record of the line is outdated, the next writeback needs a new
+ * one.  A running checkpoint doesn't wait for the line anymore.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_log_line_changed(raidxor_conf_t *conf,
+				     cache_line_t *line)
+{
+	clear_bit(CACHE_LINE_LOGGED, &line->flags);
+
+	if (test_and_clear_bit(CACHE_LINE_CHECKPOINT, &line->flags) &&
+	    conf->log)
+		wake_up(&conf->log->wait);
+}
+
+/**
+ * raidxor_log_forget_line() - notes that a line's record isn't needed
+ *
+ * Called after the writeback, or when the line's data is dropped.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_log_forget_line(raidxor_conf_t *conf,
+				    cache_line_t *line)
+{
+	line->log_seq = 0;
+	raidxor_log_line_changed(conf, line);
+}
+
+/**
+ * raidxor_log_write_page() - writes a single page of the log
+ *
+ * Returns 0 on success.
+ */
+static int raidxor_log_write_page(raidxor_log_t *log, sector_t sector,
+				  struct page *page)
+{
+	return sync_page_io(log->bdev, sector, PAGE_SIZE, page,
+			    RAIDXOR_FUA_RW) ? 0 : -EIO;
+}
+
+/**
+ * raidxor_log_write_super() - writes the superblock with a new tail
+ *
+ * Returns 0 on success.
+ */
+static int raidxor_log_write_super(raidxor_log_t *log, u64 tail)
+{
+	struct raidxor_log_super *super;
+	struct page *page;
+	int err;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	super = kmap(page);
+	memset(super, 0, PAGE_SIZE);
+	super->magic = cpu_to_le32(RAIDXOR_LOG_MAGIC);
+	super->version = cpu_to_le32(RAIDXOR_LOG_VERSION);
+	super->generation = cpu_to_le32(log->generation);
+	super->record_pages = cpu_to_le32(log->record_pages);
+	super->n_slots = cpu_to_le32(log->n_slots);
+	super->tail = cpu_to_le64(tail);
+	memcpy(super->uuid, log->conf->mddev->uuid, sizeof(super->uuid));
+	super->crc = cpu_to_le32(raidxor_log_super_crc(super));
+	kunmap(page);
+
+	err = raidxor_log_write_page(log, 0, page);
+
+	__free_page(page);
+	return err;
+}
+
+/**
+ * raidxor_log_cancel() - marks a superseded record to be skipped
+ *
+ * The record stays in the sequence, so the replay goes on after it.
+ * Returns 0 on success.
+ */
+static int raidxor_log_cancel(raidxor_log_t *log, u64 seq)
+{
+	struct raidxor_log_record *record;
+	struct page *page;
+	int err;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	record = kmap(page);
+	memset(record, 0, PAGE_SIZE);
+	record->magic = cpu_to_le32(RAIDXOR_LOG_MAGIC);
+	record->flags = cpu_to_le32(RAIDXOR_LOG_CANCELLED);
+	record->generation = cpu_to_le32(log->generation);
+	record->seq = cpu_to_le64(seq);
+	record->crc = cpu_to_le32(raidxor_log_record_crc(log, record, NULL));
+	kunmap(page);
+
+	err = raidxor_log_write_page(log, raidxor_log_slot_sector(log, seq),
+				     page);
+
+	__free_page(page);
+	return err;
+}
+
+/**
+ * raidxor_log_oldest() - returns the oldest record still referenced
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static u64 raidxor_log_oldest(raidxor_log_t *log, cache_t *cache)
+{
+	u64 oldest = log->head;
+	cache_line_t *line;
+	unsigned int i;
+
+	for (i = 0; cache && i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+		if (line->log_seq && line->log_seq < oldest)
+			oldest = line->log_seq;
+		if (line->log_writing && line->log_writing < oldest)
+			oldest = line->log_writing;
+	}
+
+	return oldest;
+}
+
+/**
+ * raidxor_log_checkpoint_pending() - checks for lines still written back
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_log_checkpoint_pending(cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; cache && i < cache->n_lines; ++i)
+		if (test_bit(CACHE_LINE_CHECKPOINT, &cache->lines[i]->flags))
+			return 1;
+
+	return 0;
+}
+
+/**
+ * raidxor_log_next_outdated() - finds a line pinning an outdated record
+ *
+ * Such a line got new data after it was logged, its record can only
+ * go away with a new record or if it's cancelled.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_log_next_outdated(cache_t *cache,
+					      unsigned int *n_line)
+{
+	cache_line_t *line;
+	unsigned int i;
+
+	for (i = 0; cache && i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+		if (line->log_seq && line->status == CACHE_LINE_DIRTY &&
+		    !test_bit(CACHE_LINE_LOGGED, &line->flags) &&
+		    !test_bit(CACHE_LINE_BUSY, &line->flags)) {
+			*n_line = i;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * raidxor_log_checkpoint_lines() - frees the space of written records
+ * @all: also write back lines whose contents aren't logged yet
+ *
+ * Logged dirty lines are written back and outdated records cancelled,
+ * then the members are flushed and the superblock gets the new tail.
+ * With @all, unlogged lines are only included while the log has space
+ * for their records, so a full log may need another round.  Returns 0
+ * on success.
+ */
+static int raidxor_log_checkpoint_lines(raidxor_log_t *log, unsigned int all)
+{
+	raidxor_conf_t *conf = log->conf;
+	cache_t *cache;
+	cache_line_t *line;
+	unsigned long flags = 0;
+	unsigned int i, n_line;
+	u64 seq, tail, room;
+	int err = 0;
+
+	mutex_lock(&log->mutex);
+
+	WITHLOCKCONF(conf, flags, {
+	cache = conf->cache;
+	room = log->n_slots - (log->head - log->tail);
+
+	for (i = 0; cache && i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+		if (line->status != CACHE_LINE_DIRTY)
+			continue;
+
+		/* an unlogged line needs a record first, without space
+		   for it, waiting for the line would never end */
+		if (!log->failed &&
+		    !test_bit(CACHE_LINE_LOGGED, &line->flags)) {
+			if (!all || room == 0)
+				continue;
+			--room;
+		}
+
+		set_bit(CACHE_LINE_CHECKPOINT, &line->flags);
+		raidxor_cache_queue_line(cache, i);
+	}
+	});
+
+	raidxor_wakeup_thread(conf);
+
+	WITHLOCKCONF(conf, flags, {
+	wait_event_lock_irqsave(log->wait,
+				!raidxor_log_checkpoint_pending(conf->cache),
+				conf->device_lock, flags, /* nothing */);
+
+	/* LOGGING keeps the line as it is while the record is cancelled */
+	while (!log->failed &&
+	       raidxor_log_next_outdated(conf->cache, &n_line)) {
+		cache = conf->cache;
+		line = cache->lines[n_line];
+		seq = line->log_seq;
+		line->status = CACHE_LINE_LOGGING;
+		++cache->active_lines;
+		UNLOCKCONF(conf, flags);
+
+		err = raidxor_log_cancel(log, seq);
+
+		LOCKCONF(conf, flags);
+		line->status = CACHE_LINE_DIRTY;
+		if (!err)
+			line->log_seq = 0;
+		--cache->active_lines;
+		raidxor_wake_quiesce(conf);
+		raidxor_cache_queue_line(cache, n_line);
+		if (err)
+			break;
+	}
+
+	tail = raidxor_log_oldest(log, conf->cache);
+	});
+
+	/* the writebacks have to be on the members before their records
+	   are given up */
+	if (!err && tail != log->tail)
+		err = raidxor_flush_units(conf);
+	if (!err && tail != log->tail)
+		err = raidxor_log_write_super(log, tail);
+
+	WITHLOCKCONF(conf, flags, {
+	if (!err)
+		log->tail = tail;
+
+	/* lines waiting for space try again */
+	for (i = 0; conf->cache && i < conf->cache->n_lines; ++i)
+		raidxor_cache_queue_line(conf->cache, i);
+	});
+
+	raidxor_wakeup_thread(conf);
+
+	mutex_unlock(&log->mutex);
+
+	return err;
+}
+
+/**
+ * raidxor_log_checkpoint() - frees space in the log
+ *
+ * Queued when the log is half full, or a record couldn't be written.
+ */
+static void raidxor_log_checkpoint(struct work_struct *work)
+{
+	raidxor_log_t *log = container_of(work, raidxor_log_t,
+					  checkpoint_work);
+	raidxor_conf_t *conf = log->conf;
+	unsigned long flags = 0;
+
+	if (raidxor_log_checkpoint_lines(log, 0))
+		printk(KERN_ERR "raidxor: checkpoint of the log failed\n");
+
+	WITHLOCKCONF(conf, flags, {
+	log->checkpointing = 0;
+	});
+}
+
+/**
+ * raidxor_log_line_settled() - checks if the replay can look at a line
+ *
+ * A line of an earlier record may still be written back.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_log_line_settled(cache_line_t *line)
+{
+	if (test_bit(CACHE_LINE_BUSY, &line->flags))
+		return 0;
+
+	switch (line->status) {
+	case CACHE_LINE_READYING:
+	case CACHE_LINE_LOADING:
+	case CACHE_LINE_WRITEBACK:
+	case CACHE_LINE_RECOVERY:
+	case CACHE_LINE_LOGGING:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/**
+ * raidxor_log_apply() - puts a replayed record into a line
+ *
+ * The line becomes dirty and refers to the record, the redundant units
+ * are encoded when it's written back.  The array didn't serve requests
+ * yet, so lines being loaded or written back are the only ones which
+ * aren't replaced.  Returns 0 on success, 1 if the replay has to stop
+ * and 2 if the record was skipped.
+ */
+static int raidxor_log_apply(raidxor_log_t *log, u64 seq, sector_t sector,
+			     struct page **pages)
+{
+	raidxor_conf_t *conf = log->conf;
+	cache_t *cache = conf->cache;
+	cache_line_t *line;
+	unsigned int i, n_line, match;
+	unsigned long flags = 0;
+
+	LOCKCONF(conf, flags);
+retry:
+	if (test_bit(CONF_STOPPING, &conf->flags)) {
+		UNLOCKCONF(conf, flags);
+		return 1;
+	}
+
+	if (!raidxor_cache_find_line(cache, sector, &n_line)) {
+		raidxor_wait_for_empty_line(conf, &flags);
+		goto retry;
+	}
+
+	line = cache->lines[n_line];
+	match = line->sector == sector;
+
+	wait_event_lock_irqsave(cache->wait_for_line,
+				raidxor_log_line_settled(line) ||
+				test_bit(CONF_STOPPING, &conf->flags),
+				conf->device_lock, flags, /* nothing */);
+
+	/* the line may have been reassigned meanwhile */
+	if (test_bit(CONF_STOPPING, &conf->flags) ||
+	    (match && line->sector != sector))
+		goto retry;
+
+	if (line->status != CACHE_LINE_CLEAN &&
+	    line->status != CACHE_LINE_READY &&
+	    !test_bit(CACHE_LINE_LOGGED, &line->flags) &&
+	    line->status != CACHE_LINE_UPTODATE &&
+	    line->status != CACHE_LINE_DIRTY) {
+		UNLOCKCONF(conf, flags);
+		printk(KERN_WARNING "raidxor: strip at %llu is in use, record "
+		       "%llu not replayed\n", (unsigned long long) sector,
+		       (unsigned long long) seq);
+		return 2;
+	}
+
+	if (line->status == CACHE_LINE_CLEAN ||
+	    line->status == CACHE_LINE_READY) {
+		UNLOCKCONF(conf, flags);
+		if (raidxor_cache_make_ready(cache, n_line)) {
+			LOCKCONF(conf, flags);
+			goto retry;
+		}
+		LOCKCONF(conf, flags);
+
+		if (line->status != CACHE_LINE_READY)
+			goto retry;
+
+		raidxor_cache_make_load_me(cache, n_line, sector);
+	}
+
+	set_bit(CACHE_LINE_BUSY, &line->flags);
+	UNLOCKCONF(conf, flags);
+
+	raidxor_copy_pages(log->record_pages - 1, line->buffers, pages);
+
+	LOCKCONF(conf, flags);
+	/* redundant units read before are outdated now */
+	bitmap_zero(line->valid, conf->n_units);
+	for (i = 0; i < conf->n_units; ++i)
+		if (!conf->units[i].redundant)
+			__set_bit(i, line->valid);
+	bitmap_copy(line->want, line->valid, conf->n_units);
+
+	line->status = CACHE_LINE_DIRTY;
+	set_bit(CACHE_LINE_LOGGED, &line->flags);
+	line->log_seq = seq;
+
+	raidxor_cache_release_line(cache, n_line, 0);
+	UNLOCKCONF(conf, flags);
+
+	return 0;
+}
+
+/**
+ * raidxor_log_read_record() - reads and checks a record for the replay
+ *
+ * Returns 1 for a record with data, 2 for a cancelled one and 0 if the
+ * replay ends here.
+ */
+static unsigned int raidxor_log_read_record(raidxor_log_t *log, u64 seq,
+					    struct page **pages,
+					    sector_t *sector)
+{
+	struct raidxor_log_record *record;
+	sector_t start = raidxor_log_slot_sector(log, seq);
+	sector_t strip_sectors, mod;
+	unsigned int i, result = 0;
+
+	if (!sync_page_io(log->bdev, start, PAGE_SIZE, pages[0], READ))
+		return 0;
+
+	record = kmap(pages[0]);
+	if (le32_to_cpu(record->magic) != RAIDXOR_LOG_MAGIC ||
+	    le32_to_cpu(record->generation) != log->generation ||
+	    le64_to_cpu(record->seq) != seq)
+		goto out;
+
+	if (le32_to_cpu(record->flags) & RAIDXOR_LOG_CANCELLED) {
+		if (le32_to_cpu(record->crc) ==
+		    raidxor_log_record_crc(log, record, NULL))
+			result = 2;
+		goto out;
+	}
+
+	*sector = le64_to_cpu(record->sector);
+
+	strip_sectors = (log->record_pages - 1) << (PAGE_SHIFT - 9);
+	mod = *sector;
+	if (*sector >= log->conf->mddev->array_sectors ||
+	    do_div(mod, strip_sectors) != 0)
+		goto out;
+
+	for (i = 1; i < log->record_pages; ++i)
+		if (!sync_page_io(log->bdev,
+				  start + ((sector_t) i << (PAGE_SHIFT - 9)),
+				  PAGE_SIZE, pages[i], READ))
+			goto out;
+
+	if (le32_to_cpu(record->crc) ==
+	    raidxor_log_record_crc(log, record, &pages[1]))
+		result = 1;
+out:
+	kunmap(pages[0]);
+	return result;
+}
+
+/**
+ * raidxor_log_replay() - puts the records of the log into the cache
+ *
+ * Returns the number of records replayed.
+ */
+static unsigned int raidxor_log_replay(raidxor_log_t *log)
+{
+	struct page **pages;
+	unsigned int i, n = 0, valid;
+	sector_t sector = 0;
+	u64 seq;
+
+	pages = kzalloc(sizeof(struct page *) * log->record_pages, GFP_KERNEL);
+	if (!pages)
+		goto out;
+
+	for (i = 0; i < log->record_pages; ++i)
+		if (!(pages[i] = alloc_page(GFP_KERNEL)))
+			goto out_free;
+
+	for (seq = log->tail; seq - log->tail < log->n_slots; ++seq) {
+		valid = raidxor_log_read_record(log, seq, pages, &sector);
+		if (!valid)
+			break;
+
+		if (valid == 1) {
+			valid = raidxor_log_apply(log, seq, sector, &pages[1]);
+			if (valid == 1)
+				break;
+			if (valid == 0)
+				++n;
+		}
+	}
+
+	log->head = seq;
+
+out_free:
+	for (i = 0; i < log->record_pages; ++i)
+		if (pages[i])
+			__free_page(pages[i]);
+	kfree(pages);
+out:
+	return n;
+}
+
+/**
+ * raidxor_log_read_super() - reads the superblock of the log device
+ *
+ * Returns 0 if it belongs to this array, 1 if the device holds no
+ * log, or a negative error code.
+ */
+static int raidxor_log_read_super(raidxor_log_t *log)
+{
+	struct raidxor_log_super *super;
+	struct page *page;
+	int result = 1;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	if (!sync_page_io(log->bdev, 0, PAGE_SIZE, page, READ)) {
+		__free_page(page);
+		return -EIO;
+	}
+
+	super = kmap(page);
+	if (le32_to_cpu(super->magic) != RAIDXOR_LOG_MAGIC ||
+	    le32_to_cpu(super->crc) != raidxor_log_super_crc(super))
+		goto out;
+
+	/* its records would be lost */
+	if (le32_to_cpu(super->version) != RAIDXOR_LOG_VERSION ||
+	    memcmp(super->uuid, log->conf->mddev->uuid,
+		   sizeof(super->uuid)) ||
+	    le32_to_cpu(super->record_pages) != log->record_pages ||
+	    le32_to_cpu(super->n_slots) != log->n_slots) {
+		result = -EBUSY;
+		goto out;
+	}
+
+	log->generation = le32_to_cpu(super->generation);
+	log->tail = log->head = le64_to_cpu(super->tail);
+	result = 0;
+out:
+	kunmap(page);
+	__free_page(page);
+	return result;
+}
+
+/**
+ * raidxor_log_start() - starts using an opened log device
+ * @assembling: called from raidxor_run(), only an existing log of this
+ *              array is accepted
+ *
+ * When assembling, records left in the log by a crash are replayed
+ * into the cache and written back.  Otherwise the array served requests
+ * already, which may be newer than the records, so they are dropped.
+ * Then a new generation of records starts.  Must be
+ * called with the array quiesced.  The device is closed on failure.
+ * Returns 0 on success, else a negative error code.
+ */
+static int raidxor_log_start(raidxor_conf_t *conf, struct block_device *bdev,
+			     unsigned int assembling)
+{
+	raidxor_log_t *log;
+	unsigned long flags = 0;
+	unsigned int replayed = 0;
+	u64 n_pages;
+	int err;
+
+	err = -ENOMEM;
+	log = kzalloc(sizeof(raidxor_log_t), GFP_KERNEL);
+	if (!log)
+		goto out_close;
+
+	log->conf = conf;
+	log->bdev = bdev;
+	log->record_pages = 1 + conf->cache->n_buffers *
+		conf->cache->n_chunk_mult;
+	INIT_LIST_HEAD(&log->ios);
+	init_waitqueue_head(&log->wait);
+	mutex_init(&log->mutex);
+	INIT_WORK(&log->checkpoint_work, raidxor_log_checkpoint);
+
+	/* checkpoints wait for writebacks, not to be run on keventd */
+	log->wq = create_singlethread_workqueue("raidxor_log");
+	if (!log->wq)
+		goto out_free;
+
+	n_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (n_pages > 0) {
+		--n_pages;
+		do_div(n_pages, log->record_pages);
+		log->n_slots = min_t(u64, n_pages, UINT_MAX);
+	}
+
+	/* a checkpoint has to be able to free enough for every line */
+	err = -ENOSPC;
+	if (log->n_slots < 2 * conf->cache->n_lines) {
+		printk(KERN_ERR "raidxor: log device too small, needs %u "
+		       "records of %u pages\n", 2 * conf->cache->n_lines,
+		       log->record_pages);
+		goto out_free;
+	}
+
+	err = raidxor_log_read_super(log);
+	if (err > 0 && assembling)
+		err = -EBUSY;
+	if (err < 0) {
+		if (err == -EBUSY)
+			printk(KERN_ERR "raidxor: log device belongs to another "
+			       "array or layout\n");
+		goto out_free;
+	}
+
+	if (err > 0)
+		log->tail = log->head = 1;
+
+	WITHLOCKCONF(conf, flags, {
+	conf->log = log;
+	});
+
+	if (err == 0 && assembling)
+		replayed = raidxor_log_replay(log);
+
+	/* the replayed lines are written back, after that, records of
+	   the old generation are not needed anymore */
+	++log->generation;
+	err = raidxor_log_checkpoint_lines(log, 1);
+	if (!err)
+		err = raidxor_log_write_super(log, log->head);
+
+	/* without forced writes, records could be lost from the cache of
+	   the device after FUA requests were ended */
+	if (err)
+		printk(KERN_ERR "raidxor: log device can't force writes to "
+		       "disk, not using it\n");
+
+	if (err) {
+		WITHLOCKCONF(conf, flags, {
+		conf->log = NULL;
+		});
+		goto out_free;
+	}
+
+	WITHLOCKCONF(conf, flags, {
+	log->tail = log->head;
+	});
+
+	printk(KERN_INFO "raidxor: using log device with %u records, "
+	       "%u replayed\n", log->n_slots, replayed);
+
+	return 0;
+out_free:
+	if (log->wq)
+		destroy_workqueue(log->wq);
+	kfree(log);
+out_close:
+	close_bdev_excl(bdev);
+	return err;
+}
+
+/**
+ * raidxor_log_attach() - starts using a log device
+ * @path: the block device
+ *
+ * See raidxor_log_start().
+ */
+static int raidxor_log_attach(raidxor_conf_t *conf, const char *path)
+{
+	struct block_device *bdev;
+
+	if (conf->log)
+		return -EBUSY;
+
+	bdev = open_bdev_excl(path, 0, conf);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	return raidxor_log_start(conf, bdev, 0);
+}
+
+/**
+ * raidxor_log_attach_dev() - reattaches the log when assembling
+ * @dev: device number of the log, as stored in the layout
+ *
+ * Called from raidxor_super_load(), before the array serves requests,
+ * so the records are replayed before anything newer can exist.
+ */
+static int raidxor_log_attach_dev(raidxor_conf_t *conf, u32 dev)
+{
+	struct block_device *bdev;
+	int err;
+
+	if (conf->log)
+		return -EBUSY;
+
+	bdev = open_by_devnum(new_decode_dev(dev), FMODE_READ | FMODE_WRITE);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	err = bd_claim(bdev, conf);
+	if (err) {
+		blkdev_put(bdev);
+		return err;
+	}
+
+	return raidxor_log_start(conf, bdev, 1);
+}
+
+/**
+ * raidxor_log_close() - stops using the log device
+ *
+ * All lines have to be written back already, so the superblock is left
+ * without records to replay.
+ */
+static void raidxor_log_close(raidxor_conf_t *conf)
+{
+	raidxor_log_t *log = conf->log;
+	unsigned long flags = 0;
+
+	if (!log)
+		return;
+
+	cancel_work_sync(&log->checkpoint_work);
+
+	if (raidxor_log_checkpoint_lines(log, 1))
+		printk(KERN_ERR "raidxor: couldn't empty the log, don't "
+		       "attach it again\n");
+
+	WITHLOCKCONF(conf, flags, {
+	conf->log = NULL;
+	});
+
+	destroy_workqueue(log->wq);
+	close_bdev_excl(log->bdev);
+	kfree(log);
+}
+
+/**
+ * raidxor_log_dirty_lines() - checks for lines not yet written back
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_log_dirty_lines(cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; cache && i < cache->n_lines; ++i)
+		if (cache->lines[i]->status == CACHE_LINE_DIRTY ||
+		    cache->lines[i]->status == CACHE_LINE_LOGGING ||
+		    cache->lines[i]->status == CACHE_LINE_WRITEBACK)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * raidxor_log_detach() - writes everything back and closes the log
+ *
+ * Must be called with the array quiesced.
+ */
+static void raidxor_log_detach(raidxor_conf_t *conf)
+{
+	raidxor_log_t *log = conf->log;
+	unsigned long flags = 0;
+	unsigned int dirty;
+
+	if (!log)
+		return;
+
+	/* lines not logged yet need space first, which the next round
+	   frees */
+	do {
+		if (raidxor_log_checkpoint_lines(log, 1))
+			break;
+
+		WITHLOCKCONF(conf, flags, {
+		dirty = raidxor_log_dirty_lines(conf->cache);
+		});
+	} while (dirty);
+
+	raidxor_log_close(conf);
+}
+
+#if 0
+Local variables:
+c-basic-offset: 8
+End:
+#endif
@@ -3,6 +3,12 @@
 #include <linux/version.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/crc32.h>
 
 /* for do_div on 64bit machines */
 #include <asm/div64.h>
@@ -14,6 +20,7 @@
 
 #include "params.c"
 #include "utils.c"
+#include "decode.c"
 #include "conf.c"
 
 static int raidxor_cache_make_clean(cache_t *cache, unsigned int line)
@@ -37,13 +44,14 @@ static int raidxor_cache_make_clean(cache_t *cache, unsigned int line)
 		return 0;
 	}
 
-	if (cache->lines[line]->status != CACHE_LINE_READY ||
+	if (cache->lines[line]->status != CACHE_LINE_READY &&
 	    cache->lines[line]->status != CACHE_LINE_READYING) {
 		UNLOCKCONF(conf, flags);
 		return 1;
 	}
 
 	cache->lines[line]->status = CACHE_LINE_CLEAN;
+	raidxor_cache_unpin_line(cache, cache->lines[line]);
 	raidxor_cache_drop_line(cache, line);
 	});
 
@@ -74,6 +82,7 @@ static int raidxor_cache_make_ready(cache_t *cache, unsigned int n_line)
 
 	if (line->status == CACHE_LINE_READY || line->status == CACHE_LINE_UPTODATE) {
 		line->status = CACHE_LINE_READY;
+		raidxor_cache_unpin_line(cache, line);
 		UNLOCKCONF(conf, flags);
 		return 0;
 	}
@@ -86,15 +95,19 @@ static int raidxor_cache_make_ready(cache_t *cache, unsigned int n_line)
 	line->status = CACHE_LINE_READYING;
 	});
 
+	/* only allocates on first use, temporaries stay with the line */
 	if (raidxor_cache_line_ensure_temps(cache, n_line))
 		goto out_free_pages;
 
+	WITHLOCKCONF(conf, flags, {
 	for (i = 0; i < (cache->n_buffers + cache->n_red_buffers) * cache->n_chunk_mult; ++i) {
-		if (!(line->buffers[i] = alloc_page(GFP_NOIO)))
+		if (!(line->buffers[i] = raidxor_cache_get_page(cache,
+								line->node))) {
+			UNLOCKCONF(conf, flags);
 			goto out_free_pages;
+		}
 	}
 
-	WITHLOCKCONF(conf, flags, {
 	line->status = CACHE_LINE_READY;
 	});
 
@@ -119,84 +132,419 @@ static int raidxor_cache_make_load_me(cache_t *cache, unsigned int line,
 
 	cache->lines[line]->status = CACHE_LINE_LOAD_ME;
 	cache->lines[line]->sector = sector;
+	cache->lines[line]->hits = 0;
+	raidxor_cache_unpin_line(cache, cache->lines[line]);
+
+	/* a new strip, nothing is valid or wanted yet */
+	bitmap_zero(cache->lines[line]->valid, cache->conf->n_units);
+	bitmap_zero(cache->lines[line]->want, cache->conf->n_units);
+	bitmap_zero(cache->lines[line]->bad, cache->conf->n_units);
 
 	return 0;
 }
 
 /**
- * raidxor_valid_decoding() - checks for necessary equation(s)
+ * raidxor_cache_repairable() - decides how to handle a read error
  *
- * Returns 1 if everything is okay, else 0.
+ * A read error usually affects a few sectors only, so the unit's data
+ * is decoded from the other units, or encoded again from the data if
+ * it's a redundant one, and written back in place, which lets the
+ * drive remap them.  The unit is failed as a whole once its member had
+ * max_read_errors errors, or if the strip can't be repaired without
+ * another unit that failed to read.
+ *
+ * Used for the scrub's line as well.  Needs to be called with
+ * conf->device_lock held.
  */
-static unsigned int raidxor_valid_decoding(cache_t *cache, unsigned int n_line)
+static unsigned int raidxor_cache_repairable(raidxor_conf_t *conf,
+					     cache_line_t *line,
+					     unsigned int unit)
 {
-#undef CHECK_RETURN_VALUE
-#define CHECK_RETURN_VALUE 0
-	cache_line_t *line;
-	unsigned int i;
-	raidxor_bio_t *rxbio;
-	raidxor_conf_t *conf;
-
-	CHECK_ARG_RET_VAL(cache);
-	CHECK_PLAIN_RET_VAL(n_line < cache->n_lines);
-
-	conf = cache->conf;
-	CHECK_PLAIN_RET_VAL(conf);
+	disk_info_t *info = &conf->units[unit];
+	unsigned int i, n = conf->n_units;
+	DECLARE_BITMAP(inputs, RAIDXOR_MAX_UNITS);
+
+	/* counted like md's other personalities, see the errors
+	   attribute of the member */
+	if (!info->rdev ||
+	    (!info->decoding && !raidxor_unit_reencoded(info)) ||
+	    atomic_inc_return(&info->rdev->corrected_errors) >
+	    max_read_errors)
+		return 0;
 
-	line = cache->lines[n_line];
-	CHECK_PLAIN_RET_VAL(line);
+	bitmap_zero(inputs, n);
+	if (raidxor_unit_reencoded(info))
+		raidxor_encoding_units(conf, info->encoding, inputs);
+	else
+		raidxor_decoding_units(conf, info->decoding, inputs, NULL);
+	if (test_bit(unit, inputs) || bitmap_intersects(inputs, line->bad, n))
+		return 0;
 
-	rxbio = line->rxbio;
-	CHECK_PLAIN_RET_VAL(rxbio);
+	for (i = find_first_bit(inputs, n); i < n;
+	     i = find_next_bit(inputs, n, i + 1))
+		if (!raidxor_unit_readable(&conf->units[i]))
+			return 0;
 
-	for (i = 0; i < conf->n_units; ++i)
-		if (test_bit(Faulty, &conf->units[i].rdev->flags) &&
-		    !conf->units[i].redundant &&
-		    !conf->units[i].decoding)
+	/* nor may the unit be needed for one that failed before */
+	for (i = find_first_bit(line->bad, n); i < n;
+	     i = find_next_bit(line->bad, n, i + 1)) {
+		bitmap_zero(inputs, n);
+		if (raidxor_unit_reencoded(&conf->units[i]))
+			raidxor_encoding_units(conf, conf->units[i].encoding,
+					       inputs);
+		else if (conf->units[i].decoding)
+			raidxor_decoding_units(conf, conf->units[i].decoding,
+					       inputs, NULL);
+		if (test_bit(unit, inputs))
 			return 0;
+	}
 
 	return 1;
 }
 
-static unsigned int raidxor_bio_index(raidxor_conf_t *conf,
-				      raidxor_bio_t *rxbio,
-				      struct bio *bio,
-				      unsigned int *data_index)
+/**
+ * raidxor_cache_plan_load() - decides which units a load reads
+ *
+ * Wanted units which aren't valid yet are read directly if possible.
+ * For the others, the units their decoding needs are read and they're
+ * recovered afterwards, see raidxor_cache_recover().  So a degraded
+ * read costs the width of the decoding instead of the whole strip.
+ *
+ * Units which failed to read in this strip are decoded as well, as
+ * long as they have a decoding; redundant ones a decoding needs are
+ * encoded again from the data units instead.  See
+ * raidxor_cache_repairable().
+ *
+ * Returns 1 if a wanted unit can't be recovered, else 0.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_plan_load(cache_t *cache,
+					    cache_line_t *line)
 {
-	unsigned int i, k;
+	raidxor_conf_t *conf = cache->conf;
+	unsigned int i, n = conf->n_units;
+
+	bitmap_zero(line->loading, n);
+	bitmap_zero(line->recovering, n);
 
-	for (i = 0, k = 0; i < rxbio->n_bios; ++i) {
-		if (rxbio->bios[i] == bio) {
-			if (data_index)
-				*data_index = k;
-			return i;
+	for (i = find_first_bit(line->want, n); i < n;
+	     i = find_next_bit(line->want, n, i + 1)) {
+		if (test_bit(i, line->valid))
+			continue;
+
+		if (raidxor_unit_readable(&conf->units[i]) &&
+		    !(test_bit(i, line->bad) && conf->units[i].decoding)) {
+			__set_bit(i, line->loading);
+			continue;
 		}
-		if (!conf->units[i].redundant) ++k;
+
+		if (!conf->units[i].decoding)
+			return 1;
+
+		__set_bit(i, line->recovering);
+		raidxor_decoding_units(conf, conf->units[i].decoding,
+				       line->loading, NULL);
+	}
+
+	for (i = find_first_bit(line->loading, n); i < n;
+	     i = find_next_bit(line->loading, n, i + 1)) {
+		if (test_bit(i, line->valid) || !test_bit(i, line->bad) ||
+		    !raidxor_unit_reencoded(&conf->units[i]))
+			continue;
+
+		__clear_bit(i, line->loading);
+		__set_bit(i, line->recovering);
+		raidxor_encoding_units(conf, conf->units[i].encoding,
+				       line->loading);
 	}
-	CHECK_BUG("didn't find bio");
+
+	bitmap_andnot(line->loading, line->loading, line->valid, n);
+
 	return 0;
 }
 
-static void raidxor_cache_commit_bio(cache_t *cache, unsigned int n_line)
+/**
+ * raidxor_bio_position() - absolute position of a bio on its disk
+ *
+ * Units are usually partitions, so the partition offset has to be
+ * added to get comparable sectors for all units of a resource.
+ */
+static sector_t raidxor_bio_position(struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+
+	if (bdev->bd_contains != bdev && bdev->bd_part)
+		return bio->bi_sector + bdev->bd_part->start_sect;
+	return bio->bi_sector;
+}
+
+/**
+ * raidxor_resource_queue_bio() - queues a bio sorted by disk position
+ * @background: the bio belongs to a resync, rebuild or scrub
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_resource_queue_bio(resource_t *resource, struct bio *bio,
+				       unsigned int background)
+{
+	struct bio **link;
+	sector_t position = raidxor_bio_position(bio);
+
+	CHECK_ARG_RET(resource);
+	CHECK_ARG_RET(bio);
+
+	link = background ? &resource->background : &resource->pending;
+	while (*link && raidxor_bio_position(*link) <= position)
+		link = &(*link)->bi_next;
+
+	bio->bi_next = *link;
+	*link = bio;
+}
+
+static unsigned int raidxor_resource_has_reads(resource_t *resource)
+{
+	struct bio *bio;
+
+	for (bio = resource->pending; bio; bio = bio->bi_next)
+		if (bio_data_dir(bio) == READ)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * raidxor_resource_sweep_bio() - takes the next bio of a queue
+ * @reads: only take reads
+ *
+ * Returns the first bio at or behind the current head position, or
+ * wraps around to the lowest one, so that a disk is swept in one
+ * direction across lines.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_resource_sweep_bio(resource_t *resource,
+					       struct bio **queue,
+					       unsigned int reads)
+{
+	struct bio **link, **first = NULL, *bio;
+
+	for (link = queue; *link; link = &(*link)->bi_next) {
+		if (reads && bio_data_dir(*link) != READ)
+			continue;
+
+		if (!first)
+			first = link;
+
+		if (raidxor_bio_position(*link) >= resource->head)
+			break;
+	}
+
+	if (!*link)
+		link = first;
+
+	if (!link)
+		return NULL;
+
+	bio = *link;
+	*link = bio->bi_next;
+	bio->bi_next = NULL;
+	resource->head = raidxor_bio_position(bio) + (bio->bi_size >> 9);
+
+	return bio;
+}
+
+/**
+ * raidxor_resource_dequeue_bio() - takes the next bio of a resource
+ *
+ * Reads, which requests are waiting for, are taken before writebacks,
+ * unless writes were passed over RAIDXOR_WRITES_STARVED times already.
+ * Background bios only get resync_share percent of the dispatches
+ * while foreground bios are waiting, but all of an idle resource.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_resource_dequeue_bio(resource_t *resource)
+{
+	struct bio *bio;
+	unsigned int reads, share;
+
+	CHECK_ARG_RET_NULL(resource);
+
+	share = resync_share < 0 ? 0 : min(resync_share, 100);
+
+	/* a foreground dispatch earns the background share, a background
+	   one costs the rest */
+	if (resource->background &&
+	    (!resource->pending || resource->background_credit >= 100 - share)) {
+		bio = raidxor_resource_sweep_bio(resource,
+						 &resource->background, 0);
+		resource->background_credit -=
+			min(resource->background_credit, 100 - share);
+		return bio;
+	}
+
+	reads = resource->writes_starved < RAIDXOR_WRITES_STARVED &&
+		raidxor_resource_has_reads(resource);
+
+	bio = raidxor_resource_sweep_bio(resource, &resource->pending, reads);
+	if (!bio)
+		return NULL;
+
+	if (bio_data_dir(bio) == READ && resource->pending)
+		++resource->writes_starved;
+	else resource->writes_starved = 0;
+
+	/* no credit is saved up while there's nothing to catch up with */
+	if (resource->background)
+		resource->background_credit += share;
+	else resource->background_credit = 0;
+
+	return bio;
+}
+
+/**
+ * raidxor_dispatch_resource() - submits queued bios of a resource
+ *
+ * Takes as many bios as the queue depth allows in one go and submits
+ * them outside of the lock.
+ */
+static void raidxor_dispatch_resource(raidxor_conf_t *conf,
+				      resource_t *resource)
+{
+	struct bio *bio, *batch = NULL, **tail = &batch;
+	unsigned long flags = 0;
+
+	CHECK_ARG_RET(conf);
+	CHECK_ARG_RET(resource);
+
+	WITHLOCKCONF(conf, flags, {
+	while (resource->in_flight < resource_queue_depth &&
+	       (bio = raidxor_resource_dequeue_bio(resource))) {
+		++resource->in_flight;
+		*tail = bio;
+		tail = &bio->bi_next;
+	}
+	});
+
+	while ((bio = batch)) {
+		batch = bio->bi_next;
+		bio->bi_next = NULL;
+		generic_make_request(bio);
+	}
+}
+
+static void raidxor_dispatch_resources(raidxor_conf_t *conf)
 {
 	unsigned int i;
+
+	CHECK_ARG_RET(conf);
+
+	if (!conf->resources)
+		return;
+
+	for (i = 0; i < conf->n_resources; ++i)
+		raidxor_dispatch_resource(conf, conf->resources[i]);
+}
+
+/**
+ * raidxor_resource_end_bio() - accounts a finished bio of a unit
+ *
+ * Returns 1 if the resource has more bios waiting, which then have
+ * to be submitted from the thread.
+ *
+ * Once a failed member has no bios left, md is told to try again to
+ * remove it, so a spare can take its place.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_resource_end_bio(disk_info_t *unit)
+{
+#undef CHECK_RETURN_VALUE
+#define CHECK_RETURN_VALUE 0
+	resource_t *resource;
+	mdk_rdev_t *rdev = unit ? unit->rdev : NULL;
+
+	CHECK_ARG_RET_VAL(unit);
+
+	resource = unit->resource;
+	CHECK_PLAIN_RET_VAL(resource);
+
+	if (rdev && atomic_dec_and_test(&rdev->nr_pending) &&
+	    test_bit(Faulty, &rdev->flags)) {
+		set_bit(MD_RECOVERY_NEEDED, &rdev->mddev->recovery);
+		md_wakeup_thread(rdev->mddev->thread);
+	}
+
+	--resource->in_flight;
+	return resource->pending != NULL || resource->background != NULL;
+}
+
+/**
+ * raidxor_cache_commit_bio() - hands the bios of a line to the resources
+ *
+ * The bios are sorted into the queues of the resources, so that units
+ * sharing a disk are accessed in ascending order instead of in unit
+ * order.  Each bio pins the member it goes to, see
+ * raidxor_remove_disk().
+ *
+ * Bios of the scrub and of resync lines nobody waits for go to the
+ * background queues, see raidxor_resource_dequeue_bio().
+ */
+static void raidxor_cache_commit_bio(cache_t *cache, unsigned int n_line)
+{
+	unsigned int i, j, index, background;
+	cache_line_t *line;
 	raidxor_bio_t *rxbio;
+	raidxor_conf_t *conf;
+	resource_t *resource;
+	unsigned long flags = 0;
 
 	CHECK_ARG_RET(cache);
 	CHECK_PLAIN_RET(n_line < cache->n_lines);
 	CHECK_PLAIN_RET(cache->lines[n_line]);
 
-	rxbio = cache->lines[n_line]->rxbio;
+	line = cache->lines[n_line];
+	rxbio = line->rxbio;
 	CHECK_PLAIN_RET(rxbio);
 
-	for (i = 0; i < rxbio->n_bios; ++i)
-		if (!test_bit(Faulty, &cache->conf->units[i].rdev->flags))
-			generic_make_request(rxbio->bios[i]);
+	conf = cache->conf;
+
+	WITHLOCKCONF(conf, flags, {
+	background = cache != conf->cache ||
+		(test_bit(CACHE_LINE_RESYNC, &line->flags) &&
+		 !line->waiting && !line->syncing &&
+		 !test_bit(CACHE_LINE_FLUSH, &line->flags));
+
+	for (i = 0; i < conf->n_resources; ++i) {
+		resource = conf->resources[i];
+		for (j = 0; j < resource->n_units; ++j) {
+			index = resource->units[j] - conf->units;
+			/* skipped units were left without device */
+			if (!rxbio->bios[index]->bi_bdev)
+				continue;
+
+			if (conf->units[index].rdev)
+				atomic_inc(&conf->units[index].rdev->nr_pending);
+			raidxor_resource_queue_bio(resource, rxbio->bios[index],
+						   background);
+		}
+	}
+	});
+
+	raidxor_dispatch_resources(conf);
 }
 
 static void raidxor_end_load_line(struct bio *bio, int error);
 static void raidxor_end_writeback_line(struct bio *bio, int error);
 
+/**
+ * raidxor_cache_load_line() - reads the units a line's requests need
+ *
+ * Returns 0 if bios were prepared, which have to be committed, else 1.
+ * If there's nothing to read, because the wanted units can be decoded
+ * from valid ones, the line goes on directly.
+ */
 static int raidxor_cache_load_line(cache_t *cache, unsigned int n_line)
 {
 #undef CHECK_JUMP_LABEL
@@ -206,7 +554,7 @@ static int raidxor_cache_load_line(cache_t *cache, unsigned int n_line)
 	/* sector inside the stripe */
 	raidxor_bio_t *rxbio;
 	struct bio *bio;
-	unsigned int i, j, k, l, n_chunk_mult;
+	unsigned int i, lost, queued = 0;
 	unsigned long flags = 0;
 
  	CHECK_FUN(raidxor_cache_load_line);
@@ -220,98 +568,114 @@ static int raidxor_cache_load_line(cache_t *cache, unsigned int n_line)
 	line = cache->lines[n_line];
 
 	WITHLOCKCONF(conf, flags, {
-	if (line->status == CACHE_LINE_LOAD_ME)
+	/* an uptodate line is only partially loaded, see line_work */
+	if (line->status == CACHE_LINE_LOAD_ME ||
+	    line->status == CACHE_LINE_UPTODATE)
 		line->status = CACHE_LINE_LOADING;
 	else {
 		UNLOCKCONF(conf, flags);
 		goto out;
 	}
+
+	lost = raidxor_cache_plan_load(cache, line);
 	});
 
+	if (lost)
+		goto out_lost;
+
 	/* unrecoverable error, abort */
 	if (test_bit(CONF_ERROR, &conf->flags)) {
 		CHECK_BUG("conf with error code in load_line");
 		goto out;
 	}
 
-	rxbio = raidxor_alloc_bio(conf->n_units);
-	CHECK_PLAIN(rxbio);
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out_free_bio
-
-	rxbio->cache = cache;
-	rxbio->line = n_line;
-	rxbio->remaining = rxbio->n_bios;
-
-	line->rxbio = rxbio;
-
-	n_chunk_mult = cache->n_chunk_mult;
-
-	for (i = 0, l = 0; i < rxbio->n_bios; ++i) {
-		/* we also load the redundant pages */
-
-		/* only one chunk */
-		rxbio->bios[i] = bio = bio_alloc(GFP_NOIO, n_chunk_mult);
-		CHECK_ALLOC(rxbio->bios[i]);
-
-		bio->bi_rw = READ;
-		bio->bi_private = rxbio;
-		bio->bi_bdev = conf->units[i].rdev->bdev;
-		bio->bi_end_io = raidxor_end_load_line;
-
-		bio->bi_sector = line->sector;
-		/* bio->bi_sector = actual_sector / stripe->n_data_units + */
-		/* 	stripe->units[i].rdev->data_offset; */
-		do_div(bio->bi_sector, conf->n_data_units);
-		bio->bi_sector += conf->units[i].rdev->data_offset;
-
-		bio->bi_size = n_chunk_mult * PAGE_SIZE;
-
-		/* assign pages */
-		bio->bi_vcnt = n_chunk_mult;
-		for (j = 0; j < n_chunk_mult; ++j) {
-			if (conf->units[i].redundant)
-				k = (cache->n_buffers + l) * n_chunk_mult + j;
-			else k = i * n_chunk_mult + j;
+	rxbio = raidxor_cache_start_bio(cache, n_line);
 
-			CHECK_PLAIN(line->buffers[k]);
-			bio->bi_io_vec[j].bv_page = line->buffers[k];
-
-			bio->bi_io_vec[j].bv_len = PAGE_SIZE;
-			bio->bi_io_vec[j].bv_offset = 0;
+	for (i = 0; i < rxbio->n_bios; ++i) {
+		/* recovery works on the line's buffers, only the units of
+		   the plan need a bio */
+		if (!test_bit(i, line->loading)) {
+			rxbio->bios[i]->bi_bdev = NULL;
+			--rxbio->remaining;
+			continue;
 		}
 
-		if (conf->units[i].redundant) ++l;
+		raidxor_cache_prepare_bio(cache, n_line, i, READ,
+					  raidxor_end_load_line);
+	}
 
-		if (test_bit(Faulty, &conf->units[i].rdev->flags)) {
-			--rxbio->remaining;
-			if (!conf->units[i].redundant)
-				rxbio->faulty = 1;
+	WITHLOCKCONF(conf, flags, {
+	if (rxbio->remaining == 0) {
+		if (bitmap_empty(line->recovering, conf->n_units)) {
+			line->status = CACHE_LINE_UPTODATE;
+			line->rxbio = NULL;
 		}
+		else line->status = CACHE_LINE_FAULTY;
+		UNLOCKCONF(conf, flags);
+		return 1;
 	}
 
-	WITHLOCKCONF(conf, flags, {
 	++cache->active_lines;
 	});
 
 	return 0;
-out_free_bio: __attribute__((unused))
-	raidxor_free_bio(rxbio);
+out_lost:
+	WITHLOCKCONF(conf, flags, {
+	/* the decodings of a new failure are still being derived,
+	   wait for them */
+	if (test_bit(CONF_DERIVING, &conf->flags)) {
+		set_bit(CACHE_LINE_PARKED, &line->flags);
+		bio = NULL;
+	}
+	else {
+		bio = raidxor_cache_lose_units(cache, n_line);
+		queued = line->waiting != NULL;
+	}
+	});
+
+	/* fail the requests needing lost units, but keep what's valid */
+	raidxor_cache_fail_requests(conf, bio);
+	if (queued)
+		raidxor_wakeup_thread(conf);
+	return 1;
 out: __attribute__((unused))
 	raidxor_cache_abort_requests(cache, n_line);
+
+	WITHLOCKCONF(conf, flags, {
+	raidxor_cache_end_resync(cache, n_line, 0);
+	});
 	return 1;
 }
 
+/**
+ * raidxor_cache_writeback_line() - writes a dirty line to its units
+ *
+ * Only units which aren't faulty get a bio, and only their encodings
+ * and the temporaries those use are computed.  Failed data units were
+ * decoded or overwritten before the line became dirty, so in degraded
+ * mode the writeback costs no more than with all units present.
+ *
+ * A clean pinned line only writes its decoded units to the spare they
+ * are rebuilt on, see raidxor_cache_pin_line().
+ *
+ * If the line can't be written at all, it keeps its status and the
+ * FUA requests, flush, checkpoint or resync waiting for it fail.
+ *
+ * Returns 0 if bios were prepared, which have to be committed, else 1.
+ */
 static int raidxor_cache_writeback_line(cache_t *cache, unsigned int n_line)
 {
 #undef CHECK_JUMP_LABEL
 #define CHECK_JUMP_LABEL out
 	cache_line_t *line;
 	raidxor_bio_t *rxbio;
-	unsigned int i, j, k, l, n_chunk_mult;
-	struct bio *bio;
-	unsigned long flags = 0;
+	struct bio *bio, *syncing = NULL;
+	unsigned int i, spare;
+	unsigned long flags = 0, status;
 	raidxor_conf_t *conf = cache->conf;
+	disk_info_t *unit;
+	DECLARE_BITMAP(written, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(temps, RAIDXOR_MAX_UNITS);
 
  	CHECK_FUN(raidxor_cache_writeback_line);
 
@@ -320,68 +684,80 @@ static int raidxor_cache_writeback_line(cache_t *cache, unsigned int n_line)
 
 	line = cache->lines[n_line];
 
-	WITHLOCKCONF(conf, flags, {
-	if (line->status == CACHE_LINE_DIRTY)
-		line->status = CACHE_LINE_WRITEBACK;
-	else {
-		UNLOCKCONF(conf, flags);
+	/* the strip goes to the log first, see raidxor_log_line() */
+	if (!raidxor_log_line(cache, n_line))
 		goto out;
-	}
-	});
 
-	rxbio = raidxor_alloc_bio(conf->n_units);
-	CHECK_PLAIN(rxbio);
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out_free_bio
+	bitmap_zero(written, conf->n_units);
 
-	rxbio->cache = cache;
-	rxbio->line = n_line;
-	rxbio->remaining = rxbio->n_bios;
+	WITHLOCKCONF(conf, flags, {
+	spare = line->status == CACHE_LINE_UPTODATE &&
+		!test_bit(CACHE_LINE_RESYNC, &line->flags) &&
+		test_and_clear_bit(CACHE_LINE_SPARE, &line->flags);
+
+	/* a resync also writes back clean lines */
+	if (line->status == CACHE_LINE_DIRTY ||
+	    (line->status == CACHE_LINE_UPTODATE &&
+	     test_bit(CACHE_LINE_RESYNC, &line->flags)) || spare) {
+		for (i = 0; i < conf->n_units; ++i) {
+			unit = &conf->units[i];
+			if (raidxor_unit_faulty(unit))
+				continue;
+			if (spare && (unit->redundant ||
+				      raidxor_unit_readable(unit) ||
+				      !test_bit(i, line->valid)))
+				continue;
+			__set_bit(i, written);
+		}
 
-	line->rxbio = rxbio;
+		/* the dirty ones go to the spare as well */
+		clear_bit(CACHE_LINE_SPARE, &line->flags);
+	}
 
-	n_chunk_mult = cache->n_chunk_mult;
+	/* with every unit faulty, the line stays as it is */
+	if (bitmap_empty(written, conf->n_units)) {
+		syncing = raidxor_cache_line_unpersisted(cache, n_line);
+		UNLOCKCONF(conf, flags);
+		goto out_fail;
+	}
 
-	for (i = 0, l = 0; i < rxbio->n_bios; ++i) {
-		/* only one chunk */
-		rxbio->bios[i] = bio = bio_alloc(GFP_NOIO, cache->n_chunk_mult);
-		CHECK_ALLOC(rxbio->bios[i]);
+	status = line->status;
+	line->status = CACHE_LINE_WRITEBACK;
+	});
 
-		bio->bi_rw = WRITE;
-		bio->bi_private = rxbio;
-		bio->bi_bdev = conf->units[i].rdev->bdev;
-		bio->bi_end_io = raidxor_end_writeback_line;
-
-		bio->bi_sector = line->sector;
-		/* bio->bi_sector = actual_sector / stripe->n_data_units + */
-		/* 	stripe->units[i].rdev->data_offset; */
-		do_div(bio->bi_sector, conf->n_data_units);
-		bio->bi_sector += conf->units[i].rdev->data_offset;
-
-		bio->bi_size = n_chunk_mult * PAGE_SIZE;
-
-		bio->bi_vcnt = n_chunk_mult;
-		/* assign pages */
-		for (j = 0; j < n_chunk_mult; ++j) {
-			if (conf->units[i].redundant)
-				k = (cache->n_buffers + l) * n_chunk_mult + j;
-			else k = i * n_chunk_mult + j;
-
-			bio->bi_io_vec[j].bv_page = line->buffers[k];
-			bio->bi_io_vec[j].bv_len = PAGE_SIZE;
-			bio->bi_io_vec[j].bv_offset = 0;
-		}
+	/* the region stays dirty in the bitmap until the whole line
+	   is on disk */
+	bitmap_startwrite(conf->mddev->bitmap,
+			  raidxor_member_sector(conf, line->sector),
+			  (conf->chunk_size >> 9) * conf->units_per_member, 0);
 
-		if (conf->units[i].redundant) ++l;
+	rxbio = raidxor_cache_start_bio(cache, n_line);
 
-		if (test_bit(Faulty, &conf->units[i].rdev->flags)) {
+	bitmap_zero(temps, RAIDXOR_MAX_UNITS);
+
+	for (i = 0; i < rxbio->n_bios; ++i) {
+		/* a skipped unit keeps the region dirty */
+		if (!test_bit(i, written)) {
+			rxbio->bios[i]->bi_bdev = NULL;
 			--rxbio->remaining;
-			if (!conf->units[i].redundant)
-				rxbio->faulty = 1;
+			rxbio->faulty = 1;
+			continue;
 		}
+
+		raidxor_cache_prepare_bio(cache, n_line, i,
+					  test_bit(CACHE_LINE_SYNC, &line->flags) ?
+					  RAIDXOR_FUA_RW : WRITE,
+					  raidxor_end_writeback_line);
+
+		if (conf->units[i].redundant)
+			raidxor_encoding_temps(conf, conf->units[i].encoding,
+					       temps);
 	}
 
+	/* temporaries in order, they only refer to earlier ones */
 	for (i = 0; i < conf->n_enc_temps; ++i) {
+		if (!test_bit(i, temps))
+			continue;
 		if (raidxor_xor_combine_encode_temporary(cache, n_line,
 							 &line->temp_buffers[i * cache->n_chunk_mult],
 							 rxbio,
@@ -390,7 +766,8 @@ static int raidxor_cache_writeback_line(cache_t *cache, unsigned int n_line)
 	}
 	
 	for (i = 0; i < rxbio->n_bios; ++i) {
-		if (!conf->units[i].redundant) continue;
+		if (!conf->units[i].redundant || !test_bit(i, written))
+			continue;
 		if (raidxor_xor_combine_encode(cache, n_line,
 					       rxbio->bios[i], rxbio,
 					       conf->units[i].encoding))
@@ -398,23 +775,92 @@ static int raidxor_cache_writeback_line(cache_t *cache, unsigned int n_line)
 	}
 
 	WITHLOCKCONF(conf, flags, {
+	/* the written redundant units are in the line now, later plans
+	   may decode from them without reading */
+	for (i = 0; i < conf->n_units; ++i)
+		if (conf->units[i].redundant && test_bit(i, written))
+			__set_bit(i, line->valid);
+
 	++cache->active_lines;
 	});
 
+	/* the bitmap has to be on disk before the data is written */
+	bitmap_unplug(conf->mddev->bitmap);
+
 	return 0;
 out_free_bio:
-	raidxor_free_bio(rxbio);
+	line->rxbio = NULL;
+
+	bitmap_endwrite(conf->mddev->bitmap,
+			raidxor_member_sector(conf, line->sector),
+			(conf->chunk_size >> 9) * conf->units_per_member,
+			0, 0);
+
+	/* the encodings can't be computed, trying again won't help */
+	WITHLOCKCONF(conf, flags, {
+	line->status = status;
+	syncing = raidxor_cache_line_unpersisted(cache, n_line);
+	});
+out_fail:
+	while ((bio = syncing)) {
+		syncing = bio->bi_next;
+		bio->bi_next = NULL;
+		bio_io_error(bio);
+	}
 out: __attribute__((unused))
 	return 1;
 }
 
+static int raidxor_handle_line(cache_t *cache, unsigned int n_line);
+
+/**
+ * raidxor_serve_line() - serves the requests of a freshly loaded line
+ *
+ * Queued by raidxor_end_load_line(), so that waiting requests are
+ * completed without a round trip through the workers.  If a worker owns
+ * the line right now, it's left to that worker.
+ */
+static void raidxor_serve_line(struct work_struct *work)
+{
+	cache_line_t *line = container_of(work, cache_line_t, serve_work);
+	cache_t *cache = line->cache;
+	raidxor_conf_t *conf = cache->conf;
+	unsigned int own = 0, done, queued;
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	if (test_bit(CACHE_LINE_BUSY, &line->flags))
+		set_bit(CACHE_LINE_REQUEUE, &line->flags);
+	else {
+		set_bit(CACHE_LINE_BUSY, &line->flags);
+		clear_bit(CACHE_LINE_REQUEUE, &line->flags);
+		list_del_init(&line->work);
+		own = 1;
+	}
+	});
+
+	if (!own)
+		return;
+
+	done = raidxor_handle_line(cache, line->index);
+
+	WITHLOCKCONF(conf, flags, {
+	raidxor_cache_release_line(cache, line->index, done);
+	queued = !list_empty(&line->work);
+	});
+
+	/* only if the line needs the workers now, e.g. for writeback */
+	if (queued)
+		raidxor_wakeup_thread(conf);
+}
+
 static void raidxor_end_load_line(struct bio *bio, int error)
 {
 	raidxor_bio_t *rxbio;
 	raidxor_conf_t *conf;
 	cache_t *cache;
 	cache_line_t *line;
-	unsigned int index, data_index, wake = 0;
+	unsigned int index, wake = 0, repair = 0;
 	unsigned long flags = 0;
 
 	CHECK_FUN(raidxor_end_load_line);
@@ -435,27 +881,45 @@ static void raidxor_end_load_line(struct bio *bio, int error)
 	conf = rxbio->cache->conf;
 	CHECK_PLAIN_RET(conf);
 
-	index = raidxor_bio_index(conf, rxbio, bio, &data_index);
+	index = raidxor_bio_unit(bio);
 
 	if (error) {
+		/* the unit stays invalid, it's planned again afterwards
+		   and then decoded, or read from its replacement */
 		WITHLOCKCONF(conf, flags, {
-		if (!conf->units[index].redundant)
-			rxbio->faulty = 1;
+		clear_bit(index, line->loading);
+		repair = raidxor_cache_repairable(conf, line, index);
+		if (repair)
+			__set_bit(index, line->bad);
 		});
-		md_error(conf->mddev, conf->units[index].rdev);
+		if (!repair)
+			md_error(conf->mddev, conf->units[index].rdev);
 	}
 
 	WITHLOCKCONF(conf, flags, {
+	/* the thread has to submit bios held back by the resource */
+	if (raidxor_resource_end_bio(&conf->units[index]))
+		wake = 1;
 	if ((--rxbio->remaining) == 0) {
-		if (rxbio->faulty)
+		bitmap_or(line->valid, line->valid, line->loading,
+			  conf->n_units);
+		if (!bitmap_empty(line->recovering, conf->n_units))
 			line->status = CACHE_LINE_FAULTY;
 		else  {
 			line->status = CACHE_LINE_UPTODATE;
 			line->rxbio = NULL;
-			raidxor_free_bio(rxbio);
 		}
 		--cache->active_lines;
-		wake = 1;
+		raidxor_wake_quiesce(conf);
+
+		/* skip the workers for serving the waiting requests */
+		if (line->status == CACHE_LINE_UPTODATE && line->waiting &&
+		    !test_bit(CACHE_LINE_BUSY, &line->flags))
+			queue_work(raidxor_wq, &line->serve_work);
+		else {
+			raidxor_cache_queue_line(cache, rxbio->line);
+			wake = 1;
+		}
 	}
 	});
 
@@ -468,7 +932,9 @@ static void raidxor_end_writeback_line(struct bio *bio, int error)
 	raidxor_conf_t *conf;
 	cache_t *cache;
 	cache_line_t *line;
-	unsigned int index, data_index, wake = 0;
+	struct bio *syncing = NULL;
+	unsigned int index, wake = 0, done = 0, degraded = 0, lost = 0;
+	sector_t sector = 0;
 	unsigned long flags = 0;
 
 	CHECK_FUN(raidxor_end_writeback_line);
@@ -489,23 +955,59 @@ static void raidxor_end_writeback_line(struct bio *bio, int error)
 	conf = rxbio->cache->conf;
 	CHECK_PLAIN_RET(conf);
 
-	index = raidxor_bio_index(conf, rxbio, bio, &data_index);
+	index = raidxor_bio_unit(bio);
 
 	if (error)
 		md_error(conf->mddev, conf->units[index].rdev);
 
 	WITHLOCKCONF(conf, flags, {
+	if (error)
+		rxbio->faulty = 1;
+	if (raidxor_resource_end_bio(&conf->units[index]))
+		wake = 1;
 	if ((--rxbio->remaining) == 0) {
 		line->status = CACHE_LINE_UPTODATE;
 
 		line->rxbio = NULL;
-		raidxor_free_bio(rxbio);
+		done = 1;
+		degraded = rxbio->faulty;
+		lost = !raidxor_conf_recoverable(conf);
+		sector = raidxor_member_sector(conf, line->sector);
+
+		raidxor_cache_line_end_write(cache, line);
+		raidxor_log_forget_line(conf, line);
+
+		syncing = raidxor_cache_line_persisted(cache, line);
+
+		/* write errors fail the device, which stops the resync */
+		raidxor_cache_end_resync(cache, rxbio->line, 1);
 
 		--cache->active_lines;
+		raidxor_wake_quiesce(conf);
+		/* requests may have arrived during the writeback */
+		raidxor_cache_queue_line(cache, rxbio->line);
 		wake = 1;
+
+		/* a replay of the log may wait for the line */
+		if (waitqueue_active(&cache->wait_for_line))
+			wake_up(&cache->wait_for_line);
 	}
 	});
 
+	/* a degraded region stays dirty for the rebuild */
+	if (done)
+		bitmap_endwrite(conf->mddev->bitmap, sector,
+				(conf->chunk_size >> 9) * conf->units_per_member,
+				!degraded, 0);
+
+	/* FUA requests in this line are on disk now; units which weren't
+	   written are decoded from the others, unless that's impossible */
+	while ((bio = syncing)) {
+		syncing = bio->bi_next;
+		bio->bi_next = NULL;
+		bio_endio(bio, lost ? -EIO : 0);
+	}
+
 	if (wake) raidxor_wakeup_thread(conf);
 }
 
@@ -521,14 +1023,12 @@ static int raidxor_xor_combine_temporary(cache_t *cache,
 #define CHECK_JUMP_LABEL out
 	unsigned int i, j, k, index;
 	unsigned int err __attribute__((unused));
-	struct bio *biofrom;
 	unsigned char *tomapped;
 	struct page **temps;
 	unsigned int nsrcs = 0;
-	const unsigned int nblocks = 5;
-	struct page *pages[nblocks];
-	void *srcs[nblocks];
-	struct bio *bios[nblocks];
+	const unsigned int nblocks = MAX_XOR_BLOCKS;
+	struct page *pages[MAX_XOR_BLOCKS];
+	void *srcs[MAX_XOR_BLOCKS];
 	raidxor_conf_t *conf;
 
 	CHECK_FUN(raidxor_xor_combine_temporary);
@@ -549,9 +1049,10 @@ static int raidxor_xor_combine_temporary(cache_t *cache,
 		raidxor_copy_pages(cache->n_chunk_mult, target, temps);
 	}
 	else {
-		/* copying first bio buffers */
-		biofrom = raidxor_find_bio(rxbio, units[0].disk);
-		raidxor_copy_bio_to_pages(target, biofrom);
+		/* copying first unit buffers */
+		raidxor_copy_pages(cache->n_chunk_mult, target,
+				   raidxor_cache_unit_pages(cache, n_line,
+							    units[0].disk));
 	}
 
 	/* XOR every NBLOCKS bio_vecs, repeating for all bio_vec of the bios */
@@ -567,10 +1068,9 @@ static int raidxor_xor_combine_temporary(cache_t *cache,
 						index = raidxor_find_dec_temps(cache->conf, units[k].decoding);
 					pages[nsrcs] = cache->lines[n_line]->temp_buffers[cache->n_chunk_mult * index + j];
 				}
-				else {
-					if (j == 0) bios[nsrcs] = raidxor_find_bio(rxbio, units[k].disk);
-					pages[nsrcs] = bio_iovec_idx(bios[nsrcs], j)->bv_page;
-				}
+				else
+					pages[nsrcs] = raidxor_cache_unit_pages(cache, n_line,
+										units[k].disk)[j];
 				srcs[nsrcs] = kmap(pages[nsrcs]);
 			}
 
@@ -606,23 +1106,6 @@ out: __attribute((unused))
 	return 1;
 }
 
-static int raidxor_xor_combine_decode_temporary(cache_t *cache, unsigned int n_line,
-						struct page **pages,
-						raidxor_bio_t *rxbio,
-						decoding_t *decoding)
-{
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out
-	CHECK_ARG(cache)
-	CHECK_ARGS3(pages, rxbio, decoding);
-
-	return raidxor_xor_combine_temporary(cache, n_line, pages, rxbio,
-					     decoding->n_units,
-					     decoding->units, 0);
-out: __attribute((unused))
-	return 1;
-}
-
 static int raidxor_xor_combine(cache_t *cache, unsigned int n_line,
 			       struct bio *bioto,
 			       raidxor_bio_t *rxbio,
@@ -632,15 +1115,13 @@ static int raidxor_xor_combine(cache_t *cache, unsigned int n_line,
 #undef CHECK_JUMP_LABEL
 #define CHECK_JUMP_LABEL out
 	unsigned int i, j, k, index;
-	struct bio *biofrom;
 	struct bio_vec *bvto;
 	unsigned char *tomapped;
 	struct page **temps;
 	unsigned int nsrcs = 0;
-	const unsigned int nblocks = 5;
-	struct page *pages[nblocks];
-	void *srcs[nblocks];
-	struct bio *bios[nblocks];
+	const unsigned int nblocks = MAX_XOR_BLOCKS;
+	struct page *pages[MAX_XOR_BLOCKS];
+	void *srcs[MAX_XOR_BLOCKS];
 	raidxor_conf_t *conf;
 
 	CHECK_FUN(raidxor_xor_combine);
@@ -660,9 +1141,10 @@ static int raidxor_xor_combine(cache_t *cache, unsigned int n_line,
 		raidxor_copy_pages_to_bio(bioto, temps);
 	}
 	else {
-		/* copying first bio buffers */
-		biofrom = raidxor_find_bio(rxbio, units[0].disk);
-		raidxor_copy_bio(bioto, biofrom);
+		/* copying first unit buffers */
+		raidxor_copy_pages_to_bio(bioto,
+					  raidxor_cache_unit_pages(cache, n_line,
+								   units[0].disk));
 	}
 
 	/* XOR every NBLOCKS bio_vecs, repeating for all bio_vec of the bios */
@@ -679,10 +1161,9 @@ static int raidxor_xor_combine(cache_t *cache, unsigned int n_line,
 						index = raidxor_find_dec_temps(cache->conf, units[k].decoding);
 					pages[nsrcs] = cache->lines[n_line]->temp_buffers[cache->n_chunk_mult * index + j];
 				}
-				else {
-					if (j == 0) bios[nsrcs] = raidxor_find_bio(rxbio, units[k].disk);
-					pages[nsrcs] = bio_iovec_idx(bios[nsrcs], j)->bv_page;
-				}
+				else
+					pages[nsrcs] = raidxor_cache_unit_pages(cache, n_line,
+										units[k].disk)[j];
 				srcs[nsrcs] = kmap(pages[nsrcs]);
 			}
 
@@ -700,21 +1181,170 @@ out: __attribute((unused))
 	return 1;
 }
 
-static int raidxor_xor_combine_decode(cache_t *cache, unsigned int n_line,
-				      struct bio *bioto,
-				      raidxor_bio_t *rxbio,
-				      decoding_t *decoding)
+/**
+ * raidxor_decoding_page() - returns one page of a decoding's input
+ *
+ * Inputs are taken from the line's buffers, whether or not the unit
+ * was part of the last transfer.
+ */
+static struct page * raidxor_decoding_page(cache_t *cache,
+					   unsigned int n_line,
+					   raidxor_bio_t *rxbio,
+					   coding_t *coding, unsigned int j)
 {
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out
-	CHECK_ARG(cache)
-	CHECK_ARGS3(bioto, rxbio, decoding);
+	unsigned int index;
 
-	return raidxor_xor_combine(cache, n_line, bioto, rxbio, decoding->n_units, decoding->units, 0);
-out: __attribute((unused))
+	if (coding->temporary) {
+		index = raidxor_find_dec_temps(cache->conf, coding->decoding);
+		return cache->lines[n_line]->temp_buffers[index * cache->n_chunk_mult + j];
+	}
+
+	return raidxor_cache_unit_pages(cache, n_line, coding->disk)[j];
+}
+
+/**
+ * raidxor_xor_decode_page() - computes one page of a decoding
+ * @j: the page inside the chunk
+ *
+ * Returns 1 on error (target still might be touched in this case).
+ */
+static int raidxor_xor_decode_page(cache_t *cache, unsigned int n_line,
+				   raidxor_bio_t *rxbio, struct page *target,
+				   decoding_t *decoding, unsigned int j)
+{
+	/* xor_blocks() takes at most MAX_XOR_BLOCKS sources per call */
+	const unsigned int nblocks = MAX_XOR_BLOCKS;
+	struct page *pages[MAX_XOR_BLOCKS];
+	void *srcs[MAX_XOR_BLOCKS];
+	unsigned char *tomapped;
+	unsigned int i, k, nsrcs;
+
+	pages[0] = raidxor_decoding_page(cache, n_line, rxbio,
+					 &decoding->units[0], j);
+	if (!pages[0])
+		return 1;
+
+	tomapped = (unsigned char *) kmap(target);
+	srcs[0] = kmap(pages[0]);
+	memcpy(tomapped, srcs[0], PAGE_SIZE);
+	kunmap(pages[0]);
+
+	for (i = 1; i < decoding->n_units; i += nsrcs) {
+		for (k = i, nsrcs = 0; k < decoding->n_units && nsrcs < nblocks;
+		     ++k, ++nsrcs) {
+			pages[nsrcs] = raidxor_decoding_page(cache, n_line, rxbio,
+							     &decoding->units[k],
+							     j);
+			if (!pages[nsrcs])
+				goto out_unmap;
+			srcs[nsrcs] = kmap(pages[nsrcs]);
+		}
+
+		xor_blocks(nsrcs, PAGE_SIZE, tomapped, srcs);
+
+		for (k = 0; k < nsrcs; ++k)
+			kunmap(pages[k]);
+	}
+
+	kunmap(target);
+	return 0;
+out_unmap:
+	for (k = 0; k < nsrcs; ++k)
+		kunmap(pages[k]);
+	kunmap(target);
 	return 1;
 }
 
+/**
+ * raidxor_xor_decode_batch() - decodes several units in one pass
+ * @temps: the decoding temporaries needed
+ * @units: the units to decode
+ *
+ * Works page by page over the chunk instead of unit by unit: each
+ * temporary shared by the decodings is computed once, and the inputs
+ * of a page are still in the CPU cache when the next unit uses them.
+ * So the failed units of a resource are rebuilt in a single pass.
+ *
+ * Returns 1 on error.
+ */
+static int raidxor_xor_decode_batch(cache_t *cache, unsigned int n_line,
+				    raidxor_bio_t *rxbio,
+				    unsigned long *temps,
+				    unsigned long *units)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+	unsigned int i, j;
+
+	for (j = 0; j < cache->n_chunk_mult; ++j) {
+		/* temporaries in order, they only refer to earlier ones */
+		for (i = 0; i < conf->n_dec_temps; ++i) {
+			if (!test_bit(i, temps))
+				continue;
+			if (raidxor_xor_decode_page(cache, n_line, rxbio,
+						    line->temp_buffers[i * cache->n_chunk_mult + j],
+						    conf->dec_temps[i], j))
+				return 1;
+		}
+
+		for (i = find_first_bit(units, conf->n_units);
+		     i < conf->n_units;
+		     i = find_next_bit(units, conf->n_units, i + 1)) {
+			if (raidxor_xor_decode_page(cache, n_line, rxbio,
+						    raidxor_cache_unit_pages(cache, n_line,
+									     &conf->units[i])[j],
+						    conf->units[i].decoding, j))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * raidxor_xor_encode_units() - encodes redundant units into a line
+ * @temps: the encoding temporaries needed
+ * @units: the redundant units
+ *
+ * Used for units which failed to read, the data units have to be valid.
+ * Returns 1 on error.
+ */
+static int raidxor_xor_encode_units(cache_t *cache, unsigned int n_line,
+				    raidxor_bio_t *rxbio,
+				    unsigned long *temps,
+				    unsigned long *units)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+	encoding_t *encoding;
+	unsigned int i;
+
+	/* temporaries in order, they only refer to earlier ones */
+	for (i = 0; i < conf->n_enc_temps; ++i) {
+		if (!test_bit(i, temps))
+			continue;
+		if (raidxor_xor_combine_encode_temporary(cache, n_line,
+							 &line->temp_buffers[i * cache->n_chunk_mult],
+							 rxbio,
+							 conf->enc_temps[i]))
+			return 1;
+	}
+
+	for (i = find_first_bit(units, conf->n_units);
+	     i < conf->n_units;
+	     i = find_next_bit(units, conf->n_units, i + 1)) {
+		encoding = conf->units[i].encoding;
+		if (raidxor_xor_combine_temporary(cache, n_line,
+						  raidxor_cache_unit_pages(cache, n_line,
+									   &conf->units[i]),
+						  rxbio, encoding->n_units,
+						  encoding->units, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
 /**
  * raidxor_xor_combine_encode() - xors a number of resources together
  *
@@ -738,19 +1368,131 @@ out: __attribute((unused))
 	return 1;
 }
 
+static void raidxor_end_repair_line(struct bio *bio, int error)
+{
+	raidxor_bio_t *rxbio;
+	raidxor_conf_t *conf;
+	cache_t *cache;
+	cache_line_t *line;
+	unsigned int index, wake = 0;
+	unsigned long flags = 0;
+	char buffer[BDEVNAME_SIZE];
+
+	CHECK_FUN(raidxor_end_repair_line);
+
+	CHECK_ARG_RET(bio);
+
+	rxbio = (raidxor_bio_t *)(bio->bi_private);
+	CHECK_PLAIN_RET(rxbio);
+
+	cache = rxbio->cache;
+	CHECK_PLAIN_RET(cache);
+
+	CHECK_PLAIN_RET(rxbio->line < cache->n_lines);
+
+	line = cache->lines[rxbio->line];
+	CHECK_PLAIN_RET(line);
+
+	conf = rxbio->cache->conf;
+	CHECK_PLAIN_RET(conf);
+
+	index = raidxor_bio_unit(bio);
+
+	/* the sectors couldn't be remapped */
+	if (error)
+		md_error(conf->mddev, conf->units[index].rdev);
+	else if (printk_ratelimit())
+		printk(KERN_INFO "raidxor: repaired read error on %s\n",
+		       bdevname(conf->units[index].rdev->bdev, buffer));
+
+	WITHLOCKCONF(conf, flags, {
+	clear_bit(index, line->bad);
+	if (raidxor_resource_end_bio(&conf->units[index]))
+		wake = 1;
+	if ((--rxbio->remaining) == 0) {
+		line->status = CACHE_LINE_UPTODATE;
+		line->rxbio = NULL;
+
+		--cache->active_lines;
+		raidxor_wake_quiesce(conf);
+		raidxor_cache_queue_line(cache, rxbio->line);
+		wake = 1;
+	}
+	});
+
+	if (wake) raidxor_wakeup_thread(conf);
+}
+
+/**
+ * raidxor_cache_repair_line() - rewrites units which failed to read
+ * @repair: the units, already decoded into the line
+ *
+ * The line stays in CACHE_LINE_RECOVERY, so its buffers don't change,
+ * until raidxor_end_repair_line() saw all writes.
+ */
+static void raidxor_cache_repair_line(cache_t *cache, unsigned int n_line,
+				      unsigned long *repair)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+	raidxor_bio_t *rxbio;
+	unsigned int i;
+	unsigned long flags = 0;
+
+	rxbio = raidxor_cache_start_bio(cache, n_line);
+
+	for (i = 0; i < rxbio->n_bios; ++i) {
+		raidxor_cache_prepare_bio(cache, n_line, i, WRITE,
+					  raidxor_end_repair_line);
+
+		/* failed meanwhile, nothing to repair */
+		if (!test_bit(i, repair) ||
+		    !raidxor_unit_readable(&conf->units[i])) {
+			rxbio->bios[i]->bi_bdev = NULL;
+			--rxbio->remaining;
+		}
+	}
+
+	WITHLOCKCONF(conf, flags, {
+	if (rxbio->remaining == 0) {
+		bitmap_andnot(line->bad, line->bad, repair, conf->n_units);
+		line->rxbio = NULL;
+		line->status = CACHE_LINE_UPTODATE;
+		UNLOCKCONF(conf, flags);
+		return;
+	}
+
+	++cache->active_lines;
+	});
+
+	raidxor_cache_commit_bio(cache, n_line);
+}
+
 /**
  * raidxor_cache_recover() - tries to recover a cache line
  *
  * Since the read buffers are available, we can use them to calculate
- * the missing data.
+ * the missing data.  Only the units of the read plan are decoded, and
+ * only if all units their decodings need were read successfully;
+ * otherwise they stay invalid and are planned again.  Redundant units
+ * which failed to read are encoded first, decodings may need them.
  */
 static void raidxor_cache_recover(cache_t *cache, unsigned int n_line)
 {
 	cache_line_t *line;
 	raidxor_conf_t *conf;
 	raidxor_bio_t *rxbio;
+	decoding_t *decoding;
 	unsigned int i;
 	unsigned long flags = 0;
+	DECLARE_BITMAP(recover, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(encode, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(repair, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(temps, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(enc_temps, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(unit_temps, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(inputs, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(available, RAIDXOR_MAX_UNITS);
 
 	CHECK_FUN(raidxor_cache_recover);
 
@@ -766,59 +1508,87 @@ static void raidxor_cache_recover(cache_t *cache, unsigned int n_line)
 	conf = cache->conf;
 	CHECK_PLAIN_RET(conf);
 
-	WITHLOCKCONF(conf, flags, {
-	if (!raidxor_valid_decoding(cache, n_line))
-		goto out_free_rxbio_unlock;
+	bitmap_zero(recover, conf->n_units);
+	bitmap_zero(encode, conf->n_units);
+	bitmap_zero(temps, RAIDXOR_MAX_UNITS);
+	bitmap_zero(enc_temps, RAIDXOR_MAX_UNITS);
 
+	WITHLOCKCONF(conf, flags, {
 	line->status = CACHE_LINE_RECOVERY;
-	});
 
-	/* decoding temporaries first */
-	for (i = 0; i < conf->n_dec_temps; ++i) {
-		if (raidxor_xor_combine_decode_temporary(cache, n_line,
-							 &line->temp_buffers[i * cache->n_chunk_mult],
-							 rxbio,
-							 conf->dec_temps[i]))
-			goto out_free_rxbio;
+	for (i = find_first_bit(line->recovering, conf->n_units);
+	     i < conf->n_units;
+	     i = find_next_bit(line->recovering, conf->n_units, i + 1)) {
+		if (!test_bit(i, line->bad) ||
+		    !raidxor_unit_reencoded(&conf->units[i]))
+			continue;
+
+		bitmap_zero(inputs, conf->n_units);
+		raidxor_encoding_units(conf, conf->units[i].encoding, inputs);
+		if (!bitmap_subset(inputs, line->valid, conf->n_units))
+			continue;
+
+		__set_bit(i, encode);
+		raidxor_encoding_temps(conf, conf->units[i].encoding,
+				       enc_temps);
 	}
 
-	/* decoding using direct style */
-	for (i = 0; i < rxbio->n_bios; ++i) {
-		if (test_bit(Faulty, &conf->units[i].rdev->flags)) {
-			if (conf->units[i].redundant) {
-				if (raidxor_xor_combine_encode(cache, n_line,
-							       rxbio->bios[i], rxbio,
-							       conf->units[i].encoding))
-					goto out_free_rxbio;
-			}
-			else {
-				if (raidxor_xor_combine_decode(cache, n_line,
-							       rxbio->bios[i], rxbio,
-							       conf->units[i].decoding))
-					goto out_free_rxbio;
-			}
-		}
+	bitmap_or(available, line->valid, encode, conf->n_units);
+
+	for (i = find_first_bit(line->recovering, conf->n_units);
+	     i < conf->n_units;
+	     i = find_next_bit(line->recovering, conf->n_units, i + 1)) {
+		decoding = conf->units[i].decoding;
+		if (!decoding || test_bit(i, encode))
+			continue;
+
+		bitmap_zero(inputs, conf->n_units);
+		bitmap_zero(unit_temps, RAIDXOR_MAX_UNITS);
+		raidxor_decoding_units(conf, decoding, inputs, unit_temps);
+		if (!bitmap_subset(inputs, available, conf->n_units))
+			continue;
+
+		__set_bit(i, recover);
+		bitmap_or(temps, temps, unit_temps, RAIDXOR_MAX_UNITS);
 	}
+	});
+
+	if (raidxor_xor_encode_units(cache, n_line, rxbio, enc_temps, encode))
+		goto out_free_rxbio;
+
+	if (raidxor_xor_decode_batch(cache, n_line, rxbio, temps, recover))
+		goto out_free_rxbio;
 
 	WITHLOCKCONF(conf, flags, {
-	line->rxbio = NULL;
-	line->status = CACHE_LINE_UPTODATE;
+	bitmap_or(line->valid, line->valid, encode, conf->n_units);
+	bitmap_or(line->valid, line->valid, recover, conf->n_units);
+	bitmap_zero(line->recovering, conf->n_units);
+
+	/* don't decode it all again on the next access */
+	raidxor_cache_pin_line(cache, line, recover);
+
+	/* units which failed to read get their data back */
+	bitmap_or(recover, recover, encode, conf->n_units);
+	bitmap_and(repair, recover, line->bad, conf->n_units);
+	if (bitmap_empty(repair, conf->n_units)) {
+		line->rxbio = NULL;
+		line->status = CACHE_LINE_UPTODATE;
+	}
 	});
 
-	raidxor_free_bio(rxbio);
+	if (!bitmap_empty(repair, conf->n_units))
+		raidxor_cache_repair_line(cache, n_line, repair);
 
 	return;
-out_free_rxbio_unlock:
-	UNLOCKCONF(conf, flags);
 out_free_rxbio:
 	line->rxbio = NULL;
-	raidxor_free_bio(rxbio);
 	/* drop this line if an error occurs or we can't recover */
 
 	raidxor_cache_abort_requests(cache, n_line);
 
 	LOCKCONF(conf, flags);
 	line->status = CACHE_LINE_READY;
+	raidxor_cache_end_resync(cache, n_line, 0);
 	UNLOCKCONF(conf, flags);
 }
 
@@ -830,10 +1600,8 @@ static void raidxor_invalidate_decoding(raidxor_conf_t *conf,
 	CHECK_ARG_RET(conf);
 	CHECK_ARG_RET(unit);
 
-	if (unit->decoding) {
-		CHECK_BUG("unit has decoding, although it shouldn't have one");
-		raidxor_safe_free_decoding(unit);
-	}
+	/* left over from an earlier failure of a rebuilt unit */
+	raidxor_safe_free_decoding(unit);
 
 	for (i = 0; i < conf->n_units; ++i)
 		if (conf->units[i].decoding &&
@@ -841,83 +1609,320 @@ static void raidxor_invalidate_decoding(raidxor_conf_t *conf,
 					       unit)) {
 			raidxor_safe_free_decoding(&conf->units[i]);
 		}
+}
+
+/**
+ * raidxor_fail_member() - marks a member failed
+ *
+ * Decodings using its units are dropped.  Returns 1 if the member
+ * wasn't failed before.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_fail_member(raidxor_conf_t *conf,
+					mdk_rdev_t *rdev)
+{
+	mddev_t *mddev = conf->mddev;
+	unsigned int i;
+
+	if (test_bit(Faulty, &rdev->flags))
+		return 0;
 
-	printk(KERN_CRIT "raidxor: raid %s needs new decoding information\n",
-	       mdname(conf->mddev));
+	set_bit(Faulty, &rdev->flags);
+	set_bit(CONF_FAULTY, &conf->flags);
+	/* a replacement still being rebuilt is already missing */
+	if (test_and_clear_bit(In_sync, &rdev->flags))
+		++mddev->degraded;
+	set_bit(MD_RECOVERY_INTR, &mddev->recovery);
+
+	/* with interleaved units, all units on the member fail */
+	for (i = 0; i < conf->n_units; ++i)
+		if (conf->units[i].rdev == rdev)
+			raidxor_invalidate_decoding(conf, &conf->units[i]);
+
+	return 1;
 }
 
 /**
  * raidxor_error() - propagates a device error
  *
+ * The units of a resource live on the same disk, so when one of its
+ * members fails, the others are failed along with it.  That way the
+ * decodings are derived once for the whole resource, and recovery
+ * rebuilds all its units in one pass, see raidxor_xor_decode_batch().
  */
 static void raidxor_error(mddev_t *mddev, mdk_rdev_t *rdev)
 {
 	unsigned long flags = 0;
+	unsigned int i, j, failed = 0, others = 0;
 	char buffer[BDEVNAME_SIZE];
 	raidxor_conf_t *conf = mddev_to_conf(mddev);
-	disk_info_t *unit = raidxor_find_unit_conf_rdev(conf, rdev);
+	resource_t *resource;
+	mdk_rdev_t *other;
 
 	WITHLOCKCONF(conf, flags, {
-	if (!test_bit(Faulty, &rdev->flags)) {
-		/* escalate error */
-		set_bit(Faulty, &rdev->flags);
-		set_bit(CONF_FAULTY, &conf->flags);
-		raidxor_invalidate_decoding(conf, unit);
-		printk(KERN_CRIT "raidxor: disk failure on %s\n",
-		       bdevname(rdev->bdev, buffer));
+	if (raidxor_fail_member(conf, rdev)) {
+		failed = 1;
+
+		for (i = 0; i < conf->n_units; ++i) {
+			resource = conf->units[i].resource;
+			if (conf->units[i].rdev != rdev || !resource)
+				continue;
+
+			for (j = 0; j < resource->n_units; ++j) {
+				other = resource->units[j]->rdev;
+				if (other && raidxor_fail_member(conf, other))
+					++others;
+			}
+		}
+
+		raidxor_schedule_derive(conf);
+		raidxor_super_schedule(conf);
 	}
 	});
+
+	if (!failed)
+		return;
+
+	if (others)
+		printk(KERN_CRIT "raidxor: disk failure on %s, failing %u "
+		       "more members of its resource\n",
+		       bdevname(rdev->bdev, buffer), others);
+	else
+		printk(KERN_CRIT "raidxor: disk failure on %s\n",
+		       bdevname(rdev->bdev, buffer));
+
+	printk(KERN_CRIT "raidxor: raid %s needs new decoding information, "
+	       "deriving it\n", mdname(mddev));
 }
 
 /**
- * raidxor_finish_lines() - tries to free some lines by writeback or dropping
+ * raidxor_add_disk() - puts a spare into the place of a removed member
+ *
+ * All units of the member use the new device.  They're written to from
+ * now on, but read only after md has rebuilt them using
+ * raidxor_sync_request() and raidxor_spare_active() was called.
  *
+ * Returns 1 if the device was added, else 0.
  */
-static void raidxor_finish_lines(cache_t *cache)
+static int raidxor_add_disk(mddev_t *mddev, mdk_rdev_t *rdev)
 {
-	unsigned int i;
-	cache_line_t *line;
-	unsigned int freed = 0;
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
 	unsigned long flags = 0;
+	unsigned int i, j, n_members;
+	int added = 0;
+	char buffer[BDEVNAME_SIZE];
 
-	CHECK_FUN(raidxor_finish_lines);
+	n_members = conf->n_units / conf->units_per_member;
 
-	CHECK_ARG_RET(cache);
+	/* the layout is kept behind the units */
+	if (rdev->size < mddev->size +
+	    (conf->super_reserved ? RAIDXOR_SUPER_SIZE : 0)) {
+		printk(KERN_WARNING "raidxor: %s is too small for %s\n",
+		       bdevname(rdev->bdev, buffer), mdname(mddev));
+		return 0;
+	}
 
-	WITHLOCKCONF(cache->conf, flags, {
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out
-	CHECK_PLAIN(cache->n_waiting > 0);
-	CHECK_PLAIN(cache->n_lines > 0);
+	WITHLOCKCONF(conf, flags, {
+	/* a re-added member goes back to its slot, only the regions
+	   written meanwhile are rebuilt */
+	if (rdev->saved_raid_disk >= 0 &&
+	    rdev->saved_raid_disk < (int)n_members &&
+	    !conf->units[rdev->saved_raid_disk].rdev)
+		i = rdev->saved_raid_disk;
+	else {
+		for (i = 0; i < n_members; ++i)
+			if (!conf->units[i].rdev)
+				break;
+	}
 
-	/* as long as there are more waiting slots than now free'd slots */
-	for (i = 0; i < cache->n_lines && freed < cache->n_waiting; ++i) {
-		line = cache->lines[i];
-		switch (line->status) {
-		case CACHE_LINE_CLEAN:
-			if (!line->waiting) ++freed;
-		case CACHE_LINE_READY:
+	if (i < n_members) {
+		if (rdev->saved_raid_disk != (int)i)
+			conf->fullsync = 1;
+
+		for (j = 0; j < conf->units_per_member; ++j)
+			conf->units[i + j * n_members].rdev = rdev;
+
+		rdev->raid_disk = i;
+		added = 1;
+
+		/* the spare already gets what's decoded in the cache */
+		if (conf->cache)
+			raidxor_cache_spare_lines(conf->cache);
+
+		raidxor_super_schedule(conf);
+	}
+	});
+
+	if (added)
+		raidxor_wakeup_thread(conf);
+
+	return added;
+}
+
+/**
+ * raidxor_remove_disk() - removes a failed member from the array
+ *
+ * Only failed or not yet rebuilt members can be removed, and only
+ * after all bios for them completed.  Returns -EBUSY otherwise, md
+ * tries again later.
+ */
+static int raidxor_remove_disk(mddev_t *mddev, int number)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	mdk_rdev_t *rdev;
+	unsigned long flags = 0;
+	unsigned int i, j, n_members;
+	int err = 0;
+
+	n_members = conf->n_units / conf->units_per_member;
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < n_members; ++i) {
+		rdev = conf->units[i].rdev;
+		if (!rdev || rdev->raid_disk != number)
+			continue;
+
+		if (!test_bit(Faulty, &rdev->flags) &&
+		    test_bit(In_sync, &rdev->flags)) {
+			err = -EBUSY;
 			break;
-		case CACHE_LINE_UPTODATE:
-			if (line->waiting) break;
-			UNLOCKCONF(cache->conf, flags);
-			raidxor_cache_make_ready(cache, i);
-			LOCKCONF(cache->conf, flags);
-			++freed;
+		}
+
+		/* queued and running bios still use the member, the
+		   last one asks md to try again */
+		if (atomic_read(&rdev->nr_pending)) {
+			err = -EBUSY;
 			break;
-		case CACHE_LINE_DIRTY:
+		}
+
+		for (j = 0; j < conf->units_per_member; ++j)
+			conf->units[i + j * n_members].rdev = NULL;
+		break;
+	}
+	});
+
+	return err;
+}
+
+/**
+ * raidxor_spare_active() - marks rebuilt members as usable for reads
+ *
+ * Called by md after the resync finished.
+ */
+static int raidxor_spare_active(mddev_t *mddev)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	mdk_rdev_t *rdev;
+	unsigned long flags = 0;
+	unsigned int i, n_members;
+	char buffer[BDEVNAME_SIZE];
+
+	n_members = conf->n_units / conf->units_per_member;
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < n_members; ++i) {
+		rdev = conf->units[i].rdev;
+		if (!rdev || test_bit(Faulty, &rdev->flags) ||
+		    test_and_set_bit(In_sync, &rdev->flags))
+			continue;
+
+		--mddev->degraded;
+		printk(KERN_INFO "raidxor: %s rebuilt as member %u\n",
+		       bdevname(rdev->bdev, buffer), i);
+		raidxor_super_schedule(conf);
+	}
+
+	/* nothing has to be decoded anymore */
+	if (!mddev->degraded && conf->cache)
+		for (i = 0; i < conf->cache->n_lines; ++i)
+			raidxor_cache_unpin_line(conf->cache,
+						 conf->cache->lines[i]);
+	});
+
+	return 0;
+}
+
+/**
+ * raidxor_finish_lines() - tries to free some lines by writeback or dropping
+ *
+ */
+static void raidxor_finish_lines(cache_t *cache)
+{
+	unsigned int i, pass;
+	cache_line_t *line;
+	unsigned int freed = 0;
+	unsigned long flags = 0;
+
+	CHECK_FUN(raidxor_finish_lines);
+
+	CHECK_ARG_RET(cache);
+
+	WITHLOCKCONF(cache->conf, flags, {
+#undef CHECK_JUMP_LABEL
+#define CHECK_JUMP_LABEL out
+	CHECK_PLAIN(cache->n_waiting > 0);
+	CHECK_PLAIN(cache->n_lines > 0);
+
+	/* as long as there are more waiting slots than now free'd slots;
+	   the first pass only frees lines without I/O, writebacks are
+	   only started in the second pass if that wasn't enough.  pinned
+	   lines are only taken in the third, see
+	   raidxor_cache_pin_line() */
+	for (pass = 0; pass < 3 && freed < cache->n_waiting; ++pass)
+	for (i = 0; i < cache->n_lines && freed < cache->n_waiting; ++i) {
+		line = cache->lines[i];
+
+		/* a worker is handling it, or will for the resync */
+		if (test_bit(CACHE_LINE_BUSY, &line->flags) ||
+		    test_bit(CACHE_LINE_RESYNC, &line->flags))
+			continue;
+
+		if (test_bit(CACHE_LINE_PINNED, &line->flags)) {
+			/* ages the hits, so old ones count less */
+			if (pass == 0)
+				line->hits >>= 1;
+			if (pass < 2)
+				continue;
+		}
+		else if (pass == 2)
+			continue;
+
+		if (pass == 0 && line->status == CACHE_LINE_DIRTY)
+			continue;
+		if (pass == 1 && line->status != CACHE_LINE_DIRTY)
+			continue;
+
+		switch (line->status) {
+		case CACHE_LINE_CLEAN:
+			if (!line->waiting) ++freed;
+		case CACHE_LINE_READY:
+			break;
+		case CACHE_LINE_UPTODATE:
+			if (line->waiting) break;
+			set_bit(CACHE_LINE_BUSY, &line->flags);
+			UNLOCKCONF(cache->conf, flags);
+			raidxor_cache_make_ready(cache, i);
+			LOCKCONF(cache->conf, flags);
+			raidxor_cache_release_line(cache, i, 0);
+			++freed;
+			break;
+		case CACHE_LINE_DIRTY:
 			if (line->waiting) break;
 			/* when the callback is invoked, the main thread is
 			   woken up and eventually revisits this entry  */
+			set_bit(CACHE_LINE_BUSY, &line->flags);
 			UNLOCKCONF(cache->conf, flags);
 			if (!raidxor_cache_writeback_line(cache, i)) {
 				raidxor_cache_commit_bio(cache, i);
 			}
 			LOCKCONF(cache->conf, flags);
+			raidxor_cache_release_line(cache, i, 0);
 			break;
 		case CACHE_LINE_LOAD_ME:
 		case CACHE_LINE_LOADING:
 		case CACHE_LINE_WRITEBACK:
+		case CACHE_LINE_LOGGING:
 		case CACHE_LINE_FAULTY:
 		case CACHE_LINE_RECOVERY:
 		case CACHE_LINE_READYING:
@@ -939,15 +1944,21 @@ out: __attribute__((unused))
 /**
  * raidxor_handle_requests() - handles waiting requests for a cache line
  *
- *
+ * Takes all waiting requests at once and handles them as a batch, so
+ * the lock is only taken before and after.  The line is owned by the
+ * caller, so it can't go away while the lock is dropped.  Requests
+ * added in the meantime requeue the line.
  */
 static void raidxor_handle_requests(cache_t *cache, unsigned int n_line)
 {
 #undef CHECK_JUMP_LABEL
 #define CHECK_JUMP_LABEL out
 	cache_line_t *line;
-	struct bio *bio;
+	struct bio *bio, *next, *requests, *syncing = NULL, *last = NULL;
+	struct bio *acked = NULL;
 	unsigned long flags = 0;
+	unsigned int written = 0;
+	DECLARE_BITMAP(overwritten, RAIDXOR_MAX_UNITS);
 
 	CHECK_FUN(raidxor_handle_requests);
 
@@ -963,26 +1974,84 @@ static void raidxor_handle_requests(cache_t *cache, unsigned int n_line)
 	CHECK_PLAIN(line->status == CACHE_LINE_UPTODATE ||
 		    line->status == CACHE_LINE_DIRTY);
 
-	/* requests are added at back, so take from front and handle */
-	while ((bio = raidxor_cache_remove_request(cache, n_line))) {
+	/* a request needing more units arrived, the line is loaded
+	   again before anything is served */
+	if (!raidxor_cache_line_has_wanted(line)) {
 		UNLOCKCONF(cache->conf, flags);
+		return;
+	}
+
+	requests = raidxor_cache_take_requests(cache, n_line);
+
+	/* requests added from now on set it again */
+	clear_bit(CACHE_LINE_URGENT, &line->flags);
+	});
+
+	bitmap_zero(overwritten, RAIDXOR_MAX_UNITS);
+
+	/* requests are in FIFO order, handle them all */
+	for (bio = requests; bio; bio = next) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
 
-		if (bio_data_dir(bio) == WRITE)
+		if (bio_data_dir(bio) == WRITE) {
 			raidxor_copy_bio_to_cache(cache, n_line, bio);
-		else raidxor_copy_bio_from_cache(cache, n_line, bio);
+			raidxor_cache_bio_overwrites(cache, bio, overwritten);
+			written = 1;
 
-		bio_endio(bio, 0);
+			/* the line keeps the first one until written back */
+			if (test_and_set_bit(CACHE_LINE_ACTIVE, &line->flags))
+				md_write_end(cache->conf->mddev);
+		}
+		else raidxor_copy_bio_from_cache(cache, n_line, bio);
 
-		LOCKCONF(cache->conf, flags);
-		/* mark dirty */
-		if (bio_data_dir(bio) == WRITE &&
-		    line->status == CACHE_LINE_UPTODATE)
-		{
-			line->status = CACHE_LINE_DIRTY;
+		/* FUA requests are ended after the next writeback, other
+		   writes once the line is marked dirty, so a flush can't
+		   miss them */
+		if (bio_data_dir(bio) == WRITE && raidxor_bio_fua(bio)) {
+			bio->bi_next = syncing;
+			syncing = bio;
+			if (!last) last = bio;
 		}
+		else if (bio_data_dir(bio) == WRITE) {
+			bio->bi_next = acked;
+			acked = bio;
+		}
+		else bio_endio(bio, 0);
+	}
+
+	if (!written)
+		return;
+
+	WITHLOCKCONF(cache->conf, flags, {
+	/* units which weren't loaded or decoded, since the writes
+	   replaced them completely, see raidxor_cache_want_bio() */
+	bitmap_or(line->valid, line->valid, overwritten,
+		  cache->conf->n_units);
+
+	/* mark dirty */
+	if (line->status == CACHE_LINE_UPTODATE)
+		line->status = CACHE_LINE_DIRTY;
+
+	/* the next writeback needs a new record */
+	raidxor_log_line_changed(cache->conf, line);
+
+	/* the writeback for FUA requests stays urgent, their deadline
+	   is still in line->deadline */
+	if (syncing) {
+		last->bi_next = line->syncing;
+		line->syncing = syncing;
+		set_bit(CACHE_LINE_SYNC, &line->flags);
+		set_bit(CACHE_LINE_URGENT, &line->flags);
 	}
 	});
 
+	while ((bio = acked)) {
+		acked = bio->bi_next;
+		bio->bi_next = NULL;
+		bio_endio(bio, 0);
+	}
+
 	return;
 out_unlock: __attribute((unused))
 	UNLOCKCONF(cache->conf, flags);
@@ -1014,35 +2083,30 @@ static int raidxor_handle_line(cache_t *cache, unsigned int n_line)
 
 	WITHLOCKCONF(cache->conf, flags, {
 
-	/* if nobody wants something from this line, do nothing */
-	if (!line->waiting) goto out_unlock;
-
-	switch (line->status) {
-	case CACHE_LINE_LOAD_ME:
+	switch (raidxor_cache_line_work(line)) {
+	case CACHE_WORK_WRITEBACK:
+		UNLOCKCONF(cache->conf, flags);
+		commit = !raidxor_cache_writeback_line(cache, n_line);
+		done = commit;
+		goto break_unlocked;
+	case CACHE_WORK_LOAD:
 		UNLOCKCONF(cache->conf, flags);
 		commit = !raidxor_cache_load_line(cache, n_line);
 		done = 1;
 		goto break_unlocked;
-	case CACHE_LINE_FAULTY:
+	case CACHE_WORK_RECOVER:
 		UNLOCKCONF(cache->conf, flags);
 		raidxor_cache_recover(cache, n_line);
 		done = 1;
 		goto break_unlocked;
-	case CACHE_LINE_UPTODATE:
-	case CACHE_LINE_DIRTY:
+	case CACHE_WORK_SERVE:
 		UNLOCKCONF(cache->conf, flags);
 		raidxor_handle_requests(cache, n_line);
 		done = 1;
 		goto break_unlocked;
-	case CACHE_LINE_READY:
-	case CACHE_LINE_RECOVERY:
-	case CACHE_LINE_LOADING:
-	case CACHE_LINE_WRITEBACK:
-	case CACHE_LINE_CLEAN:
-	case CACHE_LINE_READYING:
+	default:
 		/* no bugs, just can't do anything */
 		break;
-		/* no default */
 	}
 
 	});
@@ -1051,20 +2115,93 @@ break_unlocked:
 	if (commit) raidxor_cache_commit_bio(cache, n_line);
 
 	return done;
-out_unlock:
-	UNLOCKCONF(cache->conf, flags);
+}
+
+/**
+ * raidxor_work_line() - handles the next queued line of a worker
+ *
+ * The line is owned by the worker while it's handled, so that no other
+ * worker touches it.  Returns 1 if a line was handled, else 0.
+ */
+static unsigned int raidxor_work_line(raidxor_conf_t *conf,
+				      unsigned int worker)
+{
+	cache_t *cache;
+	unsigned int n_line, found = 0, done;
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	cache = conf->cache;
+	if (!test_bit(CONF_INCOMPLETE, &conf->flags) && cache)
+		found = raidxor_cache_next_line(cache, worker, &n_line);
+	});
+
+	if (!found)
+		return 0;
+
+	done = raidxor_handle_line(cache, n_line);
+
+	/* the line may already need the next step */
+	WITHLOCKCONF(conf, flags, {
+	raidxor_cache_release_line(cache, n_line, done);
+	});
+
+	return 1;
+}
+
+/**
+ * raidxor_worker() - additional worker thread
+ *
+ * Handles lines queued on its queue and steals from the others, see
+ * raidxor_cache_next_line().
+ */
+static int raidxor_worker(void *data)
+{
+	raidxor_worker_t *worker = (raidxor_worker_t *) data;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(worker->wait,
+					 test_and_clear_bit(0, &worker->pending) ||
+					 kthread_should_stop());
+
+		while (raidxor_work_line(worker->conf, worker->index))
+			;
+	}
 
 	return 0;
 }
 
+/**
+ * raidxor_pin_worker() - restricts a worker to the CPUs of its node
+ */
+static void raidxor_pin_worker(raidxor_worker_t *worker)
+{
+	cpumask_t mask = node_to_cpumask(worker->node);
+
+	if (num_online_nodes() > 1)
+		set_cpus_allowed_ptr(worker->thread, &mask);
+}
+
+static void raidxor_stop_workers(raidxor_conf_t *conf)
+{
+	unsigned int i;
+
+	for (i = 1; i < conf->n_workers; ++i)
+		if (conf->workers[i].thread) {
+			kthread_stop(conf->workers[i].thread);
+			conf->workers[i].thread = NULL;
+		}
+}
+
 /**
  * raidxord() - daemon thread
  *
- * Is started by the md level.  Takes requests from the queue and handles them.
+ * Is started by the md level.  Takes requests from the queue and handles
+ * them.  This is worker 0, it additionally submits queued bios and frees
+ * lines for waiting requests.
  */
 static void raidxord(mddev_t *mddev)
 {
-	unsigned int i;
 	raidxor_conf_t *conf;
 	cache_t *cache;
 	unsigned int handled = 0;
@@ -1087,24 +2224,27 @@ static void raidxord(mddev_t *mddev)
 	/* someone poked us.  see what we can do */
 	pr_debug("raidxor: raidxord active\n");
 
-	for (; !done;) {
-		/* go through all cache lines, see if any waiting requests
-		   can be handled */
-		for (i = 0, done = 1; i < cache->n_lines; ++i) {
-			/* only break if we have handled at least one line */
-			if (raidxor_handle_line(cache, i)) {
-				++handled;
-				done = 0;
-			}
+	/* starts resyncs and adds or removes spares */
+	md_check_recovery(mddev);
+
+	clear_bit(0, &conf->workers[0].pending);
+
+	for (;;) {
+		/* submit bios held back by the resource queues */
+		raidxor_dispatch_resources(conf);
+
+		/* only lines whose state changed are on the work lists */
+		if (raidxor_work_line(conf, 0)) {
+			++handled;
+			continue;
 		}
 
 		/* also, if somebody is waiting for a free line, try to make
-		   one (or more) available.  freeing some lines doesn't count
-		   for done above, so if we're done working on those lines
-		   and we free two lines afterwards, the waiting processes
-		   are notified and signal us back later on */
-
+		   one (or more) available.  the waiting processes are
+		   notified and signal us back later on */
 		if (cache->n_waiting > 0) raidxor_finish_lines(cache);
+
+		break;
 	}
 
 	pr_debug("raidxor: thread inactive, %u lines handled\n", handled);
@@ -1117,7 +2257,11 @@ static void raidxor_unplug(struct request_queue *q)
 	unsigned int i;
 	struct request_queue *r_queue;
 
-	for (i = 0; i < conf->n_units; i++) {
+	/* interleaved units share a member, so only unplug each once */
+	for (i = 0; i < conf->n_units / conf->units_per_member; i++) {
+		if (raidxor_unit_faulty(&conf->units[i]))
+			continue;
+
 		r_queue = bdev_get_queue(conf->units[i].rdev->bdev);
 
 		blk_unplug(r_queue);
@@ -1127,9 +2271,10 @@ static void raidxor_unplug(struct request_queue *q)
 /**
  * raidxor_run() - basic initialization for the raid
  *
- * We can't use it after this, because the layout of the raid is not
- * described yet.  Therefore, every read/write operation fails until
- * we've got enough information.
+ * If the members hold a layout, the array is configured from it.
+ * Otherwise we can't use it after this, because the layout of the raid
+ * is not described yet.  Therefore, every read/write operation fails
+ * until we've got enough information.
  */
 static int raidxor_run(mddev_t *mddev)
 {
@@ -1138,7 +2283,8 @@ static int raidxor_run(mddev_t *mddev)
 	mdk_rdev_t* rdev;
 	char buffer[32];
 	sector_t size;
-	unsigned long i;
+	unsigned long i, j;
+	int per_member, err;
 
 	if (mddev->level != LEVEL_XOR) {
 		printk(KERN_ERR "raidxor: %s: raid level not set to xor (%d)\n",
@@ -1159,8 +2305,30 @@ static int raidxor_run(mddev_t *mddev)
 	if (mddev->raid_disks < 1)
 		goto out_inval;
 
+	/* an assembled array keeps its own, see the layout */
+	per_member = raidxor_super_units_per_member(mddev);
+	if (per_member < 1) {
+		printk(KERN_ERR "raidxor: units_per_member must be at least 1 "
+		       "but is %d\n", per_member);
+		goto out_inval;
+	}
+
+	/* with no bio in flight, a resource would never dispatch */
+	if (resource_queue_depth < 1) {
+		printk(KERN_ERR "raidxor: resource_queue_depth must be at "
+		       "least 1 but is %d\n", resource_queue_depth);
+		goto out_inval;
+	}
+
+	if (number_of_workers < 1) {
+		printk(KERN_ERR "raidxor: number_of_workers must be at least 1 "
+		       "but is %d\n", number_of_workers);
+		goto out_inval;
+	}
+
 	conf = kzalloc(sizeof(raidxor_conf_t) +
-		       sizeof(struct disk_info) * mddev->raid_disks, GFP_KERNEL);
+		       sizeof(struct disk_info) * mddev->raid_disks *
+		       per_member, GFP_KERNEL);
 	mddev->private = conf;
 	if (!conf) {
 		printk(KERN_ERR "raidxor: couldn't allocate memory for %s\n",
@@ -1174,33 +2342,103 @@ static int raidxor_run(mddev_t *mddev)
 	conf->units_per_resource = 0;
 	conf->n_resources = 0;
 	conf->resources = NULL;
-	conf->n_units = mddev->raid_disks;
+	conf->units_per_member = per_member;
+	conf->n_units = mddev->raid_disks * conf->units_per_member;
+
+	if (conf->n_units > RAIDXOR_MAX_UNITS) {
+		printk(KERN_ERR "raidxor: at most %d units are supported, "
+		       "but got %u\n", RAIDXOR_MAX_UNITS, conf->n_units);
+		goto out_free_conf;
+	}
 
 	blk_queue_hardsect_size(mddev->queue, 4096);
 
 	spin_lock_init(&conf->device_lock);
+	INIT_WORK(&conf->flush_work, raidxor_flush_work);
+	init_waitqueue_head(&conf->wait_for_flush);
+	init_waitqueue_head(&conf->wait_for_quiesce);
+	INIT_DELAYED_WORK(&conf->derive_work, raidxor_derive_work);
+	INIT_DELAYED_WORK(&conf->super_work, raidxor_super_work);
+
+	conf->n_cache_lines = number_of_cache_lines;
+
+	/* flushes of one array mustn't wait behind those of another */
+	conf->flush_wq = create_singlethread_workqueue("raidxor_flush");
+	if (!conf->flush_wq)
+		goto out_free_conf;
+
+	/* derivations quiesce the array, not to be run on keventd */
+	conf->derive_wq = create_singlethread_workqueue("raidxor_derive");
+	if (!conf->derive_wq)
+		goto out_free_conf;
+
+#ifdef BIO_RW_DISCARD
+	/* flushes wait for pending discards, so these get their own */
+	INIT_WORK(&conf->discard_work, raidxor_discard_work);
+	conf->discard_wq = create_singlethread_workqueue("raidxor_discard");
+	if (!conf->discard_wq)
+		goto out_free_conf;
+#endif
+
+	conf->rxbio_pool = mempool_create_kmalloc_pool(RAIDXOR_MIN_RXBIOS,
+						       sizeof(raidxor_bio_t));
+	if (!conf->rxbio_pool)
+		goto out_free_conf;
+
+	conf->n_workers = number_of_workers;
+	conf->workers = kzalloc(sizeof(raidxor_worker_t) * conf->n_workers,
+				GFP_KERNEL);
+	if (!conf->workers)
+		goto out_free_conf;
+
+	for (i = 0; i < conf->n_workers; ++i) {
+		conf->workers[i].conf = conf;
+		conf->workers[i].index = i;
+		conf->workers[i].node = raidxor_nth_online_node(i);
+		init_waitqueue_head(&conf->workers[i].wait);
+	}
+
 	mddev->queue->queue_lock = &conf->device_lock;
 	mddev->queue->unplug_fn = raidxor_unplug;
 
 	size = -1; /* rdev->size is in sectors, that is 1024 byte */
 
-	i = conf->n_units - 1;
+	mddev->degraded = mddev->raid_disks;
 	rdev_for_each(rdev, tmp, mddev) {
+		/* spares are added by raidxor_add_disk() */
+		if (rdev->raid_disk < 0 || rdev->raid_disk >= mddev->raid_disks)
+			continue;
+		i = rdev->raid_disk;
+
 		size = min(size, rdev->size);
 
 		printk(KERN_INFO "raidxor: device %lu rdev %s, %llu blocks\n",
 		       i, bdevname(rdev->bdev, buffer),
 		       (unsigned long long) rdev->size * 2);
-		conf->units[i].rdev = rdev;
-		conf->units[i].redundant = -1;
 
-		--i;
+		/* member i holds units i, i + raid_disks, ..., so that
+		   it matches exactly one resource */
+		for (j = 0; j < conf->units_per_member; ++j) {
+			conf->units[i + j * mddev->raid_disks].rdev = rdev;
+			conf->units[i + j * mddev->raid_disks].slot = j;
+			conf->units[i + j * mddev->raid_disks].redundant = -1;
+		}
+
+		/* a rebuild interrupted by stopping the array has to start
+		   over, the bitmap doesn't know what it already covered */
+		if (test_bit(In_sync, &rdev->flags))
+			--mddev->degraded;
+		else
+			conf->fullsync = 1;
 	}
 	if (size == -1)
 		goto out_free_conf;
 
-	/* used component size in sectors, multiple of chunk_size ... */
-	mddev->size = size & ~(conf->chunk_size / 1024 - 1);
+	/* used component size in blocks, each unit on it a multiple of
+	   chunk_size ...  raidxor_super_load() decides whether the
+	   layout is stored behind it */
+	conf->member_size = size;
+	mddev->size = raidxor_super_data_size(conf, 0);
 	/* exported size in blocks, will be initialised later */
 	mddev->array_sectors = 0;
 
@@ -1220,13 +2458,51 @@ static int raidxor_run(mddev_t *mddev)
 		goto out_free_sysfs;
 	}
 
+	/* worker 0 is the md thread */
+	for (i = 1; i < conf->n_workers; ++i) {
+		conf->workers[i].thread = kthread_run(raidxor_worker,
+						      &conf->workers[i],
+						      "%s_raidxor/%lu",
+						      mdname(mddev), i);
+		if (IS_ERR(conf->workers[i].thread)) {
+			printk(KERN_ERR
+			       "raidxor: couldn't start worker %lu for %s\n",
+			       i, mdname(mddev));
+			conf->workers[i].thread = NULL;
+			goto out_free_thread;
+		}
+
+		raidxor_pin_worker(&conf->workers[i]);
+	}
+
+	/* without a stored layout it's uploaded through sysfs, but a
+	   stored one isn't used without the records of its log */
+	err = raidxor_super_load(conf);
+	if (err < 0 && !test_bit(CONF_INCOMPLETE, &conf->flags)) {
+		raidxor_stop(mddev);
+		return err;
+	}
+
 	return 0;
 
+out_free_thread:
+	raidxor_stop_workers(conf);
+	md_unregister_thread(mddev->thread);
+	mddev->thread = NULL;
 out_free_sysfs:
 	sysfs_remove_group(&mddev->kobj, &raidxor_attrs_group);
 
 out_free_conf:
 	if (conf) {
+		if (conf->flush_wq)
+			destroy_workqueue(conf->flush_wq);
+		if (conf->derive_wq)
+			destroy_workqueue(conf->derive_wq);
+		if (conf->discard_wq)
+			destroy_workqueue(conf->discard_wq);
+		if (conf->rxbio_pool)
+			mempool_destroy(conf->rxbio_pool);
+		kfree(conf->workers);
 		kfree(conf);
 		mddev_to_conf(mddev) = NULL;
 	}
@@ -1244,24 +2520,99 @@ static int raidxor_stop(mddev_t *mddev)
 
 	WITHLOCKCONF(conf, flags, {
 	set_bit(CONF_STOPPING, &conf->flags);
+	});
+
+	/* flushes still queued need the workers for their lines */
+	destroy_workqueue(conf->flush_wq);
+	conf->flush_wq = NULL;
+
+#ifdef BIO_RW_DISCARD
+	/* returns when the last discard has finished */
+	destroy_workqueue(conf->discard_wq);
+	conf->discard_wq = NULL;
+#endif
+
+	/* a pending derivation waits for us, don't let it run */
+	cancel_delayed_work_sync(&conf->derive_work);
+
+	/* so lines waiting for it are failed */
+	WITHLOCKCONF(conf, flags, {
+	clear_bit(CONF_DERIVING, &conf->flags);
+	});
+	raidxor_cache_fail_parked(conf);
+
+	/* but the last change of the layout has to reach the members */
+	if (cancel_delayed_work_sync(&conf->super_work))
+		raidxor_super_write(conf);
+	destroy_workqueue(conf->derive_wq);
+	conf->derive_wq = NULL;
+
+	WITHLOCKCONF(conf, flags, {
 	raidxor_wait_for_no_active_lines(conf, &flags);
 	raidxor_wait_for_writeback(conf, &flags);
 	});
 
+	/* everything is on the members, the log is left empty */
+	raidxor_log_close(conf);
+
+	raidxor_stop_workers(conf);
 	md_unregister_thread(mddev->thread);
 	mddev->thread = NULL;
 
+	/* no more completions, so nothing is queued after this */
+	flush_workqueue(raidxor_wq);
+
 	sysfs_remove_group(&mddev->kobj, &raidxor_attrs_group);
 	blk_sync_queue(mddev->queue);
 
 	mddev_to_conf(mddev) = NULL;
 	raidxor_safe_free_conf(conf);
 	raidxor_complete_free_conf(conf);
+	mempool_destroy(conf->rxbio_pool);
+	kfree(conf->workers);
 	kfree(conf);
 
 	return 0;
 }
 
+/**
+ * raidxor_quiesce() - blocks new requests and waits for the array to idle
+ * @state: 1 to quiesce, 0 to resume
+ *
+ * Quiescing nests, requests continue after the last resume.  While
+ * quiesced, no line is in use, so lines, resources and equations can
+ * be changed without stopping the array.  The cache keeps its contents.
+ */
+static void raidxor_quiesce(mddev_t *mddev, int state)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	unsigned long flags = 0;
+
+	if (!conf)
+		return;
+
+	switch (state) {
+	case 1:
+		WITHLOCKCONF(conf, flags, {
+		++conf->quiesced;
+		wait_event_lock_irqsave(conf->wait_for_quiesce,
+					raidxor_conf_idle(conf),
+					conf->device_lock, flags,
+					/* nothing */);
+		});
+
+		/* a serve work item may still be queued for an idle line */
+		flush_workqueue(raidxor_wq);
+		break;
+	case 0:
+		WITHLOCKCONF(conf, flags, {
+		if (conf->quiesced > 0 && --conf->quiesced == 0)
+			wake_up_all(&conf->wait_for_quiesce);
+		});
+		break;
+	}
+}
+
 static void raidxor_align_sector_to_strip(raidxor_conf_t *conf,
 					  sector_t *sector)
 {
@@ -1313,34 +2664,360 @@ static int raidxor_check_bio_size_and_layout(raidxor_conf_t *conf,
 	return 0;
 }
 
-static int raidxor_make_request(struct request_queue *q, struct bio *bio)
+/**
+ * raidxor_discard_range() - the whole strips covered by a discard request
+ *
+ * Partial strips at the ends are left out, @start >= @end if there are
+ * none.
+ */
+static void raidxor_discard_range(raidxor_conf_t *conf, struct bio *bio,
+				  sector_t *start, sector_t *end)
 {
-	mddev_t *mddev;
-	raidxor_conf_t *conf;
-	cache_t *cache;
-	unsigned int line;
-	sector_t aligned_sector, strip_sectors, mod, div;
-	unsigned long flags = 0;
+	sector_t strip_sectors;
 
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out
-	CHECK_ARG(q);
-	CHECK_ARG(bio);
+	strip_sectors = (conf->chunk_size >> 9) * conf->n_data_units;
 
-	mddev = q->queuedata;
-	CHECK_PLAIN(mddev);
+	*end = bio->bi_sector + (bio->bi_size >> 9);
+	raidxor_align_sector_to_strip(conf, end);
+	*start = bio->bi_sector + strip_sectors - 1;
+	raidxor_align_sector_to_strip(conf, start);
+}
 
-	conf = mddev_to_conf(mddev);
-	CHECK_PLAIN(conf);
+#ifdef BIO_RW_DISCARD
+/**
+ * raidxor_cache_invalidate_line() - forgets the cached data of a strip
+ *
+ * Returns 0 if the strip isn't cached or its line was reset, or 1 if
+ * the line is busy and the strip must not be discarded.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_invalidate_line(cache_t *cache,
+						  unsigned int n_line)
+{
+	cache_line_t *line = cache->lines[n_line];
 
-	cache = conf->cache;
-	CHECK_PLAIN(cache);
+	/* someone waits for this data to be in the cache or on disk */
+	if (line->waiting || line->syncing ||
+	    test_bit(CACHE_LINE_FLUSH, &line->flags) ||
+	    test_bit(CACHE_LINE_RESYNC, &line->flags) ||
+	    test_bit(CACHE_LINE_BUSY, &line->flags))
+		return 1;
 
-	WITHLOCKCONF(conf, flags, {
-#undef CHECK_JUMP_LABEL
-#define CHECK_JUMP_LABEL out_unlock
+	switch (line->status) {
+	case CACHE_LINE_CLEAN:
+	case CACHE_LINE_READY:
+		return 0;
+	case CACHE_LINE_DIRTY:
+		raidxor_cache_line_end_write(cache, line);
+		raidxor_log_forget_line(cache->conf, line);
+	case CACHE_LINE_UPTODATE:
+		/* the pages stay, but are reloaded on the next access */
+		line->status = CACHE_LINE_READY;
+		raidxor_cache_unpin_line(cache, line);
+		return 0;
+	}
 
-	if (test_bit(CONF_STOPPING, &conf->flags) ||
+	return 1;
+}
+
+/**
+ * raidxor_discard_done() - ends the running discard request
+ *
+ * Takes it off conf->discards and lets the next one start.  The
+ * request was entered in raidxor_queue_discard() and is exited here.
+ */
+static void raidxor_discard_done(raidxor_conf_t *conf, struct bio *bio,
+				 int error)
+{
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	conf->discards = bio->bi_next;
+	bio->bi_next = NULL;
+	clear_bit(CONF_DISCARDING, &conf->flags);
+	wake_up(&conf->cache->wait_for_line);
+	--conf->n_submitting;
+	raidxor_wake_quiesce(conf);
+	});
+
+	bio_endio(bio, error);
+}
+
+static void raidxor_end_discard(struct bio *bio, int error)
+{
+	raidxor_bio_t *rxbio;
+	raidxor_conf_t *conf;
+	struct bio *master = NULL;
+	unsigned long flags = 0;
+
+	CHECK_FUN(raidxor_end_discard);
+
+	rxbio = (raidxor_bio_t *)(bio->bi_private);
+	conf = rxbio->cache->conf;
+
+	/* discarding is only a hint, so an unsupported or failed discard
+	   isn't a reason to fail the unit */
+	bio_put(bio);
+
+	WITHLOCKCONF(conf, flags, {
+	if ((--rxbio->remaining) == 0)
+		master = rxbio->master;
+	});
+
+	if (master) {
+		mempool_free(rxbio, conf->rxbio_pool);
+		raidxor_discard_done(conf, master, 0);
+	}
+}
+
+/**
+ * raidxor_discard_strips() - discards whole strips on all units
+ *
+ * With interleaved units, the regions of all units on a member are
+ * adjacent, so one discard per member is enough.
+ */
+static void raidxor_discard_strips(raidxor_conf_t *conf, raidxor_bio_t *rxbio,
+				   sector_t start, sector_t end)
+{
+	unsigned int i;
+	sector_t sectors;
+	struct bio *bio;
+	unsigned long flags = 0;
+
+	if (start >= end)
+		return;
+
+	/* length on a single unit */
+	sectors = end - start;
+	do_div(sectors, conf->n_data_units);
+	sectors *= conf->units_per_member;
+
+	for (i = 0; i < conf->n_units; ++i) {
+		if (conf->units[i].slot != 0 ||
+		    raidxor_unit_faulty(&conf->units[i]))
+			continue;
+
+		bio = bio_alloc(GFP_NOIO, 0);
+		if (!bio)
+			continue;
+
+		bio->bi_rw = RAIDXOR_DISCARD_RW;
+		bio->bi_bdev = conf->units[i].rdev->bdev;
+		bio->bi_sector = raidxor_unit_sector(conf, &conf->units[i],
+						     start);
+		bio->bi_size = sectors << 9;
+		bio->bi_private = rxbio;
+		bio->bi_end_io = raidxor_end_discard;
+
+		WITHLOCKCONF(conf, flags, {
+		++rxbio->remaining;
+		});
+
+		generic_make_request(bio);
+	}
+}
+
+/**
+ * raidxor_handle_discard() - forwards a discard to the units
+ *
+ * Only whole strips are discarded, on every unit including the
+ * redundant ones, so the equations hold for the rest of the array
+ * and a discarded strip is simply undefined as a whole.  Partial
+ * strips at the ends are left alone, as are strips whose cache line
+ * is busy.  Cached copies of discarded strips are dropped.
+ *
+ * Runs from raidxor_discard_work() with CONF_DISCARDING set; the
+ * request is ended by raidxor_discard_done().
+ */
+static void raidxor_handle_discard(raidxor_conf_t *conf, struct bio *bio)
+{
+	cache_t *cache = conf->cache;
+	raidxor_bio_t *rxbio;
+	sector_t start, end, strip_sectors, *busy, tmp;
+	unsigned int i, j, n_busy = 0, done = 0;
+	unsigned long flags = 0;
+
+	CHECK_FUN(raidxor_handle_discard);
+
+	strip_sectors = (conf->chunk_size >> 9) * conf->n_data_units;
+
+	raidxor_discard_range(conf, bio, &start, &end);
+	if (start >= end) {
+		raidxor_discard_done(conf, bio, 0);
+		return;
+	}
+
+	busy = kmalloc(sizeof(sector_t) * cache->n_lines, GFP_NOIO);
+	if (!busy)
+		goto out;
+
+	/* never fails, waits for a free one instead */
+	rxbio = mempool_alloc(conf->rxbio_pool, GFP_NOIO);
+	memset(rxbio, 0, sizeof(raidxor_bio_t));
+
+	rxbio->cache = cache;
+	rxbio->master = bio;
+	/* keeps the discard alive until all bios are submitted */
+	rxbio->remaining = 1;
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < cache->n_lines; ++i) {
+		if (cache->lines[i]->sector < start ||
+		    cache->lines[i]->sector >= end ||
+		    !raidxor_cache_invalidate_line(cache, i))
+			continue;
+
+		/* sorted insert */
+		tmp = cache->lines[i]->sector;
+		for (j = n_busy++; j > 0 && busy[j - 1] > tmp; --j)
+			busy[j] = busy[j - 1];
+		busy[j] = tmp;
+	}
+	});
+
+	/* discard the runs between busy lines */
+	for (i = 0; i < n_busy; ++i) {
+		raidxor_discard_strips(conf, rxbio, start, busy[i]);
+		start = busy[i] + strip_sectors;
+	}
+	raidxor_discard_strips(conf, rxbio, start, end);
+
+	kfree(busy);
+
+	WITHLOCKCONF(conf, flags, {
+	done = (--rxbio->remaining) == 0;
+	});
+
+	if (done) {
+		mempool_free(rxbio, conf->rxbio_pool);
+		raidxor_discard_done(conf, bio, 0);
+	}
+
+	return;
+out:
+	raidxor_discard_done(conf, bio, -EIO);
+}
+
+/**
+ * raidxor_discard_work() - handles the queued discard requests in order
+ *
+ * Called from conf->discard_wq, for the same reason as
+ * raidxor_flush_work(): the discards of the members can't be waited
+ * for in raidxor_make_request().  The next discard starts when the
+ * previous one has finished, and not while a strip is scrubbed.
+ */
+static void raidxor_discard_work(struct work_struct *work)
+{
+	raidxor_conf_t *conf = container_of(work, raidxor_conf_t,
+					    discard_work);
+	struct bio *bio;
+	unsigned long flags = 0;
+
+	for (;;) {
+		WITHLOCKCONF(conf, flags, {
+		wait_event_lock_irqsave(conf->cache->wait_for_line,
+					!test_bit(CONF_DISCARDING,
+						  &conf->flags) &&
+					!test_bit(CONF_SCRUBBING,
+						  &conf->flags),
+					conf->device_lock, flags,
+					/* nothing */);
+		bio = conf->discards;
+		if (bio)
+			set_bit(CONF_DISCARDING, &conf->flags);
+		});
+
+		if (!bio)
+			break;
+
+		raidxor_handle_discard(conf, bio);
+	}
+}
+
+/**
+ * raidxor_queue_discard() - passes a discard request to
+ *                           raidxor_discard_work()
+ *
+ * Must be called between raidxor_enter_request() and
+ * raidxor_exit_request(); the request stays entered until the discard
+ * is done.  From now on, requests for its range wait for it, so they
+ * can't be overtaken by it.
+ */
+static void raidxor_queue_discard(raidxor_conf_t *conf, struct bio *bio)
+{
+	struct bio **link;
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	++conf->n_submitting;
+
+	for (link = &conf->discards; *link; link = &(*link)->bi_next)
+		;
+	bio->bi_next = NULL;
+	*link = bio;
+	});
+
+	queue_work(conf->discard_wq, &conf->discard_work);
+}
+#endif
+
+/**
+ * raidxor_in_discard() - checks whether a strip is to be discarded
+ *
+ * That is, whether it's covered by a discard request that hasn't
+ * finished yet.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_in_discard(raidxor_conf_t *conf, sector_t sector)
+{
+	struct bio *bio;
+	sector_t start, end;
+
+	for (bio = conf->discards; bio; bio = bio->bi_next) {
+		raidxor_discard_range(conf, bio, &start, &end);
+		if (sector >= start && sector < end)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * raidxor_in_scrub() - checks whether a strip is currently scrubbed
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_in_scrub(raidxor_conf_t *conf, sector_t sector)
+{
+	return test_bit(CONF_SCRUBBING, &conf->flags) &&
+		sector == conf->scrub_sector;
+}
+
+/**
+ * raidxor_queue_request() - packs a request into its cache line
+ *
+ * Ends the request with an error if that isn't possible.
+ */
+static void raidxor_queue_request(raidxor_conf_t *conf, struct bio *bio)
+{
+	cache_t *cache = conf->cache;
+	unsigned int line;
+	sector_t aligned_sector, strip_sectors, mod, div;
+	unsigned long flags = 0;
+
+	CHECK_FUN(raidxor_queue_request);
+
+	/* marks the array active until the line is written back, see
+	   raidxor_cache_line_end_write() */
+	md_write_start(conf->mddev, bio);
+
+	WITHLOCKCONF(conf, flags, {
+#undef CHECK_JUMP_LABEL
+#define CHECK_JUMP_LABEL out_unlock
+
+	if (test_bit(CONF_STOPPING, &conf->flags) ||
 	    test_bit(CONF_ERROR, &conf->flags))
 		goto out_unlock;
 
@@ -1382,6 +3059,12 @@ static int raidxor_make_request(struct request_queue *q, struct bio *bio)
 	}
 
 retry:
+	/* don't overtake a pending discard or running scrub of this strip */
+	wait_event_lock_irqsave(cache->wait_for_line,
+				!raidxor_in_discard(conf, aligned_sector) &&
+				!raidxor_in_scrub(conf, aligned_sector),
+				conf->device_lock, flags, /* nothing */);
+
 	/* look for matching line or otherwise available */
 	if (!raidxor_cache_find_line(cache, aligned_sector, &line)) {
 		raidxor_wait_for_empty_line(conf, &flags);
@@ -1405,7 +3088,9 @@ retry:
 			goto out_retry_lock;
 		LOCKCONF(conf, flags);
 
-		if (cache->lines[line]->status != CACHE_LINE_READY)
+		/* a scrub may have started while unlocked */
+		if (cache->lines[line]->status != CACHE_LINE_READY ||
+		    raidxor_in_scrub(conf, aligned_sector))
 			goto out_retry;
 
 		if (raidxor_cache_make_load_me(cache, line, aligned_sector)) {
@@ -1415,23 +3100,740 @@ retry:
 	}
 
 	/* pack the request somewhere in the cache */
+	++cache->lines[line]->hits;
+	raidxor_cache_stamp_line(cache->lines[line], bio);
+	raidxor_cache_want_bio(cache, line, bio);
 	raidxor_cache_add_request(cache, line, bio);
+	raidxor_cache_queue_line(cache, line);
 	});
 
 	raidxor_wakeup_thread(conf);
 
-	return 0;
+	return;
 out_retry_lock:
 	LOCKCONF(conf, flags);
 out_retry:
 	goto retry;
 out_unlock:
 	UNLOCKCONF(conf, flags);
+	if (bio_data_dir(bio) == WRITE)
+		md_write_end(conf->mddev);
+	bio_io_error(bio);
+}
+
+/**
+ * raidxor_alloc_scrub() - allocates the private line of the scrub
+ *
+ * Only called from the sync thread, so there's no concurrent
+ * allocation.
+ */
+static raidxor_scrub_t * raidxor_alloc_scrub(raidxor_conf_t *conf)
+{
+	raidxor_scrub_t *scrub;
+	unsigned int i;
+
+	if (conf->scrub)
+		return conf->scrub;
+
+	scrub = kzalloc(sizeof(raidxor_scrub_t), GFP_NOIO);
+	if (!scrub)
+		return NULL;
+
+	scrub->cache = raidxor_alloc_cache(1, conf->n_data_units,
+					   conf->n_units - conf->n_data_units,
+					   conf->chunk_size >> PAGE_SHIFT, 1);
+	if (!scrub->cache) {
+		kfree(scrub);
+		return NULL;
+	}
+	scrub->cache->conf = conf;
+	conf->scrub = scrub;
+
+	scrub->expected = kzalloc(sizeof(struct page *) *
+				  scrub->cache->n_chunk_mult, GFP_NOIO);
+	if (!scrub->expected)
+		goto out_free;
+
+	for (i = 0; i < scrub->cache->n_chunk_mult; ++i)
+		if (!(scrub->expected[i] = alloc_page(GFP_NOIO)))
+			goto out_free;
+
+	if (raidxor_cache_make_ready(scrub->cache, 0))
+		goto out_free;
+
+	return scrub;
+out_free:
+	raidxor_free_scrub(conf);
+	return NULL;
+}
+
+static void raidxor_end_scrub(struct bio *bio, int error)
+{
+	raidxor_bio_t *rxbio = (raidxor_bio_t *)(bio->bi_private);
+	raidxor_conf_t *conf = rxbio->cache->conf;
+	unsigned int index, done = 0, wake = 0;
+	unsigned long flags = 0;
+
+	index = raidxor_bio_unit(bio);
+
+	/* read errors are repaired, see raidxor_scrub_read_errors() */
+	if (error && bio_data_dir(bio) == WRITE)
+		md_error(conf->mddev, conf->units[index].rdev);
+
+	WITHLOCKCONF(conf, flags, {
+	if (error) {
+		rxbio->faulty = 1;
+		if (bio_data_dir(bio) == READ)
+			__set_bit(index, rxbio->cache->lines[0]->bad);
+	}
+	if (raidxor_resource_end_bio(&conf->units[index]))
+		wake = 1;
+	if ((--rxbio->remaining) == 0)
+		done = 1;
+	});
+
+	if (done)
+		complete(&conf->scrub->done);
+
+	if (wake) raidxor_wakeup_thread(conf);
+}
+
+/**
+ * raidxor_scrub_transfer() - reads or writes units of the scrub line
+ * @units: the units to transfer
+ *
+ * Returns 0 if all transfers succeeded, else 1.
+ */
+static int raidxor_scrub_transfer(raidxor_conf_t *conf, unsigned long rw,
+				  unsigned long *units)
+{
+	raidxor_scrub_t *scrub = conf->scrub;
+	raidxor_bio_t *rxbio;
+	unsigned int i;
+
+	rxbio = raidxor_cache_start_bio(scrub->cache, 0);
+
+	for (i = 0; i < rxbio->n_bios; ++i) {
+		raidxor_cache_prepare_bio(scrub->cache, 0, i, rw,
+					  raidxor_end_scrub);
+
+		if (!test_bit(i, units) || !rxbio->bios[i]->bi_bdev) {
+			if (test_bit(i, units))
+				rxbio->faulty = 1;
+			rxbio->bios[i]->bi_bdev = NULL;
+			--rxbio->remaining;
+		}
+	}
+
+	if (rxbio->remaining > 0) {
+		init_completion(&scrub->done);
+		raidxor_cache_commit_bio(scrub->cache, 0);
+		wait_for_completion(&scrub->done);
+	}
+
+	scrub->cache->lines[0]->rxbio = NULL;
+
+	return rxbio->faulty;
+}
+
+/**
+ * raidxor_scrub_compare() - compares a redundant unit with its encoding
+ *
+ * The expected contents are left in scrub->expected.  Returns 1 if the
+ * unit differs, 0 if it matches and -EIO if it couldn't be encoded.
+ */
+static int raidxor_scrub_compare(raidxor_conf_t *conf, unsigned int unit)
+{
+	raidxor_scrub_t *scrub = conf->scrub;
+	cache_t *cache = scrub->cache;
+	cache_line_t *line = cache->lines[0];
+	unsigned int j, differs = 0;
+	void *expected, *found;
+
+	if (raidxor_xor_combine_temporary(cache, 0, scrub->expected,
+					  line->io,
+					  conf->units[unit].encoding->n_units,
+					  conf->units[unit].encoding->units, 1))
+		return -EIO;
+
+	for (j = 0; j < cache->n_chunk_mult && !differs; ++j) {
+		expected = kmap(scrub->expected[j]);
+		found = kmap(line->buffers[conf->units[unit].buffer *
+					   cache->n_chunk_mult + j]);
+		differs = memcmp(expected, found, PAGE_SIZE) != 0;
+		kunmap(line->buffers[conf->units[unit].buffer *
+				     cache->n_chunk_mult + j]);
+		kunmap(scrub->expected[j]);
+	}
+
+	return differs;
+}
+
+/**
+ * raidxor_scrub_read_errors() - handles units the scrub failed to read
+ * @repair: the units to write back are added here
+ *
+ * Like for the lines of the cache, see raidxor_cache_repairable():
+ * data units are decoded from the others, redundant ones are encoded
+ * again from the data by the comparison.  Returns 0 if the strip can
+ * be checked, else 1, after failing the units which can't be repaired.
+ */
+static int raidxor_scrub_read_errors(raidxor_conf_t *conf,
+				     unsigned long *repair)
+{
+	raidxor_scrub_t *scrub = conf->scrub;
+	cache_line_t *line = scrub->cache->lines[0];
+	unsigned int i, n = conf->n_units, lost = 0;
+	unsigned long flags = 0;
+	DECLARE_BITMAP(failed, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(decode, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(temps, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(inputs, RAIDXOR_MAX_UNITS);
+
+	bitmap_zero(failed, n);
+	bitmap_zero(decode, n);
+	bitmap_zero(temps, RAIDXOR_MAX_UNITS);
+	bitmap_zero(inputs, n);
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < n; ++i)
+		if (!raidxor_unit_readable(&conf->units[i]))
+			lost = 1;
+
+	for (i = find_first_bit(line->bad, n); i < n;
+	     i = find_next_bit(line->bad, n, i + 1)) {
+		if (!raidxor_cache_repairable(conf, line, i))
+			__set_bit(i, failed);
+		else if (!raidxor_unit_reencoded(&conf->units[i])) {
+			__set_bit(i, decode);
+			raidxor_decoding_units(conf, conf->units[i].decoding,
+					       inputs, temps);
+		}
+	}
+	});
+
+	for (i = find_first_bit(failed, n); i < n;
+	     i = find_next_bit(failed, n, i + 1))
+		md_error(conf->mddev, conf->units[i].rdev);
+
+	/* a unit failed meanwhile, the strip is left to the resync */
+	if (lost || !bitmap_empty(failed, n))
+		return 1;
+
+	if (raidxor_xor_decode_batch(scrub->cache, 0, line->io, temps, decode))
+		return 1;
+
+	bitmap_or(repair, repair, line->bad, n);
+	return 0;
+}
+
+/**
+ * raidxor_scrub_strip() - checks the redundant units of a strip
+ * @strip: number of the strip
+ * @sectors: member sectors the strip covers
+ *
+ * Started by writing "check" or "repair" to md's sync_action.  Reads
+ * all units of the strip into the private line of the scrub, encodes
+ * the redundant units again and compares them with what was read.
+ * Mismatches are counted in md's mismatch_cnt, a repair also writes
+ * the expected contents.  A strip which couldn't be encoded counts as
+ * a mismatch as well, since it isn't known to be consistent.  Units
+ * which failed to read are repaired in both cases, see
+ * raidxor_scrub_read_errors().
+ *
+ * Strips a line of the cache is working on are skipped, since the
+ * disks may not match yet; the scrub never takes lines away from
+ * requests.  So a strip which stays dirty or busy for the whole pass
+ * isn't checked.  Its writeback encodes all redundant units from the
+ * data anyway, which repairs whatever the scrub would have found.
+ * Rate limits and progress are those of md's resync.
+ *
+ * Must be called between raidxor_enter_request() and
+ * raidxor_exit_request().  Returns the number of sectors handled, or 0
+ * to abort the scrub.
+ */
+static sector_t raidxor_scrub_strip(raidxor_conf_t *conf, sector_t strip,
+				    sector_t sectors, int *skipped)
+{
+	mddev_t *mddev = conf->mddev;
+	raidxor_scrub_t *scrub;
+	cache_line_t *line;
+	sector_t sector;
+	unsigned int i;
+	unsigned long flags = 0;
+	int differs;
+	DECLARE_BITMAP(units, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(repair, RAIDXOR_MAX_UNITS);
+
+	CHECK_FUN(raidxor_scrub_strip);
+
+	scrub = raidxor_alloc_scrub(conf);
+	if (!scrub) {
+		printk(KERN_ERR "raidxor: couldn't allocate the scrub line\n");
+		return 0;
+	}
+	line = scrub->cache->lines[0];
+
+	sector = strip * (conf->chunk_size >> 9) * conf->n_data_units;
+
+	WITHLOCKCONF(conf, flags, {
+	wait_event_lock_irqsave(conf->cache->wait_for_line,
+				!test_bit(CONF_DISCARDING, &conf->flags),
+				conf->device_lock, flags, /* nothing */);
+
+	if (!raidxor_cache_strip_idle(conf->cache, sector)) {
+		UNLOCKCONF(conf, flags);
+		goto out_skip;
+	}
+
+	for (i = 0; i < conf->n_units; ++i)
+		if (!raidxor_unit_readable(&conf->units[i])) {
+			UNLOCKCONF(conf, flags);
+			goto out_skip;
+		}
+
+	set_bit(CONF_SCRUBBING, &conf->flags);
+	conf->scrub_sector = sector;
+	});
+
+	line->sector = sector;
+
+	bitmap_fill(units, conf->n_units);
+	bitmap_zero(line->bad, conf->n_units);
+	bitmap_zero(repair, conf->n_units);
+	if (raidxor_scrub_transfer(conf, READ, units) &&
+	    raidxor_scrub_read_errors(conf, repair))
+		goto out_done;
+
+	for (i = 0; i < conf->n_enc_temps; ++i)
+		if (raidxor_xor_combine_encode_temporary(scrub->cache, 0,
+							 &line->temp_buffers[i * scrub->cache->n_chunk_mult],
+							 line->io,
+							 conf->enc_temps[i]))
+			goto out_error;
+
+	bitmap_copy(units, repair, conf->n_units);
+
+	for (i = 0; i < conf->n_units; ++i) {
+		if (!conf->units[i].redundant)
+			continue;
+
+		differs = raidxor_scrub_compare(conf, i);
+		if (differs < 0)
+			goto out_error;
+
+		/* what failed to read is rewritten, but isn't a mismatch */
+		if (!test_bit(i, repair)) {
+			if (!differs)
+				continue;
+
+			mddev->resync_mismatches += conf->chunk_size >> 9;
+
+			if (test_bit(MD_RECOVERY_CHECK, &mddev->recovery))
+				continue;
+		}
+
+		__set_bit(i, units);
+		raidxor_copy_pages(scrub->cache->n_chunk_mult,
+				   &line->buffers[conf->units[i].buffer *
+						  scrub->cache->n_chunk_mult],
+				   scrub->expected);
+	}
+
+	if (!bitmap_empty(units, conf->n_units) &&
+	    !raidxor_scrub_transfer(conf, WRITE, units) &&
+	    !bitmap_empty(repair, conf->n_units) && printk_ratelimit())
+		printk(KERN_INFO "raidxor: repaired read errors in strip "
+		       "%llu of %s\n", (unsigned long long) strip,
+		       mdname(mddev));
+	goto out_done;
+
+out_error:
+	/* counted like a mismatching unit, but nothing is repaired */
+	printk(KERN_ERR "raidxor: couldn't encode strip %llu of %s for "
+	       "the scrub\n", (unsigned long long) strip, mdname(mddev));
+	mddev->resync_mismatches += conf->chunk_size >> 9;
+out_done:
+	WITHLOCKCONF(conf, flags, {
+	clear_bit(CONF_SCRUBBING, &conf->flags);
+	wake_up_all(&conf->cache->wait_for_line);
+	});
+
+	md_done_sync(mddev, sectors, 1);
+	return sectors;
+out_skip:
+	*skipped = 1;
+	return sectors;
+}
+
+/**
+ * raidxor_sync_request() - resyncs the strip at a member sector
+ *
+ * md walks the member devices, one strip covers chunk_size *
+ * units_per_member bytes on each of them.  The strip is loaded into a
+ * line, units which aren't readable are recovered from the others and
+ * the whole line is written back, which rebuilds replaced members and
+ * makes the redundant units consistent again.  md learns about the
+ * progress from raidxor_cache_end_resync(); its speed limits and
+ * checkpoints apply as for every other level.  With a write-intent
+ * bitmap, strips whose regions weren't written since they were last in
+ * sync are skipped, unless a new member has to be filled completely.
+ *
+ * Returns the number of member sectors up to the end of the strip, or
+ * 0 to abort the resync.
+ */
+static sector_t raidxor_sync_request(mddev_t *mddev, sector_t sector_nr,
+				     int *skipped, int go_faster)
+{
+	raidxor_conf_t *conf = mddev_to_conf(mddev);
+	cache_t *cache;
+	unsigned int line;
+	sector_t max_sector = mddev->size << 1;
+	sector_t member_sectors, strip_sectors, strip, sectors = 0, sector;
+	unsigned long flags = 0;
+	unsigned int i, needed = 0, degraded = 0;
+	int blocks;
+
+	CHECK_FUN(raidxor_sync_request);
+
+	if (sector_nr >= max_sector) {
+		/* an aborted resync keeps the rest of its bitmap chunk */
+		if (mddev->curr_resync < max_sector)
+			bitmap_end_sync(mddev->bitmap, mddev->curr_resync,
+					&blocks, 1);
+		else
+			conf->fullsync = 0;
+		bitmap_close_sync(mddev->bitmap);
+		return 0;
+	}
+
+	member_sectors = (conf->chunk_size >> 9) * conf->units_per_member;
+	strip_sectors = (conf->chunk_size >> 9) * conf->n_data_units;
+
+	strip = sector_nr;
+	sectors = member_sectors - do_div(strip, member_sectors);
+
+	/* members being rebuilt don't count, they're what's synced */
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < conf->n_units; ++i)
+		if (raidxor_unit_faulty(&conf->units[i]))
+			degraded = 1;
+	});
+
+	/* a strip may span several bitmap chunks, all of them are
+	   synced, so all of them have to be started */
+	for (sector = sector_nr; sector < sector_nr + sectors;
+	     sector += blocks)
+		needed |= bitmap_start_sync(mddev->bitmap, sector, &blocks,
+					    degraded);
+
+	/* regions the bitmap knows to be in sync are skipped */
+	if (!needed && !conf->fullsync &&
+	    !test_bit(MD_RECOVERY_REQUESTED, &mddev->recovery)) {
+		*skipped = 1;
+		return sectors;
+	}
+
+	bitmap_cond_end_sync(mddev->bitmap, sector_nr);
+
+	raidxor_enter_request(conf);
+
+	LOCKCONF(conf, flags);
+
+	/* without a layout there's nothing to rebuild from */
+	if (test_bit(CONF_INCOMPLETE, &conf->flags) ||
+	    test_bit(CONF_STOPPING, &conf->flags) ||
+	    test_bit(CONF_ERROR, &conf->flags))
+		goto out_abort;
+
+	cache = conf->cache;
+
+	/* check and repair only compare, see raidxor_scrub_strip() */
+	if (test_bit(MD_RECOVERY_REQUESTED, &mddev->recovery)) {
+		UNLOCKCONF(conf, flags);
+		sectors = raidxor_scrub_strip(conf, strip, sectors, skipped);
+		raidxor_exit_request(conf);
+		return sectors;
+	}
+
+retry:
+	wait_event_lock_irqsave(cache->wait_for_line,
+				!raidxor_in_discard(conf,
+						    strip * strip_sectors),
+				conf->device_lock, flags, /* nothing */);
+
+	if (!raidxor_cache_find_line(cache, strip * strip_sectors, &line)) {
+		raidxor_wait_for_empty_line(conf, &flags);
+
+		if (test_bit(CONF_STOPPING, &conf->flags) ||
+		    test_bit(CONF_ERROR, &conf->flags))
+			goto out_abort;
+	}
+
+	if (!raidxor_cache_find_line(cache, strip * strip_sectors, &line))
+		goto out_abort;
+
+	if (cache->lines[line]->status == CACHE_LINE_CLEAN ||
+	    cache->lines[line]->status == CACHE_LINE_READY)
+	{
+		UNLOCKCONF(conf, flags);
+		if (raidxor_cache_make_ready(cache, line)) {
+			LOCKCONF(conf, flags);
+			goto retry;
+		}
+		LOCKCONF(conf, flags);
+
+		if (cache->lines[line]->status != CACHE_LINE_READY)
+			goto retry;
+
+		if (raidxor_cache_make_load_me(cache, line,
+					       strip * strip_sectors))
+			goto out_abort;
+	}
+
+	set_bit(CACHE_LINE_RESYNC, &cache->lines[line]->flags);
+	cache->lines[line]->sync_sectors += sectors;
+	raidxor_cache_want_bio(cache, line, NULL);
+	raidxor_cache_queue_line(cache, line);
+	UNLOCKCONF(conf, flags);
+
+	raidxor_exit_request(conf);
+	raidxor_wakeup_thread(conf);
+
+	return sectors;
+out_abort:
+	UNLOCKCONF(conf, flags);
+	raidxor_exit_request(conf);
+	return 0;
+}
+
+
+static void raidxor_end_flush_unit(struct bio *bio, int error)
+{
+	raidxor_flush_t *flush = (raidxor_flush_t *)(bio->bi_private);
+
+	/* a member without cache flushes can't do any better */
+	if (error && error != -EOPNOTSUPP)
+		flush->error = error;
+
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&flush->remaining))
+		complete(&flush->done);
+}
+
+/**
+ * raidxor_flush_units() - flushes the write caches of all members
+ *
+ * Returns 0 on success, else a negative error code.
+ */
+static int raidxor_flush_units(raidxor_conf_t *conf)
+{
+	unsigned int i;
+	struct bio *bio;
+	raidxor_flush_t flush;
+
+	atomic_set(&flush.remaining, 1);
+	init_completion(&flush.done);
+	flush.error = 0;
+
+	/* interleaved units share a member, flush it only once */
+	for (i = 0; i < conf->n_units; ++i) {
+		if (conf->units[i].slot != 0 ||
+		    raidxor_unit_faulty(&conf->units[i]))
+			continue;
+
+		bio = bio_alloc(GFP_NOIO, 0);
+		if (!bio) {
+			flush.error = -ENOMEM;
+			continue;
+		}
+
+		bio->bi_rw = RAIDXOR_FLUSH_RW;
+		bio->bi_bdev = conf->units[i].rdev->bdev;
+		bio->bi_private = &flush;
+		bio->bi_end_io = raidxor_end_flush_unit;
+
+		atomic_inc(&flush.remaining);
+		generic_make_request(bio);
+	}
+
+	if (!atomic_dec_and_test(&flush.remaining))
+		wait_for_completion(&flush.done);
+
+	return flush.error;
+}
+
+/**
+ * raidxor_handle_flush() - makes everything written so far durable
+ *
+ * Only the lines that are dirty or being written back right now are
+ * waited for; after they are on disk, the members are flushed.  Any
+ * data in the request is then handled like a FUA write.  Runs from
+ * raidxor_flush_work(), other lines continue normally.
+ *
+ * With a log, lines whose contents are logged already aren't waited
+ * for, the others are persisted by writing them to the log.
+ */
+static void raidxor_handle_flush(raidxor_conf_t *conf, struct bio *bio)
+{
+	cache_t *cache = conf->cache;
+	cache_line_t *line;
+	unsigned int i;
+	unsigned long flags = 0;
+	int error;
+
+	CHECK_FUN(raidxor_handle_flush);
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+		if (line->status != CACHE_LINE_DIRTY &&
+		    line->status != CACHE_LINE_LOGGING &&
+		    line->status != CACHE_LINE_WRITEBACK)
+			continue;
+
+		if (conf->log && !conf->log->failed &&
+		    test_bit(CACHE_LINE_LOGGED, &line->flags))
+			continue;
+
+		set_bit(CACHE_LINE_FLUSH, &line->flags);
+		++conf->flush_remaining;
+		raidxor_cache_queue_line(cache, i);
+	}
+	});
+
+	raidxor_wakeup_thread(conf);
+
+	WITHLOCKCONF(conf, flags, {
+	wait_event_lock_irqsave(conf->wait_for_flush,
+				conf->flush_remaining == 0,
+				conf->device_lock, flags, /* nothing */);
+	});
+
+	error = raidxor_flush_units(conf);
+
+	if (error || bio->bi_size == 0) {
+		bio_endio(bio, error);
+		return;
+	}
+
+	raidxor_queue_request(conf, bio);
+}
+
+/**
+ * raidxor_flush_work() - handles the queued flush requests in order
+ *
+ * Called from a workqueue: bios sent from raidxor_make_request() are
+ * only queued on current->bio_list until it returns, so the flushes of
+ * the members can't be waited for there.  Each request was entered in
+ * raidxor_queue_flush() and is exited here, so the array isn't
+ * quiesced in between.
+ */
+static void raidxor_flush_work(struct work_struct *work)
+{
+	raidxor_conf_t *conf = container_of(work, raidxor_conf_t,
+					    flush_work);
+	struct bio *bio;
+	unsigned long flags = 0;
+
+	for (;;) {
+		WITHLOCKCONF(conf, flags, {
+		bio = conf->flushes;
+		if (bio) {
+			conf->flushes = bio->bi_next;
+			bio->bi_next = NULL;
+		}
+		});
+
+		if (!bio)
+			break;
+
+		raidxor_handle_flush(conf, bio);
+		raidxor_exit_request(conf);
+	}
+}
+
+/**
+ * raidxor_queue_flush() - passes a flush request to raidxor_flush_work()
+ *
+ * Must be called between raidxor_enter_request() and
+ * raidxor_exit_request(); the request stays entered until the flush is
+ * done.
+ */
+static void raidxor_queue_flush(raidxor_conf_t *conf, struct bio *bio)
+{
+	struct bio **link;
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	++conf->n_submitting;
+
+	for (link = &conf->flushes; *link; link = &(*link)->bi_next)
+		;
+	bio->bi_next = NULL;
+	*link = bio;
+	});
+
+	queue_work(conf->flush_wq, &conf->flush_work);
+}
+
+static int raidxor_make_request(struct request_queue *q, struct bio *bio)
+{
+	mddev_t *mddev;
+	raidxor_conf_t *conf;
+	cache_t *cache;
+
+#undef CHECK_JUMP_LABEL
+#define CHECK_JUMP_LABEL out
+	CHECK_ARG(q);
+	CHECK_ARG(bio);
+
+	mddev = q->queuedata;
+	CHECK_PLAIN(mddev);
+
+	conf = mddev_to_conf(mddev);
+	CHECK_PLAIN(conf);
+
+	if (test_bit(CONF_STOPPING, &conf->flags) ||
+	    test_bit(CONF_ERROR, &conf->flags))
+		goto out;
+
+	/* waits while the array is quiesced */
+	raidxor_enter_request(conf);
+
+#undef CHECK_JUMP_LABEL
+#define CHECK_JUMP_LABEL out_exit
+	/* the cache may have been replaced while quiesced */
+	cache = conf->cache;
+	CHECK_PLAIN(cache);
+
+#ifdef BIO_RW_DISCARD
+	if (raidxor_bio_discard(bio)) {
+		raidxor_queue_discard(conf, bio);
+		goto out_done;
+	}
+#endif
+
+	if (raidxor_bio_flush(bio)) {
+		raidxor_queue_flush(conf, bio);
+		goto out_done;
+	}
+
+	raidxor_queue_request(conf, bio);
+
+out_done:
+	raidxor_exit_request(conf);
+	return 0;
+out_exit: __attribute__((unused))
+	raidxor_exit_request(conf);
 out: __attribute__((unused))
 	bio_io_error(bio);
 	return 0;
 }
 
+#include "log.c"
+#include "super.c"
 #include "init.c"
 
 #if 0
@@ -2,3 +2,51 @@
 
 static int number_of_cache_lines = 10;
 module_param(number_of_cache_lines, int, S_IRUGO);
+
+static int resource_queue_depth = 8;
+module_param(resource_queue_depth, int, S_IRUGO);
+
+/* 1 uses one member device per unit, else the units of a resource are
+   interleaved chunk by chunk on a single member device; only for new
+   arrays, assembled ones use the value of their layout */
+static int units_per_member = 1;
+module_param(units_per_member, int, S_IRUGO | S_IWUSR);
+
+/* if set, the page pool of the cache is allocated in blocks of one
+   chunk each, which are split into single pages afterwards */
+static int cache_chunk_pages = 0;
+module_param(cache_chunk_pages, int, S_IRUGO | S_IWUSR);
+
+/* threads per array handling cache lines, including the md thread */
+static int number_of_workers = 1;
+module_param(number_of_workers, int, S_IRUGO | S_IWUSR);
+
+/* deadlines of requests in milliseconds, lines with expired requests
+   are handled first */
+static int read_expire = 500;
+module_param(read_expire, int, S_IRUGO | S_IWUSR);
+
+static int write_expire = 5000;
+module_param(write_expire, int, S_IRUGO | S_IWUSR);
+
+/* read errors a member may have before it's failed; below that, the
+   data is decoded, or encoded for redundant units, and written back in
+   place, also by the scrub; see raidxor_cache_repairable() */
+static int max_read_errors = 20;
+module_param(max_read_errors, int, S_IRUGO | S_IWUSR);
+
+/* percentage of a resource's dispatches that resync, rebuild and scrub
+   get while foreground bios are waiting, see
+   raidxor_resource_dequeue_bio() */
+static int resync_share = 20;
+module_param(resync_share, int, S_IRUGO | S_IWUSR);
+
+/* percentage of the cache lines which may keep data decoded for failed
+   units, see raidxor_cache_pin_line(); clamped to 0 to 100 */
+static int degraded_cache_share = 50;
+module_param(degraded_cache_share, int, S_IRUGO | S_IWUSR);
+
+/* if set, an array whose log can't be reattached is started anyway,
+   losing the records in it, see raidxor_super_load() */
+static int start_without_log = 0;
+module_param(start_without_log, int, S_IRUGO | S_IWUSR);
@@ -9,6 +9,9 @@
 /* new raid level e.g. for mdadm */
 #define LEVEL_XOR (-10)
 
+/* unit indices are single bytes in the sysfs format */
+#define RAIDXOR_MAX_UNITS 256
+
 typedef struct disk_info disk_info_t;
 typedef struct coding coding_t;
 typedef struct encoding encoding_t;
@@ -19,26 +22,93 @@ typedef struct raidxor_resource resource_t;
 typedef struct cache cache_t;
 typedef struct cache_line cache_line_t;
 typedef struct raidxor_request raidxor_request_t;
+typedef struct raidxor_flush raidxor_flush_t;
+typedef struct raidxor_unit_bio raidxor_unit_bio_t;
+typedef struct raidxor_worker raidxor_worker_t;
+typedef struct raidxor_page_pool raidxor_page_pool_t;
+typedef struct raidxor_scrub raidxor_scrub_t;
+typedef struct raidxor_log raidxor_log_t;
+typedef struct raidxor_log_io raidxor_log_io_t;
 
 /**
  * struct cache_line - buffers multiple blocks over a stripe
  * @flags: current status of the line
  * @virtual_sector: index into the virtual device
+ * @cache: the cache this line belongs to
+ * @index: number of the line in the cache
+ * @node: NUMA node holding the line and its buffers
+ * @deadline: earliest deadline of the requests in @waiting and @syncing,
+ *            meaningless while both are empty
+ * @hits: requests for the strip, halved whenever lines are evicted
+ * @work: entry in one of the work lists of the cache
+ * @serve_work: serves waiting requests directly after a load completes
+ * @rxbio: the running transfer, if any
+ * @io: preallocated transfer, reused for every load and writeback
  * @waiting: waiting requests
+ * @syncing: served FUA requests, ended after the next writeback
+ * @sync_sectors: sectors of a running resync covered by this line
+ * @valid: units whose buffers hold their current contents
+ * @want: units the waiting requests need, see raidxor_cache_want_bio()
+ * @loading: units read by the running load
+ * @recovering: units decoded after the running load
+ * @bad: units which failed to read, decoded and rewritten instead
+ * @log_seq: record in the log holding the line's contents, 0 if none
+ * @log_writing: record of the line currently written to the log
  * @buffers: actual data
  */
 struct cache_line {
 	unsigned long status;
+	unsigned long flags;
 	sector_t sector;
 
+	cache_t *cache;
+	unsigned int index;
+	int node;
+	unsigned long deadline;
+	unsigned int hits;
+	struct list_head work;
+	struct work_struct serve_work;
+
 	raidxor_bio_t *rxbio;
+	raidxor_bio_t *io;
 	struct bio *waiting;
+	struct bio *syncing;
+	sector_t sync_sectors;
+
+	/* the read plan, see raidxor_cache_plan_load() */
+	DECLARE_BITMAP(valid, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(want, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(loading, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(recovering, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(bad, RAIDXOR_MAX_UNITS);
+
+	u64 log_seq, log_writing;
 
 	struct page **temp_buffers;
 
 	struct page *buffers[0];
 };
 
+/**
+ * struct raidxor_page_pool - reserved pages on one NUMA node
+ * @n_pages: number of pages reserved for the lines on this node
+ * @n_free_pages: number of pages currently in @pages
+ * @pages: stack of unused pages
+ */
+struct raidxor_page_pool {
+	unsigned int n_pages, n_free_pages;
+	struct page **pages;
+};
+
+/* work lists of the cache, see raidxor_cache_queue_line() */
+#define CACHE_WORK_SERVE     0 /* copy data of waiting requests */
+#define CACHE_WORK_RECOVER   1 /* reconstruct data of faulty units */
+#define CACHE_WORK_LOAD      2 /* read the strip from disk */
+#define CACHE_WORK_WRITEBACK 3 /* persist for a flush or FUA request */
+#define CACHE_WORK_MAX       4
+/* lists per queue, urgent lines are kept apart from the others */
+#define CACHE_WORK_LISTS     (2 * CACHE_WORK_MAX)
+
 /**
  * struct cache - groups access to the individual cache lines
  * @active_lines: number of currently active read/write activities
@@ -48,6 +118,14 @@ struct cache_line {
  * @n_chunk_mult: number of buffers per chunk
  * @n_waiting: number of processes waiting for a free line
  * @wait_for_line: waitqueue so we're able to wait for the event above
+ * @n_pinned: number of lines with CACHE_LINE_PINNED set
+ * @n_pages: number of pages reserved for the buffers of all lines
+ * @pools: reserved pages, one pool per NUMA node, lines take and return
+ *         their buffers here instead of going through the page allocator
+ * @n_queues: number of work queues, one per worker
+ * @work: lines with something to do, CACHE_WORK_LISTS lists per queue,
+ *        one for each kind of work with and without urgent requests,
+ *        each sorted by deadline, see raidxor_cache_queue_line()
  *
  * device_lock needs to be hold when accessing the cache.
  */
@@ -59,6 +137,14 @@ struct cache {
 	unsigned int n_waiting;
 	wait_queue_head_t wait_for_line;
 
+	unsigned int n_pinned;
+
+	unsigned int n_pages;
+	raidxor_page_pool_t *pools;
+
+	unsigned int n_queues;
+	struct list_head *work;
+
 	cache_line_t *lines[0];
 };
 
@@ -72,11 +158,60 @@ struct cache {
 #define CACHE_LINE_WRITEBACK 7
 #define CACHE_LINE_FAULTY    8
 #define CACHE_LINE_RECOVERY  9
+#define CACHE_LINE_LOGGING   10
+
+/* bits in cache_line->flags */
+#define CACHE_LINE_FLUSH 0 /* has to be written back for a running flush */
+#define CACHE_LINE_SYNC  1 /* has FUA requests in ->syncing */
+#define CACHE_LINE_BUSY  2 /* owned by a worker, see raidxor_work_line() */
+#define CACHE_LINE_REQUEUE 3 /* state changed while BUSY, queue again */
+#define CACHE_LINE_URGENT 4 /* has reads or synchronous writes waiting */
+#define CACHE_LINE_RESYNC 5 /* has to be written back for a resync */
+#define CACHE_LINE_ACTIVE 6 /* keeps the array marked active, see
+			       raidxor_cache_line_end_write() */
+#define CACHE_LINE_LOGGED 7 /* contents are in the log, see log.c */
+#define CACHE_LINE_CHECKPOINT 8 /* has to be written back to free the log */
+#define CACHE_LINE_PINNED 9 /* holds decoded data of failed units */
+#define CACHE_LINE_SPARE 10 /* decoded units go to a spare being rebuilt */
+#define CACHE_LINE_PARKED 11 /* load waits for decodings, see
+				raidxor_cache_unpark_lines() */
+
+/* serves requests from completions, shared by all arrays */
+static struct workqueue_struct *raidxor_wq;
+
+static void raidxor_serve_line(struct work_struct *work);
+static void raidxor_flush_work(struct work_struct *work);
+#ifdef BIO_RW_DISCARD
+static void raidxor_discard_work(struct work_struct *work);
+#endif
+static int raidxor_stop(mddev_t *mddev);
+static void raidxor_quiesce(mddev_t *mddev, int state);
+static void raidxor_wake_quiesce(raidxor_conf_t *conf);
+static void raidxor_free_scrub(raidxor_conf_t *conf);
+
+static int raidxor_log_line(cache_t *cache, unsigned int n_line);
+static void raidxor_log_line_changed(raidxor_conf_t *conf,
+				     cache_line_t *line);
+static void raidxor_log_forget_line(raidxor_conf_t *conf,
+				    cache_line_t *line);
+static int raidxor_log_attach(raidxor_conf_t *conf, const char *path);
+static int raidxor_log_attach_dev(raidxor_conf_t *conf, u32 dev);
+static void raidxor_log_detach(raidxor_conf_t *conf);
+static void raidxor_log_close(raidxor_conf_t *conf);
+
+static int raidxor_super_units_per_member(mddev_t *mddev);
+static sector_t raidxor_super_data_size(raidxor_conf_t *conf,
+					unsigned int reserve);
+static int raidxor_super_load(raidxor_conf_t *conf);
+static int raidxor_super_write(raidxor_conf_t *conf);
+static void raidxor_super_work(struct work_struct *work);
+static void raidxor_super_schedule(raidxor_conf_t *conf);
 
 static cache_t * raidxor_alloc_cache(unsigned int n_lines,
 				     unsigned int n_buffers,
 				     unsigned int n_red_buffers,
-				     unsigned int n_chunk_mult);
+				     unsigned int n_chunk_mult,
+				     unsigned int n_queues);
 
 /*
    Life cycle of a cache line:
@@ -115,6 +250,21 @@ static cache_t * raidxor_alloc_cache(unsigned int n_lines,
   11: recovery finished, so we are done
 
    during LOADING, RECOVERY and WRITEBACK, nothing is done in the handlers.
+
+   with a log device, a DIRTY line is LOGGING before it's written back,
+   and only goes on to WRITEBACK once its contents are in the log; see
+   log.c.
+
+   an UPTODATE line may hold only the units its requests needed so far,
+   see ->valid.  if a later request needs more, the line is loaded again,
+   reading only the missing units (or what their decodings need).  DIRTY
+   lines always hold all data units.
+
+   lines holding data decoded for failed units are pinned while the
+   array is degraded, up to degraded_cache_share percent of the cache.
+   they're evicted last, and the ones with the fewest requests first.
+   once a spare is added, their decoded units are written to it ahead
+   of the rebuild.
    the transition from clean to ready is simply memory (de-)allocation, so
    nothing fancy there.
 
@@ -141,6 +291,9 @@ static cache_t * raidxor_alloc_cache(unsigned int n_lines,
 
    if recovery is successful, we end up in the correct state.  globally, we
    record, which device failed (which is considered broken forever).
+   a read error below max_read_errors doesn't fail the device: the unit
+   is decoded like a failed one, and RECOVERY lasts until its data was
+   written back in place, see raidxor_cache_repair_line().
    if its unable to recover, we go back to ready and completely abort the
    request
 
@@ -172,7 +325,8 @@ static cache_t * raidxor_alloc_cache(unsigned int n_lines,
  * @encoding: contains the encoding equation if it's a redundant unit
  * @decoding: contains the decoding equation if available
  * @resource: the resource this unit belongs to
- * @stripe: the stripe this unit belongs to
+ * @slot: region of the member device holding this unit
+ * @buffer: index of the unit's buffers in a cache line
  *
  * This is the smallest building block in this driver.  One unit is the
  * actual backing storage for data, either redundancy information or
@@ -188,6 +342,8 @@ struct disk_info {
 	decoding_t *decoding;
 
 	resource_t *resource;
+	unsigned int slot;
+	unsigned int buffer;
 };
 
 /**
@@ -259,16 +415,220 @@ static int raidxor_xor_combine_decode(cache_t *cache, unsigned int n_line,
 /**
  * struct resource - one resource consists of many units
  * @n_units: the number of contained units
+ * @in_flight: number of submitted, but not yet completed bios
+ * @head: position on the disk of the last submitted bio
+ * @pending: bios waiting for submission, sorted by disk position
+ * @background: resync, rebuild and scrub bios, sorted the same way
+ * @writes_starved: number of times reads were preferred over waiting writes
+ * @background_credit: dispatches earned by @background, in percent
  * @units: the actual units
  *
- * In the rectangular raid layout, this is a row of units.
+ * In the rectangular raid layout, this is a row of units.  Since all
+ * units of a resource live on the same physical disk, bios are queued
+ * per resource and submitted in ascending order, at most
+ * resource_queue_depth at a time (see raidxor_dispatch_resource()).
+ * Reads go first, but not more than RAIDXOR_WRITES_STARVED times in a
+ * row while writes are waiting.  Background bios get a share of the
+ * dispatches set by resync_share, so a rebuild reads from all
+ * resources in parallel without starving the requests.
+ *
+ * device_lock needs to be hold when accessing the queue.
  */
 struct raidxor_resource {
 	unsigned int n_units;
+
+	unsigned int in_flight;
+	sector_t head;
+	struct bio *pending, *background;
+	unsigned int writes_starved;
+	unsigned int background_credit;
+
 	disk_info_t *units[0];
 };
 
 
+/**
+ * struct raidxor_scrub - checks the redundancy apart from the cache
+ * @cache: a cache of a single line, so the scrub never evicts lines of
+ *         the main cache
+ * @expected: recomputed contents of a redundant unit
+ * @done: completed when the transfer of the line finished
+ *
+ * See raidxor_scrub_strip().
+ */
+struct raidxor_scrub {
+	cache_t *cache;
+	struct page **expected;
+	struct completion done;
+};
+
+/* on-disk format of the layout stored on the members, see super.c */
+#define RAIDXOR_SUPER_MAGIC 0x72787362
+#define RAIDXOR_SUPER_VERSION 1
+/* the header, the encodings and the decodings, one page each */
+#define RAIDXOR_SUPER_PAGES 3
+/* space kept at the end of each member for it, in 1K blocks */
+#define RAIDXOR_SUPER_SIZE (RAIDXOR_SUPER_PAGES * (PAGE_SIZE >> 10))
+
+/**
+ * struct raidxor_super - first page of the layout on a member
+ * @crc: crc32 of this structure with @crc set to 0 and the two pages
+ *       following it
+ * @n_units: has to match the array, like @chunk_size
+ * @units_per_member: overrides the parameter of the same name, see
+ *                    raidxor_super_units_per_member()
+ * @generation: incremented on every update, the newest copy is used
+ * @uuid: the array the layout belongs to
+ * @units_per_resource: see the attribute of the same name
+ * @encoding_length: bytes used in the second page, in the format of the
+ *                   encoding attribute
+ * @decoding_length: bytes used in the third page, in the format of the
+ *                   decoding attribute
+ * @log_dev: device number of the log device, 0 without one
+ * @failed: units which weren't readable when the layout was written,
+ *          one bit each; the decodings are only valid for these
+ */
+struct raidxor_super {
+	__le32 magic;
+	__le32 version;
+	__le32 crc;
+	__le32 n_units;
+	__le64 generation;
+	__u8 uuid[16];
+	__le32 chunk_size;
+	__le32 units_per_member;
+	__le32 units_per_resource;
+	__le32 encoding_length;
+	__le32 decoding_length;
+	__le32 log_dev;
+	__u8 failed[RAIDXOR_MAX_UNITS / 8];
+};
+
+/* on-disk format of the log, see log.c */
+#define RAIDXOR_LOG_MAGIC 0x72786c67
+#define RAIDXOR_LOG_VERSION 1
+
+/**
+ * struct raidxor_log_super - first page of the log device
+ * @generation: records of other generations are ignored
+ * @record_pages: pages per record, including its header
+ * @n_slots: number of records the log holds
+ * @crc: crc32 of this structure with @crc set to 0
+ * @tail: oldest record still needed, the replay starts there
+ * @uuid: the array the log belongs to
+ */
+struct raidxor_log_super {
+	__le32 magic;
+	__le32 version;
+	__le32 generation;
+	__le32 record_pages;
+	__le32 n_slots;
+	__le32 crc;
+	__le64 tail;
+	__u8 uuid[16];
+};
+
+#define RAIDXOR_LOG_CANCELLED 1 /* the record was superseded, skip it */
+
+/**
+ * struct raidxor_log_record - header page of a record
+ * @crc: crc32 of the header with @crc set to 0 and the data following
+ *       it, of the header only for cancelled records
+ * @seq: sequence number, the record is in slot @seq % n_slots
+ * @sector: first array sector of the strip
+ */
+struct raidxor_log_record {
+	__le32 magic;
+	__le32 flags;
+	__le32 generation;
+	__le32 crc;
+	__le64 seq;
+	__le64 sector;
+};
+
+/**
+ * struct raidxor_log - a log device holding the contents of dirty lines
+ * @conf: the array
+ * @bdev: the log device
+ * @rw: how records are written, forced to disk if the device allows
+ * @record_pages: pages per record, the header and the data units
+ * @n_slots: number of records the log holds
+ * @generation: generation written into new records
+ * @head: sequence number of the next record
+ * @tail: oldest record the superblock on disk knows to be needed
+ * @failed: a record couldn't be written, lines go to the members
+ *          directly from now on
+ * @checkpointing: the checkpoint work is queued or running
+ * @ios: record writes in sequence order, see raidxor_log_end_line()
+ * @wait: woken up when a line leaves CACHE_LINE_CHECKPOINT
+ * @mutex: serialises checkpoints
+ * @wq: single thread for @checkpoint_work
+ * @checkpoint_work: frees space, see raidxor_log_checkpoint()
+ *
+ * Needs conf->device_lock, except for the fields fixed at attach.
+ */
+struct raidxor_log {
+	raidxor_conf_t *conf;
+	struct block_device *bdev;
+
+	unsigned int record_pages, n_slots;
+	u32 generation;
+	u64 head, tail;
+
+	unsigned int failed, checkpointing;
+
+	struct list_head ios;
+	wait_queue_head_t wait;
+	struct mutex mutex;
+	struct workqueue_struct *wq;
+	struct work_struct checkpoint_work;
+};
+
+/**
+ * struct raidxor_log_io - a record written to the log
+ * @line: the line whose contents are written
+ * @seq: sequence number of the record
+ * @list: entry in raidxor_log->ios
+ * @done: all bios of the record completed
+ * @remaining: bios still in flight, plus one while submitting
+ * @error: the first error of a bio
+ * @syncing: FUA requests ended by the record
+ * @pages: the header page, then the data pages of the line
+ */
+struct raidxor_log_io {
+	raidxor_log_t *log;
+	cache_line_t *line;
+	u64 seq;
+
+	struct list_head list;
+	unsigned int done;
+	atomic_t remaining;
+	int error;
+
+	struct bio *syncing;
+
+	unsigned int n_pages;
+	struct page *pages[0];
+};
+
+/**
+ * struct raidxor_worker - thread handling cache lines
+ * @conf: the array this worker belongs to
+ * @index: number of the worker and of its work queue in the cache
+ * @node: NUMA node the worker runs on, it handles the lines of this node
+ * @thread: kernel thread, NULL for worker 0, which is raidxord itself
+ * @pending: bit 0 is set when a line was queued for this worker
+ * @wait: the thread sleeps here until it's got something to do
+ */
+struct raidxor_worker {
+	raidxor_conf_t *conf;
+	unsigned int index;
+	int node;
+
+	struct task_struct *thread;
+	unsigned long pending;
+	wait_queue_head_t wait;
+};
 
 /**
  * struct raidxor_private_data_s - private data per mddev
@@ -279,6 +639,38 @@ struct raidxor_resource {
  * @waiting_list: requests to be queued into the cache
  * @configured: is 1 if we have all necessary information
  * @units_per_resource: the number of units per resource
+ * @units_per_member: the number of units interleaved on one member device
+ * @discards: discard requests not finished yet, linked by bi_next; the
+ *            first one runs while CONF_DISCARDING is set
+ * @discard_wq: single thread of this array for @discard_work
+ * @discard_work: handles @discards, see raidxor_discard_work()
+ * @scrub_sector: strip checked by the running scrub (CONF_SCRUBBING)
+ * @scrub: private line of the scrub, allocated on first use
+ * @fullsync: a new member was added, the next resync may not skip
+ *            regions the bitmap knows to be in sync
+ * @log: the log device, if one is attached
+ * @rxbio_pool: reserve of transfer descriptors not bound to a line
+ * @flushes: flush requests not handled yet, linked by bi_next
+ * @flush_wq: single thread of this array for @flush_work
+ * @flush_work: handles @flushes on @flush_wq
+ * @flush_remaining: number of lines the running flush waits for
+ * @wait_for_flush: waitqueue for the event above
+ * @n_cache_lines: number of lines of the cache, see cache_lines in sysfs
+ * @quiesced: raidxor_quiesce() nesting depth, blocks new requests if > 0
+ * @n_submitting: number of requests between raidxor_make_request() and
+ *                their cache line
+ * @wait_for_quiesce: waitqueue for both of the above
+ * @derive_wq: single thread of this array for @derive_work and
+ *             @super_work, these block for a long time
+ * @derive_work: derives decodings after a failure, see
+ *               raidxor_derive_decodings()
+ * @super_generation: generation of the layout last written to the members
+ * @super_work: writes the layout to the members, see super.c
+ * @super_reserved: the space behind the units holds the layout; arrays
+ *                  using it for data don't store one
+ * @member_size: size of the smallest member in 1K blocks
+ * @n_workers: number of threads handling cache lines
+ * @workers: the actual workers
  * @n_resources: the number of resources
  * @resources: the actual resources
  * @n_stripes: the number of stripes
@@ -298,7 +690,43 @@ struct raidxor_conf {
 
 	cache_t *cache;
 
+	struct bio *discards;
+	struct workqueue_struct *discard_wq;
+	struct work_struct discard_work;
+
+	sector_t scrub_sector;
+	raidxor_scrub_t *scrub;
+
+	unsigned int fullsync;
+
+	raidxor_log_t *log;
+
+	mempool_t *rxbio_pool;
+
+	struct bio *flushes;
+	struct workqueue_struct *flush_wq;
+	struct work_struct flush_work;
+	unsigned int flush_remaining;
+	wait_queue_head_t wait_for_flush;
+
+	unsigned int n_cache_lines;
+
+	unsigned int quiesced, n_submitting;
+	wait_queue_head_t wait_for_quiesce;
+
+	struct workqueue_struct *derive_wq;
+	struct delayed_work derive_work;
+
+	u64 super_generation;
+	struct delayed_work super_work;
+	unsigned int super_reserved;
+	sector_t member_size;
+
+	unsigned int n_workers;
+	raidxor_worker_t *workers;
+
 	unsigned int units_per_resource;
+	unsigned int units_per_member;
 	unsigned int n_resources;
 	resource_t **resources;
 
@@ -360,6 +788,37 @@ struct raidxor_conf {
 #define CONF_FAULTY 2
 #define CONF_ERROR 4
 #define CONF_STOPPING 8
+#define CONF_DISCARDING 16
+#define CONF_SCRUBBING 5
+#define CONF_DERIVING 6
+
+#define RAIDXOR_WRITES_STARVED 2
+
+#ifdef REQ_SYNC
+#define raidxor_bio_sync(bio) ((bio)->bi_rw & REQ_SYNC)
+#else
+#define raidxor_bio_sync(bio) bio_sync(bio)
+#endif
+
+#ifdef REQ_FLUSH
+#define raidxor_bio_flush(bio) ((bio)->bi_rw & REQ_FLUSH)
+#define raidxor_bio_fua(bio) ((bio)->bi_rw & REQ_FUA)
+#define RAIDXOR_FLUSH_RW WRITE_FLUSH
+#define RAIDXOR_FUA_RW WRITE_FUA
+#else
+/* a barrier flushes all earlier writes and is forced to disk itself */
+#define raidxor_bio_flush(bio) bio_barrier(bio)
+#define raidxor_bio_fua(bio) bio_barrier(bio)
+#define RAIDXOR_FLUSH_RW WRITE_BARRIER
+#define RAIDXOR_FUA_RW WRITE_BARRIER
+#endif
+
+#ifdef BIO_RW_DISCARD
+#define raidxor_bio_discard(bio) bio_discard(bio)
+#define RAIDXOR_DISCARD_RW ((1 << BIO_RW) | (1 << BIO_RW_DISCARD))
+#else
+#define raidxor_bio_discard(bio) 0
+#endif
 
 /**
  * struct raidxor_bio - private information for bio transfers from and to stripes
@@ -368,6 +827,7 @@ struct raidxor_conf {
  * @stripe: the stripe this bio is transfering from or to
  * @sector: the virtual sector address inside that stripe
  * @unit: extra information from raidxor
+ * @master: the request this transfer belongs to, if not for a line
  * @bios: the bios to the individual units
  *
  * If remaining reaches zero, the whole transfer is finished.
@@ -378,10 +838,42 @@ struct raidxor_bio {
 	unsigned int line;
 	unsigned int faulty;
 
+	struct bio *master;
+
 	unsigned int n_bios;
 	struct bio *bios[0];
 };
 
+/**
+ * struct raidxor_flush - flushes of the member caches in flight
+ * @remaining: number of unfinished flushes
+ * @error: first error reported by a member
+ * @done: completed when remaining reaches zero
+ */
+struct raidxor_flush {
+	atomic_t remaining;
+	int error;
+	struct completion done;
+};
+
+/**
+ * struct raidxor_unit_bio - preallocated bio for one unit of a line
+ * @unit: index of the unit the bio transfers to or from
+ * @bio: the bio, reinitialised for every transfer
+ * @vecs: one bio_vec per page of a chunk
+ */
+struct raidxor_unit_bio {
+	unsigned int unit;
+	struct bio bio;
+	struct bio_vec vecs[0];
+};
+
+#define raidxor_bio_unit(bio) \
+	(container_of((bio), raidxor_unit_bio_t, bio)->unit)
+
+/* reserve of descriptors for requests outside of cache lines */
+#define RAIDXOR_MIN_RXBIOS 4
+
 #define CHECK_LEVEL KERN_EMERG
 
 #ifdef RAIDXOR_DEBUG
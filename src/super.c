@@ -0,0 +1,612 @@
+/* -*- mode: c; coding: utf-8; c-file-style: "K&R"; tab-width: 8; indent-tabs-mode: t; -*- */
+
+/*
+   The layout of the array, that is the resources, the encodings with
+   their temporaries and the decodings, is kept on every member, so an
+   assembled array configures itself in raidxor_run() instead of
+   waiting for the sysfs attributes.
+
+   It takes RAIDXOR_SUPER_PAGES pages directly behind the area used for
+   the units: struct raidxor_super, then the encodings and then the
+   decodings, both in the byte format of their attributes, so they're
+   read back by the same parsers.  Every update is written to all
+   members which aren't faulty with a new generation; assembly uses the
+   newest copy which matches the array.
+
+   The decodings are only used if the same units are unreadable as when
+   they were written, otherwise they're derived again.  An attached log
+   device is found again by its device number and replayed before the
+   array serves requests.
+*/
+
+/**
+ * raidxor_super_unit_space() - returns the space used for units
+ * @size: size of the smallest member in 1K blocks
+ * @chunk_size: in bytes
+ * @reserve: keep the layout behind the units
+ *
+ * In 1K blocks per member, each unit on it a multiple of chunk_size.
+ */
+static sector_t raidxor_super_unit_space(sector_t size,
+					 unsigned long chunk_size,
+					 unsigned int units_per_member,
+					 unsigned int reserve)
+{
+	if (reserve)
+		size -= min(size, (sector_t) RAIDXOR_SUPER_SIZE);
+
+	return ((size / units_per_member) & ~(chunk_size / 1024 - 1)) *
+		units_per_member;
+}
+
+/**
+ * raidxor_super_data_size() - returns the space used for units of the
+ *                             array
+ * @reserve: keep the layout behind the units
+ */
+static sector_t raidxor_super_data_size(raidxor_conf_t *conf,
+					unsigned int reserve)
+{
+	return raidxor_super_unit_space(conf->member_size, conf->chunk_size,
+					conf->units_per_member, reserve);
+}
+
+/**
+ * raidxor_super_units_per_member() - returns the units per member of
+ *                                    the array
+ *
+ * Called by raidxor_run() before anything is set up, since the number
+ * of units depends on it.  The value is part of the layout, so an array
+ * keeps it when the units_per_member parameter changes between
+ * assemblies.  Where the layout lies depends on the value as well, so
+ * each possible one is tried on the first member.  Without a layout,
+ * the parameter is returned.
+ */
+static int raidxor_super_units_per_member(mddev_t *mddev)
+{
+	struct raidxor_super *super;
+	struct list_head *tmp;
+	struct page *page;
+	mdk_rdev_t *rdev, *first = NULL;
+	sector_t size = -1, sector;
+	unsigned int n, found = 0;
+
+	rdev_for_each(rdev, tmp, mddev) {
+		if (rdev->raid_disk < 0 || rdev->raid_disk >= mddev->raid_disks)
+			continue;
+
+		size = min(size, rdev->size);
+		if (!first && !test_bit(Faulty, &rdev->flags))
+			first = rdev;
+	}
+
+	if (!first || mddev->raid_disks < 1)
+		return units_per_member;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return units_per_member;
+
+	for (n = 1; !found && n * mddev->raid_disks <= RAIDXOR_MAX_UNITS; ++n) {
+		sector = first->data_offset +
+			raidxor_super_unit_space(size, mddev->chunk_size, n, 1) * 2;
+		if (!sync_page_io(first->bdev, sector, PAGE_SIZE, page, READ))
+			continue;
+
+		/* the rest is checked by raidxor_super_read() */
+		super = kmap(page);
+		found = le32_to_cpu(super->magic) == RAIDXOR_SUPER_MAGIC &&
+			!memcmp(super->uuid, mddev->uuid, sizeof(super->uuid)) &&
+			le32_to_cpu(super->units_per_member) == n &&
+			le32_to_cpu(super->n_units) == n * mddev->raid_disks;
+		kunmap(page);
+	}
+
+	__free_page(page);
+
+	if (!found)
+		return units_per_member;
+
+	if (n - 1 != units_per_member)
+		printk(KERN_INFO "raidxor: %s uses %u units per member as "
+		       "stored in its layout\n", mdname(mddev), n - 1);
+
+	return n - 1;
+}
+
+/**
+ * raidxor_super_sector() - returns the first sector of the layout
+ */
+static sector_t raidxor_super_sector(raidxor_conf_t *conf,
+				     mdk_rdev_t *rdev)
+{
+	return rdev->data_offset + (sector_t) conf->mddev->size * 2;
+}
+
+static u32 raidxor_super_crc(struct raidxor_super *super,
+			     struct page **pages)
+{
+	struct raidxor_super copy = *super;
+	u32 crc;
+
+	copy.crc = 0;
+	crc = crc32_le(~0, (unsigned char *) &copy, sizeof(copy));
+
+	return raidxor_log_crc_pages(crc, &pages[1],
+				     RAIDXOR_SUPER_PAGES - 1);
+}
+
+static unsigned char * raidxor_super_put_pair(unsigned char *p,
+					      unsigned char *end,
+					      unsigned int a, unsigned int b)
+{
+	if (!p || p + 2 > end)
+		return NULL;
+
+	*p++ = a;
+	*p++ = b;
+	return p;
+}
+
+/**
+ * raidxor_super_put_codings() - formats the inputs of an equation
+ * @encoding: 1 if temporaries are encoding ones, 0 for decoding ones
+ *
+ * Returns the end of the formatted inputs, or NULL if they don't fit.
+ */
+static unsigned char * raidxor_super_put_codings(raidxor_conf_t *conf,
+						 unsigned char *p,
+						 unsigned char *end,
+						 unsigned int n_units,
+						 coding_t *units,
+						 unsigned int encoding)
+{
+	unsigned int i, index;
+
+	if (!p || n_units > 255 || p + 1 + 2 * n_units > end)
+		return NULL;
+
+	*p++ = n_units;
+
+	for (i = 0; i < n_units; ++i) {
+		if (!units[i].temporary)
+			index = units[i].disk - conf->units;
+		else if (encoding)
+			index = raidxor_find_enc_temps(conf, units[i].encoding);
+		else
+			index = raidxor_find_dec_temps(conf, units[i].decoding);
+
+		*p++ = units[i].temporary;
+		*p++ = index;
+	}
+
+	return p;
+}
+
+/**
+ * raidxor_super_format_encoding() - formats the encodings for storing
+ *
+ * Temporaries come first, they're referenced by the units.  Returns the
+ * number of bytes used, or a negative error code.
+ */
+static int raidxor_super_format_encoding(raidxor_conf_t *conf,
+					 unsigned char *data)
+{
+	unsigned char *p = data, *end = data + PAGE_SIZE - 1;
+	encoding_t *encoding;
+	unsigned int i;
+
+	if (conf->n_enc_temps > 255)
+		return -ENOSPC;
+
+	*p++ = conf->n_enc_temps;
+
+	for (i = 0; i < conf->n_enc_temps; ++i) {
+		if (!(encoding = conf->enc_temps[i]))
+			continue;
+
+		p = raidxor_super_put_pair(p, end, i, 2);
+		p = raidxor_super_put_codings(conf, p, end, encoding->n_units,
+					      encoding->units, 1);
+	}
+
+	for (i = 0; i < conf->n_units; ++i) {
+		if (!conf->units[i].redundant) {
+			p = raidxor_super_put_pair(p, end, i, 0);
+			continue;
+		}
+
+		if (!(encoding = conf->units[i].encoding))
+			return -EINVAL;
+
+		p = raidxor_super_put_pair(p, end, i, 1);
+		p = raidxor_super_put_codings(conf, p, end, encoding->n_units,
+					      encoding->units, 1);
+	}
+
+	return p ? p - data : -ENOSPC;
+}
+
+/**
+ * raidxor_super_format_decoding() - formats the decodings for storing
+ *
+ * Like raidxor_super_format_encoding(), for the decodings.
+ */
+static int raidxor_super_format_decoding(raidxor_conf_t *conf,
+					 unsigned char *data)
+{
+	unsigned char *p = data, *end = data + PAGE_SIZE - 1;
+	decoding_t *decoding;
+	unsigned int i;
+
+	if (conf->n_dec_temps > 255)
+		return -ENOSPC;
+
+	*p++ = conf->n_dec_temps;
+
+	for (i = 0; i < conf->n_dec_temps; ++i) {
+		if (!(decoding = conf->dec_temps[i]))
+			continue;
+
+		p = raidxor_super_put_pair(p, end, i, 1);
+		p = raidxor_super_put_codings(conf, p, end, decoding->n_units,
+					      decoding->units, 0);
+	}
+
+	for (i = 0; i < conf->n_units; ++i) {
+		if (!(decoding = conf->units[i].decoding))
+			continue;
+
+		p = raidxor_super_put_pair(p, end, i, 0);
+		p = raidxor_super_put_codings(conf, p, end, decoding->n_units,
+					      decoding->units, 0);
+	}
+
+	return p ? p - data : -ENOSPC;
+}
+
+static void raidxor_super_free_pages(struct page **pages)
+{
+	unsigned int i;
+
+	for (i = 0; i < RAIDXOR_SUPER_PAGES; ++i)
+		if (pages[i])
+			__free_page(pages[i]);
+}
+
+static int raidxor_super_alloc_pages(struct page **pages, gfp_t gfp)
+{
+	unsigned int i;
+
+	for (i = 0; i < RAIDXOR_SUPER_PAGES; ++i)
+		pages[i] = NULL;
+
+	for (i = 0; i < RAIDXOR_SUPER_PAGES; ++i)
+		if (!(pages[i] = alloc_page(gfp))) {
+			raidxor_super_free_pages(pages);
+			return -ENOMEM;
+		}
+
+	return 0;
+}
+
+/**
+ * raidxor_super_write() - writes the current layout to the members
+ *
+ * Needs to be called with the md reconfiguration mutex held, so
+ * neither the equations nor the members change meanwhile.  Returns 0
+ * if at least one member got it, else a negative error code.
+ */
+static int raidxor_super_write(raidxor_conf_t *conf)
+{
+	mddev_t *mddev = conf->mddev;
+	struct page *pages[RAIDXOR_SUPER_PAGES];
+	struct raidxor_super *super;
+	mdk_rdev_t *rdev;
+	unsigned int i, j, n_members, written = 0;
+	unsigned long flags = 0;
+	int encoding_length, decoding_length;
+	char buffer[BDEVNAME_SIZE];
+
+	/* the space behind the units may hold data of an older array */
+	if (test_bit(CONF_INCOMPLETE, &conf->flags) || !conf->super_reserved)
+		return 0;
+
+	if (raidxor_super_alloc_pages(pages, GFP_NOIO))
+		return -ENOMEM;
+
+	for (i = 0; i < RAIDXOR_SUPER_PAGES; ++i) {
+		memset(kmap(pages[i]), 0, PAGE_SIZE);
+		kunmap(pages[i]);
+	}
+
+	encoding_length = raidxor_super_format_encoding(conf,
+							kmap(pages[1]));
+	kunmap(pages[1]);
+	decoding_length = raidxor_super_format_decoding(conf,
+							kmap(pages[2]));
+	kunmap(pages[2]);
+
+	if (encoding_length < 0 || decoding_length < 0) {
+		printk(KERN_WARNING "raidxor: layout of %s can't be stored on "
+		       "its members\n", mdname(mddev));
+		raidxor_super_free_pages(pages);
+		return -ENOSPC;
+	}
+
+	super = kmap(pages[0]);
+	super->magic = cpu_to_le32(RAIDXOR_SUPER_MAGIC);
+	super->version = cpu_to_le32(RAIDXOR_SUPER_VERSION);
+	super->n_units = cpu_to_le32(conf->n_units);
+	super->generation = cpu_to_le64(++conf->super_generation);
+	memcpy(super->uuid, mddev->uuid, sizeof(super->uuid));
+	super->chunk_size = cpu_to_le32(conf->chunk_size);
+	super->units_per_member = cpu_to_le32(conf->units_per_member);
+	super->units_per_resource = cpu_to_le32(conf->units_per_resource);
+	super->encoding_length = cpu_to_le32(encoding_length);
+	super->decoding_length = cpu_to_le32(decoding_length);
+	if (conf->log)
+		super->log_dev =
+			cpu_to_le32(new_encode_dev(conf->log->bdev->bd_dev));
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < conf->n_units; ++i)
+		if (!raidxor_unit_readable(&conf->units[i]))
+			super->failed[i / 8] |= 1 << (i % 8);
+	});
+
+	super->crc = cpu_to_le32(raidxor_super_crc(super, pages));
+	kunmap(pages[0]);
+
+	n_members = conf->n_units / conf->units_per_member;
+
+	/* members change only under the reconfiguration mutex */
+	for (i = 0; i < n_members; ++i) {
+		rdev = conf->units[i].rdev;
+		if (!rdev || test_bit(Faulty, &rdev->flags))
+			continue;
+
+		for (j = 0; j < RAIDXOR_SUPER_PAGES; ++j)
+			if (!sync_page_io(rdev->bdev,
+					  raidxor_super_sector(conf, rdev) +
+					  j * (PAGE_SIZE >> 9), PAGE_SIZE,
+					  pages[j], WRITE))
+				break;
+
+		if (j < RAIDXOR_SUPER_PAGES)
+			printk(KERN_WARNING "raidxor: couldn't write the "
+			       "layout to %s\n", bdevname(rdev->bdev, buffer));
+		else
+			++written;
+	}
+
+	raidxor_super_free_pages(pages);
+	return written ? 0 : -EIO;
+}
+
+/**
+ * raidxor_super_read() - reads and checks the layout on a member
+ *
+ * Returns 0 if @pages hold a layout of this array, else 1.
+ */
+static int raidxor_super_read(raidxor_conf_t *conf, mdk_rdev_t *rdev,
+			      struct page **pages)
+{
+	mddev_t *mddev = conf->mddev;
+	struct raidxor_super *super;
+	unsigned int i;
+	int result = 1;
+	char buffer[BDEVNAME_SIZE];
+
+	for (i = 0; i < RAIDXOR_SUPER_PAGES; ++i)
+		if (!sync_page_io(rdev->bdev,
+				  raidxor_super_sector(conf, rdev) +
+				  i * (PAGE_SIZE >> 9), PAGE_SIZE,
+				  pages[i], READ))
+			return 1;
+
+	super = kmap(pages[0]);
+	if (le32_to_cpu(super->magic) != RAIDXOR_SUPER_MAGIC ||
+	    memcmp(super->uuid, mddev->uuid, sizeof(super->uuid)))
+		goto out;
+
+	if (le32_to_cpu(super->version) != RAIDXOR_SUPER_VERSION) {
+		printk(KERN_WARNING "raidxor: layout on %s has unknown "
+		       "version %u\n", bdevname(rdev->bdev, buffer),
+		       le32_to_cpu(super->version));
+		goto out;
+	}
+
+	if (le32_to_cpu(super->crc) != raidxor_super_crc(super, pages)) {
+		printk(KERN_WARNING "raidxor: layout on %s is corrupt\n",
+		       bdevname(rdev->bdev, buffer));
+		goto out;
+	}
+
+	if (le32_to_cpu(super->n_units) != conf->n_units ||
+	    le32_to_cpu(super->chunk_size) != conf->chunk_size ||
+	    le32_to_cpu(super->units_per_member) != conf->units_per_member ||
+	    le32_to_cpu(super->encoding_length) < 1 ||
+	    le32_to_cpu(super->encoding_length) >= PAGE_SIZE ||
+	    le32_to_cpu(super->decoding_length) < 1 ||
+	    le32_to_cpu(super->decoding_length) >= PAGE_SIZE) {
+		printk(KERN_WARNING "raidxor: layout on %s doesn't match "
+		       "the array\n", bdevname(rdev->bdev, buffer));
+		goto out;
+	}
+
+	result = 0;
+out:
+	kunmap(pages[0]);
+	return result;
+}
+
+/**
+ * raidxor_super_load() - configures the array from its members
+ *
+ * Called at the end of raidxor_run(), with the md reconfiguration
+ * mutex held.  Without a stored layout, the space behind the units is
+ * only used for one if that doesn't shrink the array, otherwise the
+ * store_layout attribute enables it for a new array.  Returns 0 if the
+ * array is configured, 1 if no member holds a layout, so it has to be
+ * supplied through sysfs, or a negative error code.  The array is
+ * configured even if the log named in the layout can't be reattached,
+ * raidxor_run() fails then unless start_without_log is set.
+ */
+static int raidxor_super_load(raidxor_conf_t *conf)
+{
+	mddev_t *mddev = conf->mddev;
+	struct page *pages[RAIDXOR_SUPER_PAGES], *best[RAIDXOR_SUPER_PAGES];
+	struct page *swap;
+	struct raidxor_super *super;
+	mdk_rdev_t *rdev;
+	unsigned int i, j, n_members, found = 0, same = 1;
+	size_t encoding_length, decoding_length;
+	unsigned long flags = 0;
+	u64 generation;
+	u32 log_dev;
+	int result = -ENOMEM, err;
+
+	if (raidxor_super_alloc_pages(pages, GFP_KERNEL))
+		return -ENOMEM;
+	if (raidxor_super_alloc_pages(best, GFP_KERNEL))
+		goto out_free;
+
+	n_members = conf->n_units / conf->units_per_member;
+
+	/* the layout is looked for where it would be with space reserved */
+	mddev->size = raidxor_super_data_size(conf, 1);
+
+	for (i = 0; i < n_members; ++i) {
+		rdev = conf->units[i].rdev;
+		if (!rdev || test_bit(Faulty, &rdev->flags) ||
+		    raidxor_super_read(conf, rdev, pages))
+			continue;
+
+		super = kmap(pages[0]);
+		generation = le64_to_cpu(super->generation);
+		kunmap(pages[0]);
+
+		if (found && generation <= conf->super_generation)
+			continue;
+
+		found = 1;
+		conf->super_generation = generation;
+		for (j = 0; j < RAIDXOR_SUPER_PAGES; ++j) {
+			swap = best[j];
+			best[j] = pages[j];
+			pages[j] = swap;
+		}
+	}
+
+	result = 1;
+	if (!found) {
+		mddev->size = raidxor_super_data_size(conf, 0);
+		conf->super_reserved =
+			mddev->size == raidxor_super_data_size(conf, 1);
+		goto out_free_best;
+	}
+
+	conf->super_reserved = 1;
+
+	super = kmap(best[0]);
+	conf->units_per_resource = le32_to_cpu(super->units_per_resource);
+	encoding_length = le32_to_cpu(super->encoding_length);
+	decoding_length = le32_to_cpu(super->decoding_length);
+	log_dev = le32_to_cpu(super->log_dev);
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < conf->n_units; ++i)
+		if (!raidxor_unit_readable(&conf->units[i]) !=
+		    !!(super->failed[i / 8] & (1 << (i % 8))))
+			same = 0;
+	});
+	kunmap(best[0]);
+
+	result = raidxor_parse_encoding(mddev, kmap(best[1]), encoding_length);
+	kunmap(best[1]);
+	if (result < 0)
+		goto out_free_best;
+
+	if (same) {
+		if (raidxor_parse_decoding(mddev, kmap(best[2]),
+					   decoding_length) < 0)
+			printk(KERN_WARNING "raidxor: stored decodings of %s "
+			       "are unusable\n", mdname(mddev));
+		kunmap(best[2]);
+	}
+
+	raidxor_try_configure_raid(conf);
+
+	if (test_bit(CONF_INCOMPLETE, &conf->flags)) {
+		result = -EINVAL;
+		goto out_free_best;
+	}
+
+	printk(KERN_INFO "raidxor: %s configured from the layout on its "
+	       "members, generation %llu\n", mdname(mddev),
+	       (unsigned long long) conf->super_generation);
+
+	/* nothing was served yet, so the records are the newest data;
+	   without them, the members may hold outdated strips */
+	if (log_dev && (err = raidxor_log_attach_dev(conf, log_dev))) {
+		printk(KERN_CRIT "raidxor: couldn't reattach the log of %s "
+		       "(%d)\n", mdname(mddev), err);
+		if (!start_without_log) {
+			result = err;
+			goto out_free_best;
+		}
+		printk(KERN_CRIT "raidxor: starting %s anyway, the records "
+		       "of its log are lost\n", mdname(mddev));
+	}
+	result = 0;
+out_free_best:
+	raidxor_super_free_pages(best);
+out_free:
+	raidxor_super_free_pages(pages);
+	return result;
+}
+
+/**
+ * raidxor_super_work() - writes the layout after a change
+ *
+ * Scheduled by raidxor_super_schedule(), runs under the md
+ * reconfiguration mutex like raidxor_derive_work().
+ */
+static void raidxor_super_work(struct work_struct *work)
+{
+	raidxor_conf_t *conf = container_of(work, raidxor_conf_t,
+					    super_work.work);
+	mddev_t *mddev = conf->mddev;
+
+	if (!mutex_trylock(&mddev->reconfig_mutex)) {
+		queue_delayed_work(conf->derive_wq, &conf->super_work,
+				   HZ / 10);
+		return;
+	}
+
+	raidxor_super_write(conf);
+
+	mutex_unlock(&mddev->reconfig_mutex);
+}
+
+/**
+ * raidxor_super_schedule() - writes the layout in the background
+ *
+ * Changes arriving in quick succession, e.g. equations uploaded one by
+ * one, are written once.  Can be called from any context.  Needs to be
+ * called with conf->device_lock held, so it doesn't race with
+ * raidxor_stop().
+ */
+static void raidxor_super_schedule(raidxor_conf_t *conf)
+{
+	if (!test_bit(CONF_STOPPING, &conf->flags))
+		queue_delayed_work(conf->derive_wq, &conf->super_work,
+				   HZ / 10);
+}
+
+#if 0
+Local variables:
+c-basic-offset: 8
+End:
+#endif
@@ -38,6 +38,8 @@ static const char * raidxor_cache_line_status(cache_line_t *line)
 		return "CACHE_LINE_FAULTY";
 	case CACHE_LINE_RECOVERY:
 		return "CACHE_LINE_RECOVERY";
+	case CACHE_LINE_LOGGING:
+		return "CACHE_LINE_LOGGING";
 	}
 
 	return "UNKNOWN!";
@@ -60,13 +62,18 @@ static void raidxor_cache_print_status(cache_t *cache)
 }
 
 /**
- * raidxor_cache_add_request() - adds request at back
+ * raidxor_cache_add_request() - adds request to a line
+ *
+ * Pushes the request at the head, so producers never walk the queue.
+ * The queue is kept in reverse order (newest first),
+ * raidxor_cache_take_requests() restores FIFO order.
+ *
+ * Needs to be called with conf->device_lock held.
  */
 static void raidxor_cache_add_request(cache_t *cache, unsigned int n_line,
 				      struct bio *bio)
 {
 	cache_line_t *line;
-	struct bio *previous;
 	CHECK_ARG_RET(cache);
 	CHECK_ARG_RET(bio);
 	CHECK_PLAIN_RET(n_line < cache->n_lines);
@@ -74,24 +81,22 @@ static void raidxor_cache_add_request(cache_t *cache, unsigned int n_line,
 	line = cache->lines[n_line];
 	CHECK_PLAIN_RET(line);
 
-	previous = line->waiting;
-	if (!previous) line->waiting = bio;
-	else {
-		while (previous->bi_next) {
-			previous = previous->bi_next;
-		}
-
-		previous->bi_next = bio;
-	}
+	bio->bi_next = line->waiting;
+	line->waiting = bio;
 }
 
 /**
- * raidxor_cache_remove_request() - pops request from front
+ * raidxor_cache_take_requests() - takes all waiting requests of a line
+ *
+ * Returns the requests in the order they were added, chained through
+ * bi_next.
+ *
+ * Needs to be called with conf->device_lock held.
  */
-static struct bio * raidxor_cache_remove_request(cache_t *cache,
-						 unsigned int n_line)
+static struct bio * raidxor_cache_take_requests(cache_t *cache,
+						unsigned int n_line)
 {
-	struct bio *result;
+	struct bio *bio, *next, *result = NULL;
 	cache_line_t *line;
 	CHECK_ARG_RET_NULL(cache);
 	CHECK_PLAIN_RET_NULL(n_line < cache->n_lines);
@@ -99,12 +104,524 @@ static struct bio * raidxor_cache_remove_request(cache_t *cache,
 	line = cache->lines[n_line];
 	CHECK_PLAIN_RET_NULL(line);
 
-	result = line->waiting;
-	if (result) line->waiting = result->bi_next;
+	bio = line->waiting;
+	line->waiting = NULL;
+
+	/* reverse into FIFO order */
+	while (bio) {
+		next = bio->bi_next;
+		bio->bi_next = result;
+		result = bio;
+		bio = next;
+	}
 
 	return result;
 }
 
+/**
+ * raidxor_cache_line_has_wanted() - checks if a line can serve its requests
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_line_has_wanted(cache_line_t *line)
+{
+	return bitmap_subset(line->want, line->valid,
+			     line->cache->conf->n_units);
+}
+
+/**
+ * raidxor_cache_bio_overwrites() - collects the units a write replaces
+ * @bio: the write, with bi_sector relative to the line
+ * @units: the data units whose chunk the write covers completely are
+ *         added to this bitmap
+ */
+static void raidxor_cache_bio_overwrites(cache_t *cache, struct bio *bio,
+					 unsigned long *units)
+{
+	raidxor_conf_t *conf = cache->conf;
+	sector_t first, end;
+	unsigned int i;
+
+	/* first = ceil(start / chunk), end = floor(end / chunk) */
+	first = bio->bi_sector + (conf->chunk_size >> 9) - 1;
+	do_div(first, conf->chunk_size >> 9);
+	end = bio->bi_sector + (bio->bi_size >> 9);
+	do_div(end, conf->chunk_size >> 9);
+
+	for (i = 0; i < conf->n_units; ++i)
+		if (!conf->units[i].redundant &&
+		    conf->units[i].buffer >= first &&
+		    conf->units[i].buffer < end)
+			__set_bit(i, units);
+}
+
+/**
+ * raidxor_cache_bio_units() - collects the units a request needs
+ * @bio: the request, with bi_sector relative to the line, or NULL for
+ *       the whole line
+ * @units: the units are added to this bitmap
+ *
+ * Reads only need the data units they touch.  Writes need all of them,
+ * since the redundant units are computed from the whole strip on
+ * writeback, except the ones they overwrite completely.  Those aren't
+ * read, or decoded if their unit failed, see raidxor_handle_requests().
+ */
+static void raidxor_cache_bio_units(cache_t *cache, struct bio *bio,
+				    unsigned long *units)
+{
+	raidxor_conf_t *conf = cache->conf;
+	sector_t first = 0, last = conf->n_data_units - 1;
+	unsigned int i;
+	DECLARE_BITMAP(overwrites, RAIDXOR_MAX_UNITS);
+
+	bitmap_zero(overwrites, conf->n_units);
+
+	if (bio && bio_data_dir(bio) == READ) {
+		first = bio->bi_sector;
+		do_div(first, conf->chunk_size >> 9);
+		last = bio->bi_sector + (bio->bi_size >> 9) - 1;
+		do_div(last, conf->chunk_size >> 9);
+	}
+	else if (bio)
+		raidxor_cache_bio_overwrites(cache, bio, overwrites);
+
+	/* data buffers are in unit order, see raidxor_try_configure_raid() */
+	for (i = 0; i < conf->n_units; ++i)
+		if (!conf->units[i].redundant &&
+		    conf->units[i].buffer >= first &&
+		    conf->units[i].buffer <= last &&
+		    !test_bit(i, overwrites))
+			__set_bit(i, units);
+}
+
+/**
+ * raidxor_cache_want_bio() - marks the units a request needs in its line
+ * @bio: see raidxor_cache_bio_units()
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_want_bio(cache_t *cache, unsigned int n_line,
+				   struct bio *bio)
+{
+	raidxor_cache_bio_units(cache, bio, cache->lines[n_line]->want);
+}
+
+/**
+ * raidxor_cache_line_work() - returns what raidxord has to do with a line
+ *
+ * Returns one of the CACHE_WORK_* values or -1 if there's nothing to do
+ * until the line changes state again.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static int raidxor_cache_line_work(cache_line_t *line)
+{
+	/* if nobody wants something from this line, do nothing,
+	   unless it has to be persisted for a flush or FUA request,
+	   or a checkpoint of the log waits for it */
+	if (!line->waiting) {
+		if (line->status == CACHE_LINE_DIRTY &&
+		    (test_bit(CACHE_LINE_FLUSH, &line->flags) ||
+		     test_bit(CACHE_LINE_SYNC, &line->flags) ||
+		     test_bit(CACHE_LINE_CHECKPOINT, &line->flags)))
+			return CACHE_WORK_WRITEBACK;
+
+		/* decoded units go to the spare as soon as it's there */
+		if ((line->status == CACHE_LINE_DIRTY ||
+		     line->status == CACHE_LINE_UPTODATE) &&
+		    test_bit(CACHE_LINE_SPARE, &line->flags))
+			return CACHE_WORK_WRITEBACK;
+
+		/* a resync loads (or recovers) the whole line and writes
+		   it back to every unit */
+		if (test_bit(CACHE_LINE_RESYNC, &line->flags)) {
+			switch (line->status) {
+			case CACHE_LINE_LOAD_ME:
+				return CACHE_WORK_LOAD;
+			case CACHE_LINE_FAULTY:
+				return CACHE_WORK_RECOVER;
+			case CACHE_LINE_UPTODATE:
+				if (!raidxor_cache_line_has_wanted(line))
+					return CACHE_WORK_LOAD;
+			case CACHE_LINE_DIRTY:
+				return CACHE_WORK_WRITEBACK;
+			}
+		}
+		return -1;
+	}
+
+	switch (line->status) {
+	case CACHE_LINE_LOAD_ME:
+		return CACHE_WORK_LOAD;
+	case CACHE_LINE_FAULTY:
+		return CACHE_WORK_RECOVER;
+	case CACHE_LINE_UPTODATE:
+		/* partially loaded, the new requests need more */
+		if (!raidxor_cache_line_has_wanted(line))
+			return CACHE_WORK_LOAD;
+	case CACHE_LINE_DIRTY:
+		return CACHE_WORK_SERVE;
+	}
+
+	return -1;
+}
+
+/**
+ * raidxor_cache_line_queue() - chooses the worker for a line
+ *
+ * Prefers a worker on the node of the line, so copies and XOR stay
+ * node-local.  Lines are spread over the workers of a node by index.
+ * Without one, the worker belonging to the current CPU is used.
+ */
+static unsigned int raidxor_cache_line_queue(cache_t *cache,
+					     cache_line_t *line)
+{
+	raidxor_worker_t *workers = cache->conf->workers;
+	unsigned int i, queue;
+
+	for (i = 0; i < cache->n_queues; ++i) {
+		queue = (line->index + i) % cache->n_queues;
+		if (workers[queue].node == line->node)
+			return queue;
+	}
+
+	return raw_smp_processor_id() % cache->n_queues;
+}
+
+/**
+ * raidxor_cache_line_has_deadline() - checks for requests with a deadline
+ *
+ * After its requests were served, a line's deadline is outdated, its
+ * remaining work isn't due anymore.
+ */
+static unsigned int raidxor_cache_line_has_deadline(cache_line_t *line)
+{
+	return line->waiting || line->syncing;
+}
+
+/**
+ * raidxor_cache_line_due_before() - compares the deadlines of two lines
+ *
+ * Lines without a deadline come last.  Returns 1 if line @a is due
+ * before line @b.
+ */
+static unsigned int raidxor_cache_line_due_before(cache_line_t *a,
+						  cache_line_t *b)
+{
+	unsigned int has_a = raidxor_cache_line_has_deadline(a);
+	unsigned int has_b = raidxor_cache_line_has_deadline(b);
+
+	if (has_a != has_b)
+		return has_a;
+
+	return has_a && time_before(a->deadline, b->deadline);
+}
+
+/**
+ * raidxor_cache_queue_line() - puts a line on the matching work list
+ *
+ * Has to be called after every state change that may give the workers
+ * something to do with the line, including new requests, which may
+ * change its urgency and deadline; a queued line is moved then.  The
+ * line goes to the queue of a worker, see raidxor_cache_line_queue(),
+ * and is inserted by deadline, so the head of each list is the line to
+ * handle next.  Returns 1 if the line was queued, so the caller knows
+ * to wake up the workers.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_queue_line(cache_t *cache,
+					     unsigned int n_line)
+{
+	cache_line_t *line, *other;
+	struct list_head *list;
+	unsigned int queue;
+	int work;
+
+	CHECK_ARG_RET_VAL(cache);
+	CHECK_PLAIN_RET_VAL(n_line < cache->n_lines);
+
+	line = cache->lines[n_line];
+
+	/* the owner queues it again when it's done */
+	if (test_bit(CACHE_LINE_BUSY, &line->flags)) {
+		set_bit(CACHE_LINE_REQUEUE, &line->flags);
+		return 1;
+	}
+
+	list_del_init(&line->work);
+
+	work = raidxor_cache_line_work(line);
+	if (work < 0)
+		return 0;
+
+	if (!test_bit(CACHE_LINE_URGENT, &line->flags))
+		work += CACHE_WORK_MAX;
+
+	queue = raidxor_cache_line_queue(cache, line);
+	list = &cache->work[queue * CACHE_WORK_LISTS + work];
+
+	/* new deadlines are mostly the latest, search from the tail */
+	list_for_each_entry_reverse(other, list, work)
+		if (!raidxor_cache_line_due_before(line, other))
+			break;
+
+	list_add(&line->work, &other->work);
+	set_bit(0, &cache->conf->workers[queue].pending);
+	return 1;
+}
+
+/**
+ * raidxor_cache_stamp_line() - accounts the deadline of a new request
+ *
+ * Reads expire after read_expire, writes after write_expire
+ * milliseconds.  Reads and synchronous writes make the line urgent.
+ *
+ * Needs to be called with conf->device_lock held, before the request is
+ * added to the line.
+ */
+static void raidxor_cache_stamp_line(cache_line_t *line, struct bio *bio)
+{
+	unsigned long deadline = jiffies;
+
+	if (bio_data_dir(bio) == READ)
+		deadline += msecs_to_jiffies(read_expire);
+	else deadline += msecs_to_jiffies(write_expire);
+
+	if (bio_data_dir(bio) == READ || raidxor_bio_sync(bio) ||
+	    raidxor_bio_fua(bio))
+		set_bit(CACHE_LINE_URGENT, &line->flags);
+
+	if (!raidxor_cache_line_has_deadline(line) ||
+	    time_before(deadline, line->deadline))
+		line->deadline = deadline;
+}
+
+/**
+ * raidxor_cache_line_before() - compares two queued lines
+ *
+ * Lines with expired requests go first, then lines with urgent
+ * requests, then the kinds of work in list order, and finally the
+ * earliest deadline.  Returns 1 if line @a is to be handled first.
+ */
+static unsigned int raidxor_cache_line_before(cache_line_t *a,
+					      unsigned int kind_a,
+					      cache_line_t *b,
+					      unsigned int kind_b)
+{
+	unsigned int expired_a = raidxor_cache_line_has_deadline(a) &&
+		time_after_eq(jiffies, a->deadline);
+	unsigned int expired_b = raidxor_cache_line_has_deadline(b) &&
+		time_after_eq(jiffies, b->deadline);
+	unsigned int urgent_a = test_bit(CACHE_LINE_URGENT, &a->flags);
+	unsigned int urgent_b = test_bit(CACHE_LINE_URGENT, &b->flags);
+
+	if (expired_a != expired_b)
+		return expired_a;
+
+	if (!expired_a) {
+		if (urgent_a != urgent_b)
+			return urgent_a;
+
+		if (kind_a != kind_b)
+			return kind_a < kind_b;
+	}
+
+	return raidxor_cache_line_due_before(a, b);
+}
+
+/**
+ * raidxor_cache_next_line() - takes the next line to handle
+ * @queue: queue of the calling worker
+ *
+ * Looks at the own queue first, then steals from the others.  The lists
+ * are sorted, so only their heads are compared, the order between them
+ * is given by raidxor_cache_line_before().  Returns 1 and sets @n_line
+ * if a line was found, which is then BUSY until it's released with
+ * raidxor_cache_release_line().
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_next_line(cache_t *cache,
+					    unsigned int queue,
+					    unsigned int *n_line)
+{
+	cache_line_t *line, *best = NULL;
+	struct list_head *work;
+	unsigned int i, j, kind = 0;
+
+	for (j = 0; j < cache->n_queues && !best; ++j) {
+		work = &cache->work[((queue + j) % cache->n_queues) *
+				    CACHE_WORK_LISTS];
+
+		for (i = 0; i < CACHE_WORK_LISTS; ++i) {
+			if (list_empty(&work[i]))
+				continue;
+
+			line = list_first_entry(&work[i], cache_line_t, work);
+			if (!best ||
+			    raidxor_cache_line_before(line, i % CACHE_WORK_MAX,
+						      best, kind)) {
+				best = line;
+				kind = i % CACHE_WORK_MAX;
+			}
+		}
+	}
+
+	if (!best)
+		return 0;
+
+	list_del_init(&best->work);
+
+	set_bit(CACHE_LINE_BUSY, &best->flags);
+	clear_bit(CACHE_LINE_REQUEUE, &best->flags);
+
+	*n_line = best->index;
+	return 1;
+}
+
+/**
+ * raidxor_cache_release_line() - gives up ownership of a line
+ * @requeue: if set, the line is queued again if it's got more work
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_release_line(cache_t *cache, unsigned int n_line,
+				       unsigned int requeue)
+{
+	cache_line_t *line;
+
+	CHECK_ARG_RET(cache);
+	CHECK_PLAIN_RET(n_line < cache->n_lines);
+
+	line = cache->lines[n_line];
+
+	clear_bit(CACHE_LINE_BUSY, &line->flags);
+
+	if (test_and_clear_bit(CACHE_LINE_REQUEUE, &line->flags) || requeue)
+		raidxor_cache_queue_line(cache, n_line);
+
+	/* a replay of the log may wait for the line */
+	if (waitqueue_active(&cache->wait_for_line))
+		wake_up(&cache->wait_for_line);
+
+	raidxor_wake_quiesce(cache->conf);
+}
+
+/**
+ * raidxor_cache_end_resync() - reports the resync of a line to md
+ * @ok: 0 if the line couldn't be resynced, which aborts the resync
+ *
+ * Does nothing if the line isn't part of a running resync.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_end_resync(cache_t *cache, unsigned int n_line,
+				     int ok)
+{
+	cache_line_t *line;
+	sector_t sectors;
+
+	CHECK_ARG_RET(cache);
+	CHECK_PLAIN_RET(n_line < cache->n_lines);
+
+	line = cache->lines[n_line];
+
+	if (!test_and_clear_bit(CACHE_LINE_RESYNC, &line->flags))
+		return;
+
+	sectors = line->sync_sectors;
+	line->sync_sectors = 0;
+
+	md_done_sync(cache->conf->mddev, sectors, ok);
+}
+
+/**
+ * raidxor_member_sector() - returns the member sector of a strip
+ * @sector: first array sector of the strip
+ *
+ * This is the offset md's resync and write-intent bitmap use.
+ */
+static sector_t raidxor_member_sector(raidxor_conf_t *conf, sector_t sector)
+{
+	sector_t strip = sector;
+
+	do_div(strip, (conf->chunk_size >> 9) * conf->n_data_units);
+
+	return strip * (conf->chunk_size >> 9) * conf->units_per_member;
+}
+
+/**
+ * raidxor_cache_line_end_write() - releases the array's active state
+ *
+ * Every write request marks the array active with md_write_start().
+ * The first one copied into a line hands this over to the line, which
+ * keeps it until its data is on disk; md only marks the array clean
+ * again after all dirty lines were written back.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_line_end_write(cache_t *cache, cache_line_t *line)
+{
+	if (test_and_clear_bit(CACHE_LINE_ACTIVE, &line->flags))
+		md_write_end(cache->conf->mddev);
+}
+
+/**
+ * raidxor_cache_line_persisted() - accounts a finished writeback
+ *
+ * Releases a running flush from waiting on this line and returns the
+ * FUA requests that were waiting for the writeback.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_cache_line_persisted(cache_t *cache,
+						 cache_line_t *line)
+{
+	struct bio *result;
+	raidxor_conf_t *conf;
+
+	CHECK_ARG_RET_NULL(cache);
+	CHECK_ARG_RET_NULL(line);
+
+	conf = cache->conf;
+
+	if (test_and_clear_bit(CACHE_LINE_FLUSH, &line->flags) &&
+	    (--conf->flush_remaining) == 0)
+		wake_up(&conf->wait_for_flush);
+
+	clear_bit(CACHE_LINE_SYNC, &line->flags);
+	result = line->syncing;
+	line->syncing = NULL;
+
+	return result;
+}
+
+/**
+ * raidxor_cache_line_unpersisted() - accounts a writeback that can't be
+ *                                    done
+ *
+ * The line keeps its contents, but a running flush, checkpoint or
+ * resync doesn't wait for it anymore.  Returns the FUA requests that
+ * were waiting for the writeback, they have to be failed.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_cache_line_unpersisted(cache_t *cache,
+						   unsigned int n_line)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+
+	if (test_and_clear_bit(CACHE_LINE_CHECKPOINT, &line->flags) &&
+	    conf->log)
+		wake_up(&conf->log->wait);
+
+	raidxor_cache_end_resync(cache, n_line, 0);
+
+	return raidxor_cache_line_persisted(cache, line);
+}
+
 static unsigned int raidxor_cache_line_length_requests(cache_t *, unsigned int) __attribute__((unused));
 static unsigned int raidxor_cache_line_length_requests(cache_t *cache,
 						       unsigned int n_line)
@@ -121,22 +638,164 @@ static unsigned int raidxor_cache_line_length_requests(cache_t *cache,
 }
 
 /**
- * raidxor_find_bio() - searches for the corresponding bio for a single unit
+ * raidxor_unit_faulty() - checks whether a unit can't be accessed at all
  *
- * Returns NULL if not found.
+ * Units without a device were removed from the array, after a failure.
  */
-static struct bio * raidxor_find_bio(raidxor_bio_t *rxbio, disk_info_t *unit)
+static unsigned int raidxor_unit_faulty(disk_info_t *unit)
+{
+	return !unit->rdev || test_bit(Faulty, &unit->rdev->flags);
+}
+
+/**
+ * raidxor_unit_readable() - checks whether a unit holds valid data
+ *
+ * A replaced unit is written to, but until the rebuild is finished its
+ * contents have to be recovered from the other units.
+ */
+static unsigned int raidxor_unit_readable(disk_info_t *unit)
+{
+	return !raidxor_unit_faulty(unit) &&
+		test_bit(In_sync, &unit->rdev->flags);
+}
+
+/**
+ * raidxor_conf_recoverable() - checks if every unit can be read or
+ *                              decoded
+ *
+ * While raidxor_derive_work() runs, missing decodings are assumed to
+ * come.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_conf_recoverable(raidxor_conf_t *conf)
 {
 	unsigned int i;
 
-	CHECK_ARG_RET_NULL(rxbio);
-	CHECK_ARG_RET_NULL(unit);
+	if (test_bit(CONF_ERROR, &conf->flags))
+		return 0;
 
-	/* goes to the bdevs to find a matching bio */
-	for (i = 0; i < rxbio->n_bios; ++i)
-		if (rxbio->bios[i]->bi_bdev == unit->rdev->bdev)
-			return rxbio->bios[i];
-	return NULL;
+	for (i = 0; i < conf->n_units; ++i)
+		if (!raidxor_unit_readable(&conf->units[i]) &&
+		    !conf->units[i].decoding &&
+		    !test_bit(CONF_DERIVING, &conf->flags))
+			return 0;
+
+	return 1;
+}
+
+/**
+ * raidxor_cache_unpin_line() - makes a line an ordinary one again
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_unpin_line(cache_t *cache, cache_line_t *line)
+{
+	clear_bit(CACHE_LINE_SPARE, &line->flags);
+	if (test_and_clear_bit(CACHE_LINE_PINNED, &line->flags))
+		--cache->n_pinned;
+}
+
+/**
+ * raidxor_cache_pin_line() - keeps a line with decoded data in the cache
+ * @units: the units just decoded
+ *
+ * While the array is degraded, decoding costs the reads and XOR of the
+ * whole equation every time the line is loaded again, so such lines
+ * are evicted last, see raidxor_finish_lines().  At most
+ * degraded_cache_share percent of the lines are pinned; if that many
+ * already are, the one with the fewest hits makes way, if this line
+ * has more.  Units being rebuilt get their data right away, see
+ * raidxor_cache_spare_lines().
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_pin_line(cache_t *cache, cache_line_t *line,
+				   unsigned long *units)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *victim = NULL;
+	unsigned int i, budget, share, degraded = 0;
+
+	for (i = find_first_bit(units, conf->n_units); i < conf->n_units;
+	     i = find_next_bit(units, conf->n_units, i + 1)) {
+		if (raidxor_unit_readable(&conf->units[i]))
+			continue;
+
+		degraded = 1;
+		if (!raidxor_unit_faulty(&conf->units[i]))
+			set_bit(CACHE_LINE_SPARE, &line->flags);
+	}
+
+	/* repaired read errors only, the units are fine */
+	if (!degraded || test_bit(CACHE_LINE_PINNED, &line->flags))
+		return;
+
+	share = degraded_cache_share < 0 ? 0 : min(degraded_cache_share, 100);
+	budget = cache->n_lines * share / 100;
+
+	if (cache->n_pinned >= budget) {
+		for (i = 0; i < cache->n_lines; ++i)
+			if (test_bit(CACHE_LINE_PINNED,
+				     &cache->lines[i]->flags) &&
+			    (!victim || cache->lines[i]->hits < victim->hits))
+				victim = cache->lines[i];
+
+		if (!victim || victim->hits >= line->hits)
+			return;
+
+		raidxor_cache_unpin_line(cache, victim);
+	}
+
+	set_bit(CACHE_LINE_PINNED, &line->flags);
+	++cache->n_pinned;
+}
+
+/**
+ * raidxor_cache_spare_lines() - writes pinned lines to added spares
+ *
+ * Called when a spare took the place of a failed member.  The units
+ * decoded in pinned lines are written to it before md's rebuild gets
+ * there, see raidxor_cache_writeback_line().
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_cache_spare_lines(cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->n_lines; ++i) {
+		if (!test_bit(CACHE_LINE_PINNED, &cache->lines[i]->flags))
+			continue;
+
+		set_bit(CACHE_LINE_SPARE, &cache->lines[i]->flags);
+		raidxor_cache_queue_line(cache, i);
+	}
+}
+
+/**
+ * raidxor_unit_sector() - maps a line to the sector on a unit's device
+ *
+ * With interleaved units, the chunks of all units of a member for one
+ * strip are adjacent, so a line touches one contiguous region per
+ * member device.
+ */
+static sector_t raidxor_unit_sector(raidxor_conf_t *conf, disk_info_t *unit,
+				    sector_t sector)
+{
+	sector_t result = sector;
+
+	/* result = sector / conf->n_data_units */
+	do_div(result, conf->n_data_units);
+
+	if (conf->units_per_member > 1)
+		result = result * conf->units_per_member +
+			unit->slot * (conf->chunk_size >> 9);
+
+	if (unit->rdev)
+		result += unit->rdev->data_offset;
+
+	return result;
 }
 
 static int raidxor_find_enc_temps(raidxor_conf_t *conf, encoding_t *temp)
@@ -169,20 +828,6 @@ static int raidxor_find_dec_temps(raidxor_conf_t *conf, decoding_t *temp)
 	return 0;
 }
 
-static disk_info_t * raidxor_find_unit_conf_rdev(raidxor_conf_t *conf,
-						 mdk_rdev_t *rdev)
-{
-	unsigned int i;
-
-	CHECK_ARG_RET_NULL(conf);
-	CHECK_ARG_RET_NULL(rdev);
-
-	for (i = 0; i < conf->n_units; ++i)
-		if (conf->units[i].rdev == rdev)
-			return &conf->units[i];
-	return NULL;
-}
-
 static disk_info_t * raidxor_find_unit_decoding(decoding_t *decoding,
 						disk_info_t *unit)
 {
@@ -198,110 +843,431 @@ static disk_info_t * raidxor_find_unit_decoding(decoding_t *decoding,
 	return NULL;
 }
 
-static void clear_bio(struct bio *bio)
+/**
+ * raidxor_decoding_units() - collects the units a decoding reads
+ * @units: the units are added to this bitmap
+ * @temps: if not NULL, the decoding temporaries used are added here
+ *
+ * Temporaries are followed recursively.
+ */
+static void raidxor_decoding_units(raidxor_conf_t *conf,
+				   decoding_t *decoding,
+				   unsigned long *units, unsigned long *temps)
+{
+	unsigned int i;
+
+	for (i = 0; i < decoding->n_units; ++i) {
+		if (decoding->units[i].temporary) {
+			if (temps)
+				__set_bit(raidxor_find_dec_temps(conf,
+								 decoding->units[i].decoding),
+					  temps);
+			raidxor_decoding_units(conf,
+					       decoding->units[i].decoding,
+					       units, temps);
+		}
+		else
+			__set_bit(decoding->units[i].disk - conf->units, units);
+	}
+}
+
+/**
+ * raidxor_encoding_temps() - collects the temporaries an encoding uses
+ * @temps: the encoding temporaries are added to this bitmap
+ *
+ * Temporaries are followed recursively.
+ */
+static void raidxor_encoding_temps(raidxor_conf_t *conf,
+				   encoding_t *encoding, unsigned long *temps)
 {
 	unsigned int i;
 
-	CHECK_ARG_RET(bio);
+	for (i = 0; i < encoding->n_units; ++i) {
+		if (!encoding->units[i].temporary)
+			continue;
 
-	for (i = 0; i < bio->bi_vcnt; ++i)
-		bio->bi_io_vec[i].bv_page = NULL;
+		__set_bit(raidxor_find_enc_temps(conf,
+						 encoding->units[i].encoding),
+			  temps);
+		raidxor_encoding_temps(conf, encoding->units[i].encoding,
+				       temps);
+	}
+}
+
+/**
+ * raidxor_encoding_units() - collects the units an encoding reads
+ * @units: the units are added to this bitmap
+ *
+ * Temporaries are followed recursively.
+ */
+static void raidxor_encoding_units(raidxor_conf_t *conf,
+				   encoding_t *encoding, unsigned long *units)
+{
+	unsigned int i;
+
+	for (i = 0; i < encoding->n_units; ++i) {
+		if (encoding->units[i].temporary)
+			raidxor_encoding_units(conf,
+					       encoding->units[i].encoding,
+					       units);
+		else
+			__set_bit(encoding->units[i].disk - conf->units, units);
+	}
+}
+
+/**
+ * raidxor_unit_reencoded() - checks how a unit's data is repaired
+ *
+ * Redundant units are encoded again from the data units, others are
+ * decoded, see raidxor_cache_repairable().
+ */
+static unsigned int raidxor_unit_reencoded(disk_info_t *unit)
+{
+	return unit->redundant == 1 && unit->encoding;
+}
+
+/**
+ * raidxor_cache_unit_pages() - returns the buffers of a unit in a line
+ *
+ * The coding functions work on these directly, so units without a bio
+ * in the current transfer can still be used as input or target.
+ */
+static struct page ** raidxor_cache_unit_pages(cache_t *cache,
+					       unsigned int n_line,
+					       disk_info_t *unit)
+{
+	return &cache->lines[n_line]->buffers[unit->buffer *
+					      cache->n_chunk_mult];
+}
+
+/**
+ * raidxor_cache_start_bio() - takes the preallocated transfer of a line
+ */
+static raidxor_bio_t * raidxor_cache_start_bio(cache_t *cache,
+					       unsigned int n_line)
+{
+	raidxor_bio_t *rxbio;
+
+	CHECK_ARG_RET_NULL(cache);
+	CHECK_PLAIN_RET_NULL(n_line < cache->n_lines);
+
+	rxbio = cache->lines[n_line]->io;
+
+	rxbio->cache = cache;
+	rxbio->line = n_line;
+	rxbio->remaining = rxbio->n_bios;
+	rxbio->faulty = 0;
+	rxbio->master = NULL;
+
+	cache->lines[n_line]->rxbio = rxbio;
+
+	return rxbio;
+}
+
+/**
+ * raidxor_cache_prepare_bio() - sets up the preallocated bio for a unit
+ *
+ * Reinitialises the bio and points it at the unit's buffers in the
+ * line, so no allocation happens per transfer.
+ */
+static struct bio * raidxor_cache_prepare_bio(cache_t *cache,
+					      unsigned int n_line,
+					      unsigned int unit,
+					      unsigned long rw,
+					      bio_end_io_t *end_io)
+{
+	raidxor_conf_t *conf;
+	cache_line_t *line;
+	raidxor_unit_bio_t *ubio;
+	struct bio *bio;
+	unsigned int j, k;
+
+	CHECK_ARG_RET_NULL(cache);
+	CHECK_PLAIN_RET_NULL(n_line < cache->n_lines);
+
+	conf = cache->conf;
+	line = cache->lines[n_line];
+	bio = line->io->bios[unit];
+	ubio = container_of(bio, raidxor_unit_bio_t, bio);
+
+	bio_init(bio);
+	bio->bi_io_vec = ubio->vecs;
+	bio->bi_max_vecs = cache->n_chunk_mult;
+
+	bio->bi_rw = rw;
+	bio->bi_private = line->io;
+	/* removed units are skipped when the bios are committed */
+	bio->bi_bdev = conf->units[unit].rdev ?
+		conf->units[unit].rdev->bdev : NULL;
+	bio->bi_end_io = end_io;
+
+	bio->bi_sector = raidxor_unit_sector(conf, &conf->units[unit],
+					     line->sector);
+
+	/* only one chunk */
+	bio->bi_size = cache->n_chunk_mult * PAGE_SIZE;
+	bio->bi_vcnt = cache->n_chunk_mult;
+
+	/* assign pages */
+	for (j = 0; j < cache->n_chunk_mult; ++j) {
+		k = conf->units[unit].buffer * cache->n_chunk_mult + j;
+
+		CHECK_PLAIN_RET_NULL(line->buffers[k]);
+		bio->bi_io_vec[j].bv_page = line->buffers[k];
+		bio->bi_io_vec[j].bv_len = PAGE_SIZE;
+		bio->bi_io_vec[j].bv_offset = 0;
+	}
+
+	return bio;
+}
+
+static void raidxor_free_line_bio(raidxor_bio_t *rxbio)
+{
+	unsigned int i;
+
+	if (!rxbio)
+		return;
+
+	for (i = 0; i < rxbio->n_bios; ++i)
+		if (rxbio->bios[i])
+			kfree(container_of(rxbio->bios[i],
+					   raidxor_unit_bio_t, bio));
+	kfree(rxbio);
 }
 
 /**
- * free_bio() - puts all pages in a bio and the bio itself
+ * raidxor_alloc_line_bio() - allocates the transfer descriptor of a line
+ * @n_bios: number of units
+ * @n_chunk_mult: number of pages per chunk
+ * @node: NUMA node of the line
  */
-static void free_bio(struct bio *bio)
+static raidxor_bio_t * raidxor_alloc_line_bio(unsigned int n_bios,
+					      unsigned int n_chunk_mult,
+					      int node)
+{
+	raidxor_bio_t *result;
+	raidxor_unit_bio_t *ubio;
+	unsigned int i;
+
+	CHECK_PLAIN_RET_NULL(n_bios);
+
+	result = kzalloc_node(sizeof(raidxor_bio_t) +
+			      sizeof(struct bio *) * n_bios,
+			      GFP_NOIO, node);
+	CHECK_ALLOC_RET_NULL(result);
+
+	result->n_bios = n_bios;
+
+	for (i = 0; i < n_bios; ++i) {
+		ubio = kzalloc_node(sizeof(raidxor_unit_bio_t) +
+				    sizeof(struct bio_vec) * n_chunk_mult,
+				    GFP_NOIO, node);
+		if (!ubio)
+			goto out_free;
+
+		ubio->unit = i;
+		result->bios[i] = &ubio->bio;
+	}
+
+	return result;
+out_free:
+	raidxor_free_line_bio(result);
+	return NULL;
+}
+
+static void raidxor_cache_line_free_temps(cache_t *cache, unsigned int line)
+{
+	unsigned int i;
+
+	CHECK_ARG_RET(cache);
+	CHECK_PLAIN_RET(line < cache->n_lines);
+
+	if (!cache->lines[line]->temp_buffers)
+		return;
+
+	for (i = 0; i < max(cache->conf->n_enc_temps, cache->conf->n_dec_temps) * cache->n_chunk_mult; ++i) {
+		safe_put_page(cache->lines[line]->temp_buffers[i]);
+		cache->lines[line]->temp_buffers[i] = NULL;
+	}
+
+	kfree(cache->lines[line]->temp_buffers);
+	cache->lines[line]->temp_buffers = NULL;
+}
+
+static void raidxor_cache_free_temps(cache_t *cache)
 {
 	unsigned int i;
 
-	CHECK_ARG_RET(bio);
+	CHECK_ARG_RET(cache);
+
+	for (i = 0; i < cache->n_lines; ++i)
+		raidxor_cache_line_free_temps(cache, i);
+}
+
+/**
+ * raidxor_nth_online_node() - maps a number to an online NUMA node
+ *
+ * Used to spread lines and workers round-robin over all nodes.
+ */
+static int raidxor_nth_online_node(unsigned int n)
+{
+	int node;
+
+	n %= num_online_nodes();
+
+	for_each_online_node(node)
+		if (n-- == 0)
+			return node;
 
-	for (i = 0; i < bio->bi_vcnt; ++i)
-		safe_put_page(bio->bi_io_vec[i].bv_page);
-	bio_put(bio);
+	return numa_node_id();
 }
 
 /**
- * clear_bios() - 
+ * raidxor_cache_get_page() - takes a page from the pool of a node
+ *
+ * Must be called inside conf lock.
  */
-static void clear_bios(raidxor_bio_t *rxbio)
+static struct page * raidxor_cache_get_page(cache_t *cache, int node)
 {
-	unsigned int i;
+	raidxor_page_pool_t *pool;
+
+	CHECK_ARG_RET_NULL(cache);
 
-	CHECK_ARG_RET(rxbio);
+	pool = &cache->pools[node];
 
-	for (i = 0; i < rxbio->n_bios; ++i)
-		if (rxbio->bios[i]) clear_bio(rxbio->bios[i]);
+	if (pool->n_free_pages == 0)
+		return NULL;
+
+	return pool->pages[--pool->n_free_pages];
 }
 
 /**
- * free_bios() - puts all bios (and their pages) in a raidxor_bio_t
+ * raidxor_cache_put_page() - returns a page to the pool of a node
+ *
+ * Must be called inside conf lock.
  */
-static void free_bios(raidxor_bio_t *rxbio)
+static void raidxor_cache_put_page(cache_t *cache, int node,
+				   struct page *page)
 {
-	unsigned int i;
+	raidxor_page_pool_t *pool;
 
-	CHECK_ARG_RET(rxbio);
+	CHECK_ARG_RET(cache);
 
-	for (i = 0; i < rxbio->n_bios; ++i)
-		if (rxbio->bios[i]) {
-			free_bio(rxbio->bios[i]);
-			rxbio->bios[i] = NULL;
-		}
+	if (!page)
+		return;
+
+	pool = &cache->pools[node];
+
+	CHECK_PLAIN_RET(pool->n_free_pages < pool->n_pages);
+	pool->pages[pool->n_free_pages++] = page;
 }
 
-static raidxor_bio_t * raidxor_alloc_bio(unsigned int nbios)
+/**
+ * raidxor_cache_fill_pool() - reserves the pages of a node
+ *
+ * Allocates pages for all buffers of the lines on this node up front.
+ * With cache_chunk_pages set, whole chunks are allocated at once and
+ * split afterwards, so the pages of a chunk are physically contiguous.
+ */
+static int raidxor_cache_fill_pool(cache_t *cache, int node)
 {
-	raidxor_bio_t *result;
+	raidxor_page_pool_t *pool = &cache->pools[node];
+	unsigned int i, order = 0;
+	struct page *page;
 
-	CHECK_PLAIN_RET_NULL(nbios);
+	CHECK_ARG_RET_VAL(cache);
 
-	result = kzalloc(sizeof(raidxor_bio_t) +
-			 sizeof(struct bio *) * nbios,
-			 GFP_NOIO);
-	CHECK_ALLOC_RET_NULL(result);
+	if (cache_chunk_pages)
+		order = get_order(cache->n_chunk_mult << PAGE_SHIFT);
+
+	while (pool->n_free_pages < pool->n_pages) {
+		if (order > 0 &&
+		    (page = alloc_pages_node(node, GFP_KERNEL | __GFP_NOWARN,
+					     order))) {
+			split_page(page, order);
+			for (i = 0; i < (1 << order); ++i) {
+				if (pool->n_free_pages < pool->n_pages)
+					pool->pages[pool->n_free_pages++] = page + i;
+				else __free_page(page + i);
+			}
+			continue;
+		}
 
-	result->n_bios = nbios;
-	return result;
-}
+		/* fall back to single pages if there's no contiguous memory */
+		order = 0;
+		if (!(page = alloc_pages_node(node, GFP_KERNEL, 0)))
+			return 1;
+		pool->pages[pool->n_free_pages++] = page;
+	}
 
-static void raidxor_free_bio(raidxor_bio_t *rxbio)
-{
-	clear_bios(rxbio);
-	free_bios(rxbio);
-	kfree(rxbio);
+	return 0;
 }
 
-static void raidxor_cache_line_free_temps(cache_t *cache, unsigned int line)
+static void raidxor_cache_free_pools(cache_t *cache)
 {
-	unsigned int i;
+	raidxor_page_pool_t *pool;
+	int node;
 
 	CHECK_ARG_RET(cache);
-	CHECK_PLAIN_RET(line < cache->n_lines);
 
-	if (!cache->lines[line]->temp_buffers)
+	if (!cache->pools)
 		return;
 
-	for (i = 0; i < max(cache->conf->n_enc_temps, cache->conf->n_dec_temps) * cache->n_chunk_mult; ++i) {
-		safe_put_page(cache->lines[line]->temp_buffers[i]);
-		cache->lines[line]->temp_buffers[i] = NULL;
+	for (node = 0; node < nr_node_ids; ++node) {
+		pool = &cache->pools[node];
+		while (pool->n_free_pages > 0)
+			__free_page(pool->pages[--pool->n_free_pages]);
+		kfree(pool->pages);
 	}
 
-	kfree(cache->lines[line]->temp_buffers);
-	cache->lines[line]->temp_buffers = NULL;
+	kfree(cache->pools);
+	cache->pools = NULL;
 }
 
-static void raidxor_cache_free_temps(cache_t *cache)
+/**
+ * raidxor_cache_alloc_pools() - reserves the pages of all lines
+ *
+ * Each line draws its buffers from the pool of its own node.
+ */
+static int raidxor_cache_alloc_pools(cache_t *cache, unsigned int n_lines,
+				     unsigned int line_pages)
 {
+	raidxor_page_pool_t *pool;
 	unsigned int i;
+	int node;
 
-	CHECK_ARG_RET(cache);
+	CHECK_ARG_RET_VAL(cache);
 
-	for (i = 0; i < cache->n_lines; ++i)
-		raidxor_cache_line_free_temps(cache, i);
+	cache->pools = kzalloc(sizeof(raidxor_page_pool_t) * nr_node_ids,
+			       GFP_KERNEL);
+	if (!cache->pools)
+		return 1;
+
+	for (i = 0; i < n_lines; ++i)
+		cache->pools[cache->lines[i]->node].n_pages += line_pages;
+
+	for (node = 0; node < nr_node_ids; ++node) {
+		pool = &cache->pools[node];
+		if (pool->n_pages == 0)
+			continue;
+
+		pool->pages = kzalloc_node(sizeof(struct page *) *
+					   pool->n_pages, GFP_KERNEL, node);
+		if (!pool->pages || raidxor_cache_fill_pool(cache, node))
+			goto out_free_pools;
+	}
+
+	return 0;
+out_free_pools:
+	raidxor_cache_free_pools(cache);
+	return 1;
 }
 
+/**
+ * raidxor_cache_drop_line() - returns the buffers of a line to the pool
+ *
+ * Temporary buffers stay with the line.  Must be called inside conf lock.
+ */
 static void raidxor_cache_drop_line(cache_t *cache, unsigned int line)
 {
 	unsigned int i;
@@ -309,12 +1275,13 @@ static void raidxor_cache_drop_line(cache_t *cache, unsigned int line)
 	CHECK_ARG_RET(cache);
 	CHECK_PLAIN_RET(line < cache->n_lines);
 
+	raidxor_cache_line_end_write(cache, cache->lines[line]);
+
 	for (i = 0; i < (cache->n_buffers + cache->n_red_buffers) * cache->n_chunk_mult; ++i) {
-		safe_put_page(cache->lines[line]->buffers[i]);
+		raidxor_cache_put_page(cache, cache->lines[line]->node,
+				       cache->lines[line]->buffers[i]);
 		cache->lines[line]->buffers[i] = NULL;
 	}
-
-	raidxor_cache_line_free_temps(cache, line);
 }
 
 /**
@@ -328,28 +1295,57 @@ static void raidxor_cache_drop_line(cache_t *cache, unsigned int line)
 static cache_t * raidxor_alloc_cache(unsigned int n_lines,
 				     unsigned int n_buffers,
 				     unsigned int n_red_buffers,
-				     unsigned int n_chunk_mult)
+				     unsigned int n_chunk_mult,
+				     unsigned int n_queues)
 {
 	unsigned int i;
+	int node;
 	cache_t *cache;
 
 	CHECK_PLAIN_RET_NULL(n_lines != 0);
 	CHECK_PLAIN_RET_NULL(n_buffers != 0);
 	CHECK_PLAIN_RET_NULL(n_chunk_mult != 0);
+	CHECK_PLAIN_RET_NULL(n_queues != 0);
 
 	cache = kzalloc(sizeof(cache_t) + sizeof(cache_line_t *) * n_lines,
 			GFP_NOIO);
 	CHECK_ALLOC_RET_NULL(cache);
 
+	cache->n_pages = n_lines * (n_buffers + n_red_buffers) * n_chunk_mult;
+
+	cache->n_queues = n_queues;
+	cache->work = kzalloc(sizeof(struct list_head) * n_queues *
+			      CACHE_WORK_LISTS, GFP_KERNEL);
+	if (!cache->work)
+		goto out_free_cache;
+
 	for (i = 0; i < n_lines; ++i) {
-		cache->lines[i] = kzalloc(sizeof(cache_line_t) +
-					  sizeof(struct page *) *
-					  (n_buffers + n_red_buffers) *
-					  n_chunk_mult,
-					  GFP_NOIO);
+		/* spread lines over the nodes, everything of a line lives
+		   on its node; who submits to a strip isn't known yet, so
+		   every node gets its share and raidxor_cache_find_line()
+		   picks a local one when a line is reassigned */
+		node = raidxor_nth_online_node(i);
+
+		cache->lines[i] = kzalloc_node(sizeof(cache_line_t) +
+					       sizeof(struct page *) *
+					       (n_buffers + n_red_buffers) *
+					       n_chunk_mult,
+					       GFP_NOIO, node);
 		if (!cache->lines[i])
 			goto out_free_lines;
 		cache->lines[i]->status = CACHE_LINE_CLEAN;
+		cache->lines[i]->cache = cache;
+		cache->lines[i]->index = i;
+		cache->lines[i]->node = node;
+		INIT_LIST_HEAD(&cache->lines[i]->work);
+		INIT_WORK(&cache->lines[i]->serve_work, raidxor_serve_line);
+
+		cache->lines[i]->io = raidxor_alloc_line_bio(n_buffers +
+							     n_red_buffers,
+							     n_chunk_mult,
+							     node);
+		if (!cache->lines[i]->io)
+			goto out_free_lines;
 	}
 
 	cache->n_lines = n_lines;
@@ -360,11 +1356,27 @@ static cache_t * raidxor_alloc_cache(unsigned int n_lines,
 
 	init_waitqueue_head(&cache->wait_for_line);
 
+	for (i = 0; i < n_queues * CACHE_WORK_LISTS; ++i)
+		INIT_LIST_HEAD(&cache->work[i]);
+
+	if (raidxor_cache_alloc_pools(cache, n_lines,
+				      (n_buffers + n_red_buffers) *
+				      n_chunk_mult)) {
+		printk(KERN_INFO "raidxor: couldn't reserve %u pages for the cache\n",
+		       cache->n_pages);
+		goto out_free_lines;
+	}
+
 	return cache;
 
 out_free_lines:
-	for (i = 0; i < cache->n_lines; ++i)
-		if (cache->lines[i]) kfree(cache->lines[i]);
+	for (i = 0; i < n_lines; ++i)
+		if (cache->lines[i]) {
+			raidxor_free_line_bio(cache->lines[i]->io);
+			kfree(cache->lines[i]);
+		}
+	kfree(cache->work);
+out_free_cache:
 	kfree(cache);
 	return NULL;
 }
@@ -390,7 +1402,8 @@ static int raidxor_cache_line_ensure_temps(cache_t *cache, unsigned int line)
 		goto out;
 
 	for (i = 0; i < to; ++i) {
-		if (!(cache->lines[line]->temp_buffers[i] = alloc_page(GFP_NOIO))) {
+		if (!(cache->lines[line]->temp_buffers[i] =
+		      alloc_pages_node(cache->lines[line]->node, GFP_NOIO, 0))) {
 			printk(KERN_INFO "page allocation failed for line %u\n", line);
 			goto out_free_pages;
 		}
@@ -413,18 +1426,201 @@ static void raidxor_free_cache(cache_t *cache)
 
 	for (i = 0; i < cache->n_lines; ++i) {
 		raidxor_cache_drop_line(cache, i);
+		raidxor_cache_line_free_temps(cache, i);
+		raidxor_free_line_bio(cache->lines[i]->io);
 		kfree(cache->lines[i]);
 	}
 
+	raidxor_cache_free_pools(cache);
+	kfree(cache->work);
 	kfree(cache);
 }
 
+/**
+ * raidxor_cache_fail_requests() - ends requests chained by bi_next with
+ *                                 an error
+ */
+static void raidxor_cache_fail_requests(raidxor_conf_t *conf, struct bio *bio)
+{
+	struct bio *next;
+
+	for (; bio; bio = next) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+		if (bio_data_dir(bio) == WRITE)
+			md_write_end(conf->mddev);
+		bio_io_error(bio);
+	}
+}
+
+/**
+ * raidxor_cache_abort_requests() - fails the waiting requests of a line
+ *
+ * Has to be called without conf->device_lock held.
+ */
 static void raidxor_cache_abort_requests(cache_t *cache, unsigned int line)
 {
+	unsigned long flags = 0;
 	struct bio *bio;
 
-	while ((bio = raidxor_cache_remove_request(cache, line)))
-		bio_io_error(bio);
+	WITHLOCKCONF(cache->conf, flags, {
+	bio = raidxor_cache_take_requests(cache, line);
+	});
+
+	raidxor_cache_fail_requests(cache->conf, bio);
+}
+
+/**
+ * raidxor_cache_lose_line() - gives up on the wanted units of a line
+ *
+ * What's valid is kept.  Returns the waiting requests, which the
+ * caller fails with raidxor_cache_fail_requests() after unlocking.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_cache_lose_line(cache_t *cache,
+					    unsigned int n_line)
+{
+	cache_line_t *line = cache->lines[n_line];
+	struct bio *bio;
+
+	bio = raidxor_cache_take_requests(cache, n_line);
+	bitmap_copy(line->want, line->valid, cache->conf->n_units);
+	line->status = bitmap_empty(line->valid, cache->conf->n_units) ?
+		CACHE_LINE_READY : CACHE_LINE_UPTODATE;
+	raidxor_cache_end_resync(cache, n_line, 0);
+
+	return bio;
+}
+
+/**
+ * raidxor_cache_lose_units() - gives up on the units a line can't load
+ *
+ * These are the units which are neither valid, nor readable, nor have
+ * a decoding, see raidxor_cache_plan_load().  Only the requests which
+ * need one of them are returned, for the caller to fail them with
+ * raidxor_cache_fail_requests() after unlocking.  The others stay and
+ * the line is queued to load again what they want.  A resync of the
+ * line fails.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static struct bio * raidxor_cache_lose_units(cache_t *cache,
+					     unsigned int n_line)
+{
+	raidxor_conf_t *conf = cache->conf;
+	cache_line_t *line = cache->lines[n_line];
+	struct bio *bio, *next, *lost = NULL, **tail = &lost;
+	unsigned int i, n = conf->n_units;
+	DECLARE_BITMAP(missing, RAIDXOR_MAX_UNITS);
+	DECLARE_BITMAP(units, RAIDXOR_MAX_UNITS);
+
+	bitmap_zero(missing, n);
+	for (i = 0; i < n; ++i)
+		if (!test_bit(i, line->valid) &&
+		    !raidxor_unit_readable(&conf->units[i]) &&
+		    !conf->units[i].decoding)
+			__set_bit(i, missing);
+
+	bio = raidxor_cache_take_requests(cache, n_line);
+	bitmap_copy(line->want, line->valid, n);
+
+	/* in FIFO order, so adding them again keeps it */
+	for (; bio; bio = next) {
+		next = bio->bi_next;
+
+		bitmap_zero(units, n);
+		raidxor_cache_bio_units(cache, bio, units);
+		if (bitmap_intersects(units, missing, n)) {
+			bio->bi_next = NULL;
+			*tail = bio;
+			tail = &bio->bi_next;
+			continue;
+		}
+
+		bitmap_or(line->want, line->want, units, n);
+		raidxor_cache_add_request(cache, n_line, bio);
+	}
+
+	raidxor_cache_end_resync(cache, n_line, 0);
+
+	if (line->waiting) {
+		line->status = bitmap_empty(line->valid, n) ?
+			CACHE_LINE_LOAD_ME : CACHE_LINE_UPTODATE;
+		raidxor_cache_queue_line(cache, n_line);
+	}
+	else
+		line->status = bitmap_empty(line->valid, n) ?
+			CACHE_LINE_READY : CACHE_LINE_UPTODATE;
+
+	return lost;
+}
+
+/**
+ * raidxor_cache_unpark_lines() - loads parked lines again
+ *
+ * A load which needs a failed unit before raidxor_derive_work() gave
+ * it a decoding is parked by raidxor_cache_load_line(): the line stays
+ * LOADING with its requests, but without a transfer.  Once the
+ * decodings are there, the line is planned anew, and its requests only
+ * fail if the unit really can't be recovered.  Returns 1 if a line was
+ * queued.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_unpark_lines(cache_t *cache)
+{
+	cache_line_t *line;
+	unsigned int i, queued = 0;
+
+	for (i = 0; i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+		if (!test_and_clear_bit(CACHE_LINE_PARKED, &line->flags))
+			continue;
+
+		line->status = bitmap_empty(line->valid, cache->conf->n_units) ?
+			CACHE_LINE_LOAD_ME : CACHE_LINE_UPTODATE;
+		if (raidxor_cache_queue_line(cache, i))
+			queued = 1;
+	}
+
+	return queued;
+}
+
+/**
+ * raidxor_cache_fail_parked() - fails the requests of parked lines
+ *
+ * Parked lines count as idle, see raidxor_conf_idle(), so they may
+ * still be there when the cache is freed.  Has to be called without
+ * conf->device_lock held.
+ */
+static void raidxor_cache_fail_parked(raidxor_conf_t *conf)
+{
+	cache_t *cache = conf->cache;
+	struct bio *bio, *tail, *lost = NULL;
+	unsigned long flags = 0;
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	WITHLOCKCONF(conf, flags, {
+	for (i = 0; i < cache->n_lines; ++i) {
+		if (!test_and_clear_bit(CACHE_LINE_PARKED,
+					&cache->lines[i]->flags))
+			continue;
+
+		bio = raidxor_cache_lose_line(cache, i);
+		for (tail = bio; tail && tail->bi_next; tail = tail->bi_next)
+			;
+		if (tail) {
+			tail->bi_next = lost;
+			lost = bio;
+		}
+	}
+	});
+
+	raidxor_cache_fail_requests(conf, lost);
 }
 
 static void raidxor_safe_free_decoding(disk_info_t *unit)
@@ -550,11 +1746,11 @@ static int raidxor_ensure_dec_temps(raidxor_conf_t *conf,
 
 	raidxor_safe_free_dec_temps(conf);
 
+	conf->n_dec_temps = ntemps;
+
 	if (ntemps == 0)
 		return 0;
 
-	conf->n_dec_temps = ntemps;
-
 	return raidxor_alloc_dec_temps(conf);
 }
 
@@ -573,6 +1769,9 @@ static int raidxor_cache_ensure_temps(raidxor_conf_t *conf, unsigned int n_enc_t
 	raidxor_ensure_dec_temps(conf, n_dec_temps);
 	raidxor_ensure_enc_temps(conf, n_enc_temps);
 
+	/* its temporaries are sized for the old equations */
+	raidxor_free_scrub(conf);
+
 	if (!conf->cache)
 		return 0;
 
@@ -595,7 +1794,7 @@ out: __attribute((unused))
  *
  * Must be called inside conf lock.
  */
-static void raidxor_safe_free_conf(raidxor_conf_t *conf)
+static void raidxor_safe_free_resources(raidxor_conf_t *conf)
 {
 	unsigned int i;
 
@@ -609,6 +1808,41 @@ static void raidxor_safe_free_conf(raidxor_conf_t *conf)
 		kfree(conf->resources);
 		conf->resources = NULL;
 	}
+}
+
+/**
+ * raidxor_free_scrub() - frees the private line of the scrub
+ *
+ * Must not be called while a scrub runs, it's allocated again on the
+ * next one.
+ */
+static void raidxor_free_scrub(raidxor_conf_t *conf)
+{
+	raidxor_scrub_t *scrub = conf->scrub;
+	unsigned int i;
+
+	if (!scrub)
+		return;
+
+	conf->scrub = NULL;
+
+	if (scrub->expected) {
+		for (i = 0; i < scrub->cache->n_chunk_mult; ++i)
+			if (scrub->expected[i])
+				__free_page(scrub->expected[i]);
+		kfree(scrub->expected);
+	}
+
+	raidxor_free_cache(scrub->cache);
+	kfree(scrub);
+}
+
+static void raidxor_safe_free_conf(raidxor_conf_t *conf)
+{
+	CHECK_ARG_RET(conf);
+
+	raidxor_safe_free_resources(conf);
+	raidxor_free_scrub(conf);
 
 	if (conf->cache != NULL) {
 		raidxor_free_cache(conf->cache);
@@ -715,30 +1949,6 @@ static void raidxor_copy_bio_from_cache(cache_t *cache, unsigned int n_line,
 	}
 }
 
-static void raidxor_copy_bio(struct bio *bioto, struct bio *biofrom)
-{
-	unsigned int i;
-	unsigned char *tomapped, *frommapped;
-	unsigned char *toptr, *fromptr;
-	struct bio_vec *bvto, *bvfrom;
-
-	for (i = 0; i < bioto->bi_vcnt; ++i) {
-		bvto = bio_iovec_idx(bioto, i);
-		bvfrom = bio_iovec_idx(biofrom, i);
-
-		tomapped = (unsigned char *) kmap(bvto->bv_page);
-		frommapped = (unsigned char *) kmap(bvfrom->bv_page);
-
-		toptr = tomapped + bvto->bv_offset;
-		fromptr = frommapped + bvfrom->bv_offset;
-
-		memmove(toptr, fromptr, min(bvto->bv_len, bvfrom->bv_len));
-
-		kunmap(bvfrom->bv_page);
-		kunmap(bvto->bv_page);
-	}
-}
-
 static void raidxor_copy_pages_to_bio(struct bio *bioto, struct page **pages)
 {
 	unsigned int i;
@@ -758,25 +1968,6 @@ static void raidxor_copy_pages_to_bio(struct bio *bioto, struct page **pages)
 	}
 }
 
-static void raidxor_copy_bio_to_pages(struct page **pages, struct bio *biofrom)
-{
-	unsigned int i;
-	unsigned char *tomapped, *frommapped;
-	struct bio_vec *bvfrom;
-
-	for (i = 0; i < biofrom->bi_vcnt; ++i) {
-		bvfrom = bio_iovec_idx(biofrom, i);
-
-		tomapped = (unsigned char *) kmap(pages[i]);
-		frommapped = (unsigned char *) kmap(bvfrom->bv_page) + bvfrom->bv_offset;
-
-		memmove(tomapped, frommapped, bvfrom->bv_len);
-
-		kunmap(pages[i]);
-		kunmap(bvfrom->bv_page);
-	}
-}
-
 static void raidxor_copy_pages(unsigned int length, struct page **to, struct page **from)
 {
 	unsigned int i;
@@ -793,9 +1984,22 @@ static void raidxor_copy_pages(unsigned int length, struct page **to, struct pag
 	}
 }
 
+/**
+ * raidxor_cache_line_free() - checks if a line may get another strip
+ */
+static unsigned int raidxor_cache_line_free(cache_line_t *line)
+{
+	return line->status == CACHE_LINE_CLEAN ||
+		(line->status == CACHE_LINE_READY && !line->waiting);
+}
+
 /**
  * raidxor_cache_find_line() - finds a matching or otherwise available line
  *
+ * A free line on the node of the submitter is preferred, so its buffers
+ * are local to the copies of the request.  Only if there's none, a free
+ * line on another node is taken.
+ *
  * Returns 1 if we've found a line, else 0.
  */
 static int raidxor_cache_find_line(cache_t *cache, sector_t sector,
@@ -804,6 +2008,7 @@ static int raidxor_cache_find_line(cache_t *cache, sector_t sector,
 #undef CHECK_RETURN_VALUE
 #define CHECK_RETURN_VALUE 0
 	unsigned int i;
+	int other = -1, node = numa_node_id();
 
 	CHECK_ARG_RET_VAL(cache);
 
@@ -815,17 +2020,23 @@ static int raidxor_cache_find_line(cache_t *cache, sector_t sector,
 		}
 	}
 
-	/* find lines to reassign */
+	/* find lines to reassign, preferably on the node of the
+	   submitter */
 	for (i = 0; i < cache->n_lines; ++i) {
-		if (cache->lines[i]->status == CACHE_LINE_CLEAN) {
-			if (line) *line = i;
-			return 1;
-		}
-		else if (cache->lines[i]->status == CACHE_LINE_READY &&
-			 !cache->lines[i]->waiting) {
+		if (!raidxor_cache_line_free(cache->lines[i]))
+			continue;
+
+		if (cache->lines[i]->node == node) {
 			if (line) *line = i;
 			return 1;
 		}
+
+		if (other < 0) other = i;
+	}
+
+	if (other >= 0) {
+		if (line) *line = other;
+		return 1;
 	}
 
 	return 0;
@@ -856,9 +2067,16 @@ static unsigned int raidxor_cache_empty_lines(cache_t *cache)
  */
 static void raidxor_wakeup_thread(raidxor_conf_t *conf)
 {
+	unsigned int i;
+
 	CHECK_ARG_RET(conf);
 
 	md_wakeup_thread(conf->mddev->thread);
+
+	/* the other workers only if lines were queued for them */
+	for (i = 1; i < conf->n_workers; ++i)
+		if (test_bit(0, &conf->workers[i].pending))
+			wake_up(&conf->workers[i].wait);
 }
 
 #define __wait_event_lock_irqsave(wq, condition, lock, flags, cmd) 	\
@@ -925,6 +2143,117 @@ static void raidxor_wait_for_empty_line(raidxor_conf_t *conf, unsigned long *fla
 	--conf->cache->n_waiting;
 }
 
+/**
+ * raidxor_wake_quiesce() - lets a running quiesce check for idleness again
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static void raidxor_wake_quiesce(raidxor_conf_t *conf)
+{
+	if (conf->quiesced)
+		wake_up_all(&conf->wait_for_quiesce);
+}
+
+/**
+ * raidxor_conf_idle() - checks if no request or line is in progress
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_conf_idle(raidxor_conf_t *conf)
+{
+	cache_t *cache = conf->cache;
+	cache_line_t *line;
+	unsigned int i;
+
+	if (conf->n_submitting > 0 ||
+	    test_bit(CONF_DISCARDING, &conf->flags))
+		return 0;
+
+	if (!cache)
+		return 1;
+
+	if (cache->active_lines > 0)
+		return 0;
+
+	for (i = 0; i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+
+		/* nothing in flight, see raidxor_cache_unpark_lines() */
+		if (test_bit(CACHE_LINE_PARKED, &line->flags))
+			continue;
+
+		if (line->waiting || line->syncing ||
+		    test_bit(CACHE_LINE_BUSY, &line->flags) ||
+		    test_bit(CACHE_LINE_RESYNC, &line->flags) ||
+		    !list_empty(&line->work))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * raidxor_cache_strip_idle() - checks whether a strip may be scrubbed
+ *
+ * A strip is idle if no line holds data of it which differs from the
+ * disks or is being transferred, and no line is about to take it.
+ *
+ * Needs to be called with conf->device_lock held.
+ */
+static unsigned int raidxor_cache_strip_idle(cache_t *cache, sector_t sector)
+{
+	cache_line_t *line;
+	unsigned int i;
+
+	for (i = 0; i < cache->n_lines; ++i) {
+		line = cache->lines[i];
+
+		if (line->status == CACHE_LINE_READYING)
+			return 0;
+
+		if (line->sector != sector ||
+		    line->status == CACHE_LINE_CLEAN ||
+		    line->status == CACHE_LINE_READY)
+			continue;
+
+		if (line->status != CACHE_LINE_UPTODATE ||
+		    line->waiting || line->syncing ||
+		    test_bit(CACHE_LINE_BUSY, &line->flags) ||
+		    test_bit(CACHE_LINE_RESYNC, &line->flags) ||
+		    !list_empty(&line->work))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * raidxor_enter_request() - waits until the array isn't quiesced
+ *
+ * Every request passes here, see raidxor_quiesce().
+ */
+static void raidxor_enter_request(raidxor_conf_t *conf)
+{
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	wait_event_lock_irqsave(conf->wait_for_quiesce,
+				conf->quiesced == 0,
+				conf->device_lock, flags, /* nothing */);
+	++conf->n_submitting;
+	});
+}
+
+static void raidxor_exit_request(raidxor_conf_t *conf)
+{
+	unsigned long flags = 0;
+
+	WITHLOCKCONF(conf, flags, {
+	--conf->n_submitting;
+	raidxor_wake_quiesce(conf);
+	});
+}
+
 static void raidxor_wait_for_writeback(raidxor_conf_t *conf, unsigned long *flags)
 {
 	CHECK_ARG_RET(conf);